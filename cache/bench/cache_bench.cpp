@@ -0,0 +1,113 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+// Multithreaded benchmark of the builtin caches: every thread looks up and
+// releases keys drawn from a small hot set, as faiss search threads of
+// concurrent queries do, and inserts one now and then.  Prints the lookup
+// throughput of every policy for a growing number of threads.
+//
+// usage: cache_bench [max_threads] [hot_keys] [ops_per_thread] [insert_per_mille] [num_shard_bits]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cache.h"
+
+namespace {
+
+void Deleter(const char* key, size_t keylen, void* value) {
+  (void)key;
+  (void)keylen;
+  (void)value;
+}
+
+struct Policy {
+  const char* name;
+  Cache* (*create)(size_t capacity, int num_shard_bits);
+};
+
+double Run(Cache* cache, int threads, int hot_keys, long ops,
+           int insert_per_mille) {
+  std::vector<std::string> keys;
+  for (int i = 0; i < hot_keys; i++) {
+    keys.push_back("index_" + std::to_string(i));
+    cache->Release(cache->Insert(keys.back(), nullptr, 1, Deleter));
+  }
+
+  std::atomic<bool> go(false);
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      std::mt19937 rng(t);
+      while (!go.load(std::memory_order_acquire)) {
+      }
+      for (long i = 0; i < ops; i++) {
+        const std::string& key = keys[rng() % keys.size()];
+        if (static_cast<int>(rng() % 1000) < insert_per_mille) {
+          cache->Release(cache->Insert(key, nullptr, 1, Deleter));
+          continue;
+        }
+        Cache::Handle* handle = cache->Lookup(key);
+        if (handle != nullptr) {
+          cache->Release(handle);
+        }
+      }
+    });
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  return threads * ops / seconds;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const int max_threads = argc > 1 ? atoi(argv[1]) : 16;
+  const int hot_keys = argc > 2 ? atoi(argv[2]) : 8;
+  const long ops = argc > 3 ? atol(argv[3]) : 1000000;
+  const int insert_per_mille = argc > 4 ? atoi(argv[4]) : 1;
+  const int num_shard_bits = argc > 5 ? atoi(argv[5]) : kDefaultNumShardBits;
+
+  const Policy policies[] = {
+      {"lru", [](size_t c, int b) { return NewLRUCache(c, b); }},
+      {"slru", [](size_t c, int b) { return NewSLRUCache(c, b); }},
+      {"clock", [](size_t c, int b) { return NewClockCache(c, b); }},
+  };
+
+  printf("%d hot keys, %ld ops/thread, %d/1000 inserts, %d shards\n", hot_keys,
+         ops, insert_per_mille, 1 << num_shard_bits);
+  printf("%8s", "threads");
+  for (const Policy& policy : policies) {
+    printf(" %14s", policy.name);
+  }
+  printf("   (Mops/s)\n");
+
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    printf("%8d", threads);
+    for (const Policy& policy : policies) {
+      Cache* cache = policy.create(1 << 20, num_shard_bits);
+      printf(" %14.2f",
+             Run(cache, threads, hot_keys, ops, insert_per_mille) / 1e6);
+      fflush(stdout);
+      delete cache;
+    }
+    printf("\n");
+  }
+  return 0;
+}
@@ -4,7 +4,16 @@
 
 #include "cache.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <initializer_list>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 using MutexLock = std::lock_guard<std::mutex>;
 
 #define EXCLUSIVE_LOCKS_REQUIRED(x)
@@ -61,8 +70,55 @@ static inline uint32_t Hash(const char* data, size_t n, uint32_t seed) {
   return h;
 }
 
+static inline int64_t NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
 Cache::~Cache() {}
 
+// The capacity of a sharded cache is shared by its shards rather than split
+// evenly between them: an entry may take room anywhere in the cache, and the
+// shards evict for each other (see ShardedCache::EnforceCapacity()).  Each
+// shard accounts its own entries in the shared usage under its own lock.
+struct CapacityBudget {
+  std::atomic<size_t> capacity{0};
+  std::atomic<size_t> usage{0};            // Combined charge of the shards.
+  std::atomic<size_t> protected_usage{0};  // Of the SLRU protected segments.
+  std::atomic<double> admission_ratio{1.0};
+
+  // Whether an entry is cached at all.  An entry charged more than
+  // admission_ratio of the capacity would push many others out for a single
+  // key, it is handed to its caller uncached instead, unless pinned.
+  // (capacity==0 is supported and turns off caching.)
+  bool Admits(size_t charge, Cache::Priority priority) const {
+    const size_t cap = capacity.load(std::memory_order_relaxed);
+    if (cap == 0) {
+      return false;
+    }
+    return priority == Cache::Priority::kPinned ||
+           charge <= cap * admission_ratio.load(std::memory_order_relaxed);
+  }
+
+  bool Exceeded() const {
+    return usage.load(std::memory_order_relaxed) >
+           capacity.load(std::memory_order_relaxed);
+  }
+};
+
+// The entry a shard would evict next, as compared across the shards.
+struct Victim {
+  int rank;  // Lists are evicted in order: probation (or kLow), protected,
+             // kHigh.
+  int64_t last_access;
+
+  bool Before(const Victim& other) const {
+    return rank != other.rank ? rank < other.rank
+                              : last_access < other.last_access;
+  }
+};
+
 // LRU cache implementation
 //
 // Cache entries have an "in_cache" boolean indicating whether the cache has a
@@ -81,6 +137,17 @@ Cache::~Cache() {}
 // Elements are moved between these lists by the Ref() and Unref() methods,
 // when they detect an element in the cache acquiring or losing its only
 // external reference.
+//
+// Items that are not referenced by clients are actually spread over more
+// lists, according to their priority, and are evicted list after list:
+// - LRU (also called probation when segmented):  kLow items
+// - protected:  kLow items that a segmented cache saw hit again since they
+//   were inserted.  This segment is bounded by kProtectedRatio of the
+//   capacity; its oldest items are demoted back to probation when it
+//   overflows.  Items that are inserted once and never looked up again, as
+//   by a scan, thus never push the hot items out.
+// - high:  kHigh items, only evicted when the lists above are empty
+// - pinned:  kPinned items, never evicted, only erased
 
 // An entry is a variable length heap-allocated structure.  Entries
 // are kept in a circular doubly linked list ordered by access time.
@@ -93,8 +160,12 @@ struct LRUHandle {
   size_t charge;  // TODO(opt): Only allow uint32_t?
   size_t key_length;
   bool in_cache;     // Whether entry is in the cache.
+  bool in_protected; // Whether entry is in the protected segment.
+  Cache::Priority priority;
   uint32_t refs;     // References, including cache reference, if present.
   uint32_t hash;     // Hash of key(); used for fast sharding and comparisons
+  int64_t inserted_at;  // See Cache::EntryInfo.
+  int64_t last_access;
   char key_data[1];  // Beginning of key
 
   Slice key() const {
@@ -146,6 +217,8 @@ class HandleTable {
     return result;
   }
 
+  uint32_t Size() const { return elems_; }
+
  private:
   // The table consists of an array of buckets where each bucket is
   // a linked list of cache entries that hash into the bucket.
@@ -198,64 +271,167 @@ class LRUCache {
   ~LRUCache();
 
   // Separate from constructor so caller can easily make an array of LRUCache
-  void SetCapacity(size_t capacity) { capacity_ = capacity; }
+  void SetBudget(CapacityBudget* budget) { budget_ = budget; }
+  void SetSegmented(bool segmented) { segmented_ = segmented; }
 
   // Like Cache methods, but with an extra "hash" parameter.
   Cache::Handle* Insert(const Slice& key, uint32_t hash, void* value,
-                        size_t charge,
+                        size_t charge, Cache::Priority priority,
                         void (*deleter)(const char *key, size_t keylen, void* value));
   Cache::Handle* Lookup(const Slice& key, uint32_t hash);
+  Cache::Handle* LookupOrLoad(const Slice& key, uint32_t hash,
+                              Cache::Loader loader, void* arg,
+                              Cache::Priority priority,
+                              void (*deleter)(const char *key, size_t keylen, void* value),
+                              Cache::LoadInfo* info);
   void Release(Cache::Handle* handle);
   void Erase(const Slice& key, uint32_t hash);
   void Prune();
   size_t TotalCharge() const {
-    MutexLock l(mutex_);
+    auto l = Lock();
     return usage_;
   }
+  Cache::Stats GetStats() const;
+  void GetEntries(int shard, std::vector<Cache::EntryInfo>* entries) const;
+
+  // Demote the protected entries the new capacity has no room for.
+  void CapacityChanged() {
+    auto l = Lock();
+    DemoteProtected();
+  }
+
+  // Describe the entry EvictOne() would evict.  Returns false if every entry
+  // is in use or pinned.
+  bool PeekVictim(Victim* victim) const;
+  // Evict the next entry, if the cache is still over its capacity.  Returns
+  // whether an entry was evicted.
+  bool EvictOne();
+
+  static uint32_t HandleHash(Cache::Handle* handle) {
+    return reinterpret_cast<LRUHandle*>(handle)->hash;
+  }
+  static void* HandleValue(Cache::Handle* handle) {
+    return reinterpret_cast<LRUHandle*>(handle)->value;
+  }
 
  private:
+  // Lock mutex_, counting the acquisitions that have to wait.
+  std::unique_lock<std::mutex> Lock() const;
   void LRU_Remove(LRUHandle* e);
   void LRU_Append(LRUHandle* list, LRUHandle* e);
   void Ref(LRUHandle* e);
   void Unref(LRUHandle* e);
   bool FinishErase(LRUHandle* e) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  LRUHandle* LookupLocked(const Slice& key, uint32_t hash)
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  LRUHandle* InsertLocked(const Slice& key, uint32_t hash, void* value,
+                          size_t charge, Cache::Priority priority,
+                          void (*deleter)(const char *key, size_t keylen, void* value))
+      EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  LRUHandle* ListFor(LRUHandle* e) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  LRUHandle* EvictionCandidate() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void DemoteProtected() EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  void EvictAll(LRUHandle* list) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Share of the capacity the protected segment may use.
+  static constexpr double kProtectedRatio = 0.8;
 
   // Initialized before use.
-  size_t capacity_;
+  CapacityBudget* budget_;
+  bool segmented_;
 
   // mutex_ protects the following state.
   mutable std::mutex mutex_;
   size_t usage_ GUARDED_BY(mutex_);
 
+  // capacity, usage and entries are filled in by GetStats().
+  mutable Cache::Stats stats_ GUARDED_BY(mutex_);
+
   // Dummy head of LRU list.
   // lru.prev is newest entry, lru.next is oldest entry.
   // Entries have refs==1 and in_cache==true.
   LRUHandle lru_ GUARDED_BY(mutex_);
 
+  // Dummy heads of the protected, high and pinned lists, ordered like lru_.
+  // Entries have refs==1 and in_cache==true.
+  LRUHandle protected_ GUARDED_BY(mutex_);
+  LRUHandle high_ GUARDED_BY(mutex_);
+  LRUHandle pinned_ GUARDED_BY(mutex_);
+
   // Dummy head of in-use list.
   // Entries are in use by clients, and have refs >= 2 and in_cache==true.
   LRUHandle in_use_ GUARDED_BY(mutex_);
 
   HandleTable table_ GUARDED_BY(mutex_);
+
+  // A load of LookupOrLoad() in progress.
+  struct Flight {
+    bool done = false;
+    int error = 0;
+  };
+
+  // Keys being loaded, and the condition their waiters wait on.
+  std::unordered_map<std::string, std::shared_ptr<Flight>> flights_
+      GUARDED_BY(mutex_);
+  std::condition_variable load_done_;
 };
 
-LRUCache::LRUCache() : capacity_(0), usage_(0) {
+LRUCache::LRUCache() : budget_(nullptr), segmented_(false), usage_(0) {
   // Make empty circular linked lists.
-  lru_.next = &lru_;
-  lru_.prev = &lru_;
-  in_use_.next = &in_use_;
-  in_use_.prev = &in_use_;
+  for (LRUHandle* list : {&lru_, &protected_, &high_, &pinned_, &in_use_}) {
+    list->next = list;
+    list->prev = list;
+  }
 }
 
 LRUCache::~LRUCache() {
   assert(in_use_.next == &in_use_);  // Error if caller has an unreleased handle
-  for (LRUHandle* e = lru_.next; e != &lru_;) {
-    LRUHandle* next = e->next;
-    assert(e->in_cache);
-    e->in_cache = false;
-    assert(e->refs == 1);  // Invariant of lru_ list.
-    Unref(e);
-    e = next;
+  for (LRUHandle* list : {&lru_, &protected_, &high_, &pinned_}) {
+    for (LRUHandle* e = list->next; e != list;) {
+      LRUHandle* next = e->next;
+      assert(e->in_cache);
+      e->in_cache = false;
+      assert(e->refs == 1);  // Invariant of lru_ list.
+      Unref(e);
+      e = next;
+    }
+  }
+}
+
+std::unique_lock<std::mutex> LRUCache::Lock() const {
+  std::unique_lock<std::mutex> l(mutex_, std::try_to_lock);
+  if (!l.owns_lock()) {
+    l.lock();
+    stats_.lock_waits++;
+  }
+  return l;
+}
+
+Cache::Stats LRUCache::GetStats() const {
+  auto l = Lock();
+  Cache::Stats stats = stats_;
+  stats.capacity = budget_->capacity.load(std::memory_order_relaxed);
+  stats.usage = usage_;
+  stats.entries = table_.Size();
+  return stats;
+}
+
+void LRUCache::GetEntries(int shard,
+                          std::vector<Cache::EntryInfo>* entries) const {
+  auto l = Lock();
+  for (const LRUHandle* list : {&in_use_, &pinned_, &high_, &protected_, &lru_}) {
+    for (const LRUHandle* e = list->next; e != list; e = e->next) {
+      Cache::EntryInfo entry;
+      entry.key = e->key().ToString();
+      entry.charge = e->charge;
+      entry.refs = e->refs - 1;  // Not the cache's own reference.
+      entry.priority = e->priority;
+      entry.in_protected = e->in_protected;
+      entry.shard = shard;
+      entry.inserted_at = e->inserted_at;
+      entry.last_access = e->last_access;
+      entries->push_back(std::move(entry));
+    }
   }
 }
 
@@ -275,9 +451,48 @@ void LRUCache::Unref(LRUHandle* e) {
     (*e->deleter)(e->key_data, e->key_length, e->value);
     free(e);
   } else if (e->in_cache && e->refs == 1) {
-    // No longer in use; move to lru_ list.
+    // No longer in use; move to the list of its priority.
     LRU_Remove(e);
-    LRU_Append(&lru_, e);
+    LRU_Append(ListFor(e), e);
+    if (e->in_protected) {
+      DemoteProtected();
+    }
+  }
+}
+
+LRUHandle* LRUCache::ListFor(LRUHandle* e) {
+  switch (e->priority) {
+    case Cache::Priority::kPinned:
+      return &pinned_;
+    case Cache::Priority::kHigh:
+      return &high_;
+    default:
+      return e->in_protected ? &protected_ : &lru_;
+  }
+}
+
+LRUHandle* LRUCache::EvictionCandidate() {
+  for (LRUHandle* list : {&lru_, &protected_, &high_}) {
+    if (list->next != list) {
+      return list->next;
+    }
+  }
+  return nullptr;
+}
+
+void LRUCache::DemoteProtected() {
+  // The protected segments of all the shards share kProtectedRatio of the
+  // capacity; a shard only demotes its own entries.
+  const size_t protected_capacity = static_cast<size_t>(
+      budget_->capacity.load(std::memory_order_relaxed) * kProtectedRatio);
+  while (budget_->protected_usage.load(std::memory_order_relaxed) >
+             protected_capacity &&
+         protected_.next != &protected_) {
+    LRUHandle* old = protected_.next;
+    LRU_Remove(old);
+    old->in_protected = false;
+    budget_->protected_usage.fetch_sub(old->charge, std::memory_order_relaxed);
+    LRU_Append(&lru_, old);
   }
 }
 
@@ -295,26 +510,140 @@ void LRUCache::LRU_Append(LRUHandle* list, LRUHandle* e) {
 }
 
 Cache::Handle* LRUCache::Lookup(const Slice& key, uint32_t hash) {
-  MutexLock l(mutex_);
+  auto l = Lock();
+  LRUHandle* e = LookupLocked(key, hash);
+  if (e != nullptr) {
+    stats_.hits++;
+  } else {
+    stats_.misses++;
+  }
+  return reinterpret_cast<Cache::Handle*>(e);
+}
+
+LRUHandle* LRUCache::LookupLocked(const Slice& key, uint32_t hash) {
   LRUHandle* e = table_.Lookup(key, hash);
   if (e != nullptr) {
+    if (segmented_ && e->priority == Cache::Priority::kLow &&
+        !e->in_protected) {
+      // Hit again since inserted: promote out of probation.
+      e->in_protected = true;
+      budget_->protected_usage.fetch_add(e->charge, std::memory_order_relaxed);
+    }
     Ref(e);
+    DemoteProtected();
+    e->last_access = NowMicros();
+  }
+  return e;
+}
+
+Cache::Handle* LRUCache::LookupOrLoad(const Slice& key, uint32_t hash,
+                                      Cache::Loader loader, void* arg,
+                                      Cache::Priority priority,
+                                      void (*deleter)(const char *key,
+                                                      size_t keylen,
+                                                      void* value),
+                                      Cache::LoadInfo* info) {
+  const auto start = std::chrono::steady_clock::now();
+  auto elapsed = [start]() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  };
+  *info = Cache::LoadInfo();
+
+  std::unique_lock<std::mutex> l = Lock();
+  const std::string flight_key = key.ToString();
+  for (;;) {
+    LRUHandle* e = LookupLocked(key, hash);
+    if (e != nullptr) {
+      if (info->waited) {
+        info->seconds = elapsed();
+        stats_.misses++;
+      } else {
+        stats_.hits++;
+      }
+      return reinterpret_cast<Cache::Handle*>(e);
+    }
+    auto it = flights_.find(flight_key);
+    if (it == flights_.end()) {
+      break;
+    }
+    // Wait for the caller that is loading the key instead of loading it
+    // again.  Its value may already be evicted (or not cached at all when
+    // the capacity is 0) when we look again, then we load it ourselves.
+    std::shared_ptr<Flight> flight = it->second;
+    info->waited = true;
+    load_done_.wait(l, [&flight]() { return flight->done; });
+    if (flight->error != 0) {
+      info->error = flight->error;
+      info->seconds = elapsed();
+      stats_.misses++;
+      return nullptr;
+    }
+  }
+
+  stats_.misses++;
+
+  std::shared_ptr<Flight> flight = std::make_shared<Flight>();
+  flights_.emplace(flight_key, flight);
+  auto land = [&](int error) {
+    flights_.erase(flight_key);
+    flight->done = true;
+    flight->error = error;
+    load_done_.notify_all();
+  };
+
+  void* value = nullptr;
+  size_t charge = 0;
+  int error;
+  const double load_start = elapsed();
+  l.unlock();
+  try {
+    error = (*loader)(arg, key.data(), key.size(), &value, &charge);
+  } catch (...) {
+    l.lock();
+    stats_.loads++;
+    stats_.load_failures++;
+    stats_.load_seconds += elapsed() - load_start;
+    land(-1);
+    throw;
+  }
+  l.lock();
+
+  info->loaded = true;
+  info->error = error;
+  info->seconds = elapsed();
+  stats_.loads++;
+  stats_.load_failures += (error != 0);
+  stats_.load_seconds += info->seconds - load_start;
+  LRUHandle* e = nullptr;
+  if (error == 0) {
+    e = InsertLocked(key, hash, value, charge, priority, deleter);
   }
+  land(error);
   return reinterpret_cast<Cache::Handle*>(e);
 }
 
 void LRUCache::Release(Cache::Handle* handle) {
-  MutexLock l(mutex_);
+  auto l = Lock();
   Unref(reinterpret_cast<LRUHandle*>(handle));
 }
 
 Cache::Handle* LRUCache::Insert(const Slice& key, uint32_t hash, void* value,
-                                size_t charge,
+                                size_t charge, Cache::Priority priority,
                                 void (*deleter)(const char *key,
                                                 size_t keylen,
                                                 void* value)) {
-  MutexLock l(mutex_);
+  auto l = Lock();
+  return reinterpret_cast<Cache::Handle*>(
+      InsertLocked(key, hash, value, charge, priority, deleter));
+}
 
+LRUHandle* LRUCache::InsertLocked(const Slice& key, uint32_t hash, void* value,
+                                  size_t charge, Cache::Priority priority,
+                                  void (*deleter)(const char *key,
+                                                  size_t keylen,
+                                                  void* value)) {
   LRUHandle* e =
       reinterpret_cast<LRUHandle*>(malloc(sizeof(LRUHandle) - 1 + key.size()));
   e->value = value;
@@ -323,29 +652,65 @@ Cache::Handle* LRUCache::Insert(const Slice& key, uint32_t hash, void* value,
   e->key_length = key.size();
   e->hash = hash;
   e->in_cache = false;
+  e->in_protected = false;
+  e->priority = priority;
   e->refs = 1;  // for the returned handle.
+  e->inserted_at = NowMicros();
+  e->last_access = e->inserted_at;
   std::memcpy(e->key_data, key.data(), key.size());
+  stats_.inserts++;
 
-  if (capacity_ > 0) {
+  if (budget_->Admits(charge, priority)) {
     e->refs++;  // for the cache's reference.
     e->in_cache = true;
     LRU_Append(&in_use_, e);
     usage_ += charge;
+    budget_->usage.fetch_add(charge, std::memory_order_relaxed);
     FinishErase(table_.Insert(e));
-  } else {  // don't cache. (capacity_==0 is supported and turns off caching.)
+  } else {  // don't cache.
+    if (budget_->capacity.load(std::memory_order_relaxed) > 0) {
+      stats_.rejects++;
+    }
     // next is read by key() in an assert, so it must be initialized
     e->next = nullptr;
   }
-  while (usage_ > capacity_ && lru_.next != &lru_) {
-    LRUHandle* old = lru_.next;
-    assert(old->refs == 1);
-    bool erased = FinishErase(table_.Remove(old->key(), old->hash));
-    if (!erased) {  // to avoid unused variable when compiled NDEBUG
-      assert(erased);
+  // The cache is brought back within its capacity by the caller, see
+  // ShardedCache::EnforceCapacity().
+
+  return e;
+}
+
+bool LRUCache::PeekVictim(Victim* victim) const {
+  auto l = Lock();
+  int rank = 0;
+  for (const LRUHandle* list : {&lru_, &protected_, &high_}) {
+    if (list->next != list) {
+      victim->rank = rank;
+      victim->last_access = list->next->last_access;
+      return true;
     }
+    rank++;
   }
+  return false;
+}
 
-  return reinterpret_cast<Cache::Handle*>(e);
+bool LRUCache::EvictOne() {
+  auto l = Lock();
+  if (!budget_->Exceeded()) {  // another caller made room meanwhile
+    return false;
+  }
+  LRUHandle* old = EvictionCandidate();
+  if (old == nullptr) {  // everything left is in use or pinned
+    return false;
+  }
+  assert(old->refs == 1);
+  stats_.evictions++;
+  stats_.bytes_evicted += old->charge;
+  bool erased = FinishErase(table_.Remove(old->key(), old->hash));
+  if (!erased) {  // to avoid unused variable when compiled NDEBUG
+    assert(erased);
+  }
+  return true;
 }
 
 // If e != nullptr, finish removing *e from the cache; it has already been
@@ -353,23 +718,39 @@ Cache::Handle* LRUCache::Insert(const Slice& key, uint32_t hash, void* value,
 bool LRUCache::FinishErase(LRUHandle* e) {
   if (e != nullptr) {
     assert(e->in_cache);
+    if (e->refs > 1) {
+      // The entry outlives its erasure until these handles are released.
+      stats_.erased_in_use++;
+    }
     LRU_Remove(e);
     e->in_cache = false;
     usage_ -= e->charge;
+    budget_->usage.fetch_sub(e->charge, std::memory_order_relaxed);
+    if (e->in_protected) {
+      e->in_protected = false;
+      budget_->protected_usage.fetch_sub(e->charge, std::memory_order_relaxed);
+    }
     Unref(e);
   }
   return e != nullptr;
 }
 
 void LRUCache::Erase(const Slice& key, uint32_t hash) {
-  MutexLock l(mutex_);
+  auto l = Lock();
   FinishErase(table_.Remove(key, hash));
 }
 
 void LRUCache::Prune() {
-  MutexLock l(mutex_);
-  while (lru_.next != &lru_) {
-    LRUHandle* e = lru_.next;
+  auto l = Lock();
+  // Pinned entries stay.
+  EvictAll(&lru_);
+  EvictAll(&protected_);
+  EvictAll(&high_);
+}
+
+void LRUCache::EvictAll(LRUHandle* list) {
+  while (list->next != list) {
+    LRUHandle* e = list->next;
     assert(e->refs == 1);
     bool erased = FinishErase(table_.Remove(e->key(), e->hash));
     if (!erased) {  // to avoid unused variable when compiled NDEBUG
@@ -378,12 +759,596 @@ void LRUCache::Prune() {
   }
 }
 
-static const int kNumShardBits = 4;
-static const int kNumShards = 1 << kNumShardBits;
+// CLOCK cache implementation
+//
+// A read-optimized alternative to LRUCache, for a few hot keys looked up by
+// many threads.  Lookups only take the shard's lock in shared mode, take
+// their reference with an atomic increment and mark the entry as recently
+// used by setting its access bit instead of relinking it in a list.
+// Release() takes no lock at all.  Only inserts and erases take the lock
+// exclusively.
+//
+// Eviction sweeps a clock hand over the entries: an entry whose access bit
+// is set gets a second chance (the bit is cleared), an entry whose bit is
+// clear is evicted, unless it is in use.  kHigh entries are only swept once
+// no kLow entry can be evicted, kPinned entries never are.
+//
+// The references of an entry and whether the cache holds it are packed in
+// one atomic word, so that exactly one of the last Release() and the
+// erasure of the entry sees it become unreferenced and deletes it.
+struct ClockHandle {
+  void* value;
+  void (*deleter)(const char *, size_t, void* value);
+  ClockHandle* next_hash;
+  size_t charge;
+  size_t key_length;
+  uint32_t hash;        // Hash of key(); used for fast sharding and comparisons
+  uint32_t ring_index;  // Position in ClockCache::ring_, while in the cache.
+  Cache::Priority priority;
+  std::atomic<uint32_t> state;     // kInCache | references * kRef
+  std::atomic<bool> accessed;      // Access bit, cleared by the clock hand.
+  int64_t inserted_at;             // See Cache::EntryInfo.
+  std::atomic<int64_t> last_access;
+  char key_data[1];  // Beginning of key
+
+  Slice key() const { return Slice(key_data, key_length); }
+};
+
+// A hash table of ClockHandle that grows incrementally: once it is too
+// loaded, a table twice as large is allocated and every later Insert() and
+// Remove() moves a few buckets from the old table, so that no single write
+// rehashes the whole shard while holding its lock.  Lookups look in
+// whichever table holds the bucket of the key.
+class ClockHandleTable {
+ public:
+  ClockHandleTable()
+      : length_(kMinLength),
+        elems_(0),
+        list_(new ClockHandle*[kMinLength]()),
+        old_length_(0),
+        old_list_(nullptr),
+        migrated_(0) {}
+  ~ClockHandleTable() {
+    delete[] list_;
+    delete[] old_list_;
+  }
+
+  ClockHandle* Lookup(const Slice& key, uint32_t hash) const {
+    return *FindPointer(key, hash);
+  }
+
+  ClockHandle* Insert(ClockHandle* h) {
+    MigrateSome();
+    ClockHandle** ptr = FindPointer(h->key(), h->hash);
+    ClockHandle* old = *ptr;
+    h->next_hash = (old == nullptr ? nullptr : old->next_hash);
+    *ptr = h;
+    if (old == nullptr) {
+      ++elems_;
+      if (elems_ > length_ && old_list_ == nullptr) {
+        StartResize();
+      }
+    }
+    return old;
+  }
+
+  ClockHandle* Remove(const Slice& key, uint32_t hash) {
+    MigrateSome();
+    ClockHandle** ptr = FindPointer(key, hash);
+    ClockHandle* result = *ptr;
+    if (result != nullptr) {
+      *ptr = result->next_hash;
+      --elems_;
+    }
+    return result;
+  }
+
+  uint32_t Size() const { return elems_; }
 
-class ShardedLRUCache : public Cache {
  private:
-  LRUCache shard_[kNumShards];
+  static const uint32_t kMinLength = 16;
+  // Buckets moved from the old table by each Insert() and Remove().
+  static const uint32_t kMigrateBuckets = 16;
+
+  uint32_t length_;
+  uint32_t elems_;
+  ClockHandle** list_;
+
+  // The table being migrated, if any.  Its buckets below migrated_ are
+  // already moved to list_.
+  uint32_t old_length_;
+  ClockHandle** old_list_;
+  uint32_t migrated_;
+
+  ClockHandle** Bucket(uint32_t hash) const {
+    if (old_list_ != nullptr) {
+      const uint32_t old_bucket = hash & (old_length_ - 1);
+      if (old_bucket >= migrated_) {
+        return &old_list_[old_bucket];
+      }
+    }
+    return &list_[hash & (length_ - 1)];
+  }
+
+  ClockHandle** FindPointer(const Slice& key, uint32_t hash) const {
+    ClockHandle** ptr = Bucket(hash);
+    while (*ptr != nullptr && ((*ptr)->hash != hash || key != (*ptr)->key())) {
+      ptr = &(*ptr)->next_hash;
+    }
+    return ptr;
+  }
+
+  void StartResize() {
+    old_list_ = list_;
+    old_length_ = length_;
+    migrated_ = 0;
+    length_ *= 2;
+    list_ = new ClockHandle*[length_]();
+  }
+
+  void MigrateSome() {
+    if (old_list_ == nullptr) {
+      return;
+    }
+    for (uint32_t n = 0; n < kMigrateBuckets && migrated_ < old_length_;
+         n++, migrated_++) {
+      ClockHandle* h = old_list_[migrated_];
+      while (h != nullptr) {
+        ClockHandle* next = h->next_hash;
+        ClockHandle** ptr = &list_[h->hash & (length_ - 1)];
+        h->next_hash = *ptr;
+        *ptr = h;
+        h = next;
+      }
+      old_list_[migrated_] = nullptr;
+    }
+    if (migrated_ == old_length_) {
+      delete[] old_list_;
+      old_list_ = nullptr;
+      old_length_ = 0;
+    }
+  }
+};
+
+// A single shard of sharded cache.
+class ClockCache {
+ public:
+  ClockCache();
+  ~ClockCache();
+
+  // Separate from constructor so caller can easily make an array of ClockCache
+  void SetBudget(CapacityBudget* budget) { budget_ = budget; }
+
+  // Like Cache methods, but with an extra "hash" parameter.
+  Cache::Handle* Insert(const Slice& key, uint32_t hash, void* value,
+                        size_t charge, Cache::Priority priority,
+                        void (*deleter)(const char *key, size_t keylen, void* value));
+  Cache::Handle* Lookup(const Slice& key, uint32_t hash);
+  Cache::Handle* LookupOrLoad(const Slice& key, uint32_t hash,
+                              Cache::Loader loader, void* arg,
+                              Cache::Priority priority,
+                              void (*deleter)(const char *key, size_t keylen, void* value),
+                              Cache::LoadInfo* info);
+  void Release(Cache::Handle* handle) {
+    Unref(reinterpret_cast<ClockHandle*>(handle));
+  }
+  void Erase(const Slice& key, uint32_t hash);
+  void Prune();
+  size_t TotalCharge() const {
+    auto l = ReadLock();
+    return usage_;
+  }
+  Cache::Stats GetStats() const;
+  void GetEntries(int shard, std::vector<Cache::EntryInfo>* entries) const;
+
+  void CapacityChanged() {}
+
+  // See LRUCache.  The victim is the least recently used evictable entry,
+  // while EvictOne() sweeps the clock hand: it is only a likely victim.
+  bool PeekVictim(Victim* victim) const;
+  bool EvictOne();
+
+  static uint32_t HandleHash(Cache::Handle* handle) {
+    return reinterpret_cast<ClockHandle*>(handle)->hash;
+  }
+  static void* HandleValue(Cache::Handle* handle) {
+    return reinterpret_cast<ClockHandle*>(handle)->value;
+  }
+
+ private:
+  static const uint32_t kInCache = 1;
+  static const uint32_t kRef = 2;
+
+  // Lock mutex_, counting the acquisitions that have to wait.
+  std::shared_lock<std::shared_mutex> ReadLock() const;
+  std::unique_lock<std::shared_mutex> WriteLock() const;
+
+  // Look key up and reference its entry, without counting a hit or a miss.
+  ClockHandle* Find(const Slice& key, uint32_t hash);
+  static void Unref(ClockHandle* e);
+  static void Free(ClockHandle* e);
+  // Finish removing *e from the cache; it has already been removed from the
+  // hash table.  Return whether e != nullptr.
+  bool FinishErase(ClockHandle* e) EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+  // Whether the clock hand may evict e, at the given pass of a sweep.
+  static bool Evictable(const ClockHandle* e, Cache::Priority pass);
+
+  // Initialized before use.
+  CapacityBudget* budget_;
+
+  // mutex_ protects the following state.  Lookups only take it in shared
+  // mode: the fields of the entries they touch are atomic.
+  mutable std::shared_mutex mutex_;
+  size_t usage_ GUARDED_BY(mutex_);
+
+  // The entries of the cache, in no particular order, and the clock hand
+  // sweeping them.
+  std::vector<ClockHandle*> ring_ GUARDED_BY(mutex_);
+  size_t hand_ GUARDED_BY(mutex_);
+
+  ClockHandleTable table_ GUARDED_BY(mutex_);
+
+  // Counters of GetStats(), updated by readers and writers alike.
+  struct Counters {
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> inserts{0};
+    std::atomic<uint64_t> rejects{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> bytes_evicted{0};
+    std::atomic<uint64_t> erased_in_use{0};
+    std::atomic<uint64_t> lock_waits{0};
+    std::atomic<uint64_t> loads{0};
+    std::atomic<uint64_t> load_failures{0};
+    std::atomic<uint64_t> load_micros{0};
+  };
+  mutable Counters counters_;
+
+  // A load of LookupOrLoad() in progress.
+  struct Flight {
+    bool done = false;
+    int error = 0;
+  };
+
+  // Keys being loaded, and the condition their waiters wait on.  Lock
+  // order: flight_mutex_ before mutex_.
+  std::mutex flight_mutex_;
+  std::unordered_map<std::string, std::shared_ptr<Flight>> flights_;
+  std::condition_variable load_done_;
+};
+
+ClockCache::ClockCache() : budget_(nullptr), usage_(0), hand_(0) {}
+
+ClockCache::~ClockCache() {
+  for (ClockHandle* e : ring_) {
+    // Error if caller has an unreleased handle
+    assert(e->state.load(std::memory_order_relaxed) == kInCache);
+    Free(e);
+  }
+}
+
+std::shared_lock<std::shared_mutex> ClockCache::ReadLock() const {
+  std::shared_lock<std::shared_mutex> l(mutex_, std::try_to_lock);
+  if (!l.owns_lock()) {
+    counters_.lock_waits.fetch_add(1, std::memory_order_relaxed);
+    l.lock();
+  }
+  return l;
+}
+
+std::unique_lock<std::shared_mutex> ClockCache::WriteLock() const {
+  std::unique_lock<std::shared_mutex> l(mutex_, std::try_to_lock);
+  if (!l.owns_lock()) {
+    counters_.lock_waits.fetch_add(1, std::memory_order_relaxed);
+    l.lock();
+  }
+  return l;
+}
+
+void ClockCache::Unref(ClockHandle* e) {
+  if (e->state.fetch_sub(kRef, std::memory_order_acq_rel) == kRef) {
+    // Neither referenced nor in the cache anymore.
+    Free(e);
+  }
+}
+
+void ClockCache::Free(ClockHandle* e) {
+  (*e->deleter)(e->key_data, e->key_length, e->value);
+  e->~ClockHandle();
+  free(e);
+}
+
+ClockHandle* ClockCache::Find(const Slice& key, uint32_t hash) {
+  auto l = ReadLock();
+  ClockHandle* e = table_.Lookup(key, hash);
+  if (e != nullptr) {
+    // The entry can't leave the table while we hold the lock, so it is safe
+    // to reference it.
+    e->state.fetch_add(kRef, std::memory_order_relaxed);
+    if (!e->accessed.load(std::memory_order_relaxed)) {
+      e->accessed.store(true, std::memory_order_relaxed);
+    }
+    e->last_access.store(NowMicros(), std::memory_order_relaxed);
+  }
+  return e;
+}
+
+Cache::Handle* ClockCache::Lookup(const Slice& key, uint32_t hash) {
+  ClockHandle* e = Find(key, hash);
+  (e != nullptr ? counters_.hits : counters_.misses)
+      .fetch_add(1, std::memory_order_relaxed);
+  return reinterpret_cast<Cache::Handle*>(e);
+}
+
+Cache::Handle* ClockCache::LookupOrLoad(const Slice& key, uint32_t hash,
+                                        Cache::Loader loader, void* arg,
+                                        Cache::Priority priority,
+                                        void (*deleter)(const char *key,
+                                                        size_t keylen,
+                                                        void* value),
+                                        Cache::LoadInfo* info) {
+  *info = Cache::LoadInfo();
+  ClockHandle* e = Find(key, hash);
+  if (e != nullptr) {
+    counters_.hits.fetch_add(1, std::memory_order_relaxed);
+    return reinterpret_cast<Cache::Handle*>(e);
+  }
+  counters_.misses.fetch_add(1, std::memory_order_relaxed);
+
+  const auto start = std::chrono::steady_clock::now();
+  auto elapsed = [start]() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  };
+
+  std::unique_lock<std::mutex> l(flight_mutex_);
+  const std::string flight_key = key.ToString();
+  for (;;) {
+    // The loader of the key may have inserted it since we looked.
+    e = Find(key, hash);
+    if (e != nullptr) {
+      info->seconds = elapsed();
+      return reinterpret_cast<Cache::Handle*>(e);
+    }
+    auto it = flights_.find(flight_key);
+    if (it == flights_.end()) {
+      break;
+    }
+    // Wait for the caller that is loading the key, see LRUCache.
+    std::shared_ptr<Flight> flight = it->second;
+    info->waited = true;
+    load_done_.wait(l, [&flight]() { return flight->done; });
+    if (flight->error != 0) {
+      info->error = flight->error;
+      info->seconds = elapsed();
+      return nullptr;
+    }
+  }
+
+  std::shared_ptr<Flight> flight = std::make_shared<Flight>();
+  flights_.emplace(flight_key, flight);
+  auto land = [&](int error) {
+    const double seconds = elapsed();
+    counters_.loads.fetch_add(1, std::memory_order_relaxed);
+    counters_.load_failures.fetch_add(error != 0, std::memory_order_relaxed);
+    counters_.load_micros.fetch_add(static_cast<uint64_t>(seconds * 1e6),
+                                    std::memory_order_relaxed);
+    flights_.erase(flight_key);
+    flight->done = true;
+    flight->error = error;
+    load_done_.notify_all();
+    return seconds;
+  };
+
+  void* value = nullptr;
+  size_t charge = 0;
+  int error;
+  l.unlock();
+  try {
+    error = (*loader)(arg, key.data(), key.size(), &value, &charge);
+  } catch (...) {
+    l.lock();
+    land(-1);
+    throw;
+  }
+  if (error == 0) {
+    // Inserted before the waiters wake up, so that they find it.
+    e = reinterpret_cast<ClockHandle*>(
+        Insert(key, hash, value, charge, priority, deleter));
+  }
+  l.lock();
+
+  info->loaded = true;
+  info->error = error;
+  info->seconds = land(error);
+  return reinterpret_cast<Cache::Handle*>(e);
+}
+
+Cache::Handle* ClockCache::Insert(const Slice& key, uint32_t hash, void* value,
+                                  size_t charge, Cache::Priority priority,
+                                  void (*deleter)(const char *key,
+                                                  size_t keylen,
+                                                  void* value)) {
+  ClockHandle* e = new (malloc(sizeof(ClockHandle) - 1 + key.size()))
+      ClockHandle;
+  e->value = value;
+  e->deleter = deleter;
+  e->next_hash = nullptr;
+  e->charge = charge;
+  e->key_length = key.size();
+  e->hash = hash;
+  e->ring_index = 0;
+  e->priority = priority;
+  e->state.store(kRef, std::memory_order_relaxed);  // for the returned handle.
+  e->accessed.store(false, std::memory_order_relaxed);
+  e->inserted_at = NowMicros();
+  e->last_access.store(e->inserted_at, std::memory_order_relaxed);
+  std::memcpy(e->key_data, key.data(), key.size());
+  counters_.inserts.fetch_add(1, std::memory_order_relaxed);
+
+  auto l = WriteLock();
+  if (budget_->Admits(charge, priority)) {
+    // for the cache's reference.
+    e->state.fetch_add(kInCache, std::memory_order_relaxed);
+    e->ring_index = static_cast<uint32_t>(ring_.size());
+    ring_.push_back(e);
+    usage_ += charge;
+    budget_->usage.fetch_add(charge, std::memory_order_relaxed);
+    FinishErase(table_.Insert(e));
+  } else if (budget_->capacity.load(std::memory_order_relaxed) > 0) {
+    counters_.rejects.fetch_add(1, std::memory_order_relaxed);
+  }  // else don't cache.
+
+  return reinterpret_cast<Cache::Handle*>(e);
+}
+
+bool ClockCache::FinishErase(ClockHandle* e) {
+  if (e == nullptr) {
+    return false;
+  }
+  ClockHandle* last = ring_.back();
+  ring_[e->ring_index] = last;
+  last->ring_index = e->ring_index;
+  ring_.pop_back();
+  usage_ -= e->charge;
+  budget_->usage.fetch_sub(e->charge, std::memory_order_relaxed);
+
+  const uint32_t old_state =
+      e->state.fetch_and(~kInCache, std::memory_order_acq_rel);
+  if (old_state == kInCache) {
+    Free(e);
+  } else {
+    // The entry outlives its erasure until these handles are released.
+    counters_.erased_in_use.fetch_add(1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+bool ClockCache::Evictable(const ClockHandle* e, Cache::Priority pass) {
+  // Under the exclusive lock, references may only be dropped, not taken.
+  return e->priority == pass &&
+         e->state.load(std::memory_order_acquire) == kInCache;
+}
+
+bool ClockCache::PeekVictim(Victim* victim) const {
+  auto l = ReadLock();
+  bool found = false;
+  for (const ClockHandle* e : ring_) {
+    if (e->priority == Cache::Priority::kPinned ||
+        e->state.load(std::memory_order_acquire) != kInCache) {
+      continue;
+    }
+    const Victim candidate{e->priority == Cache::Priority::kHigh ? 2 : 0,
+                           e->last_access.load(std::memory_order_relaxed)};
+    if (!found || candidate.Before(*victim)) {
+      *victim = candidate;
+      found = true;
+    }
+  }
+  return found;
+}
+
+bool ClockCache::EvictOne() {
+  auto l = WriteLock();
+  if (!budget_->Exceeded()) {  // another caller made room meanwhile
+    return false;
+  }
+  for (Cache::Priority pass : {Cache::Priority::kLow, Cache::Priority::kHigh}) {
+    // Two turns of the hand give every entry its second chance.
+    size_t steps = 2 * ring_.size();
+    while (!ring_.empty() && steps-- > 0) {
+      if (hand_ >= ring_.size()) {
+        hand_ = 0;
+      }
+      ClockHandle* e = ring_[hand_];
+      if (!Evictable(e, pass) ||
+          e->accessed.exchange(false, std::memory_order_relaxed)) {
+        hand_++;
+        continue;
+      }
+      counters_.evictions.fetch_add(1, std::memory_order_relaxed);
+      counters_.bytes_evicted.fetch_add(e->charge, std::memory_order_relaxed);
+      table_.Remove(e->key(), e->hash);
+      // The last entry of the ring takes e's place, under the hand.
+      FinishErase(e);
+      return true;
+    }
+  }
+  return false;
+}
+
+void ClockCache::Erase(const Slice& key, uint32_t hash) {
+  auto l = WriteLock();
+  FinishErase(table_.Remove(key, hash));
+}
+
+void ClockCache::Prune() {
+  auto l = WriteLock();
+  for (size_t i = 0; i < ring_.size();) {
+    ClockHandle* e = ring_[i];
+    // Pinned entries stay.
+    if (Evictable(e, Cache::Priority::kLow) ||
+        Evictable(e, Cache::Priority::kHigh)) {
+      table_.Remove(e->key(), e->hash);
+      FinishErase(e);
+    } else {
+      i++;
+    }
+  }
+}
+
+Cache::Stats ClockCache::GetStats() const {
+  Cache::Stats stats;
+  {
+    auto l = ReadLock();
+    stats.capacity = budget_->capacity.load(std::memory_order_relaxed);
+    stats.usage = usage_;
+    stats.entries = table_.Size();
+  }
+  const auto relaxed = std::memory_order_relaxed;
+  stats.hits = counters_.hits.load(relaxed);
+  stats.misses = counters_.misses.load(relaxed);
+  stats.inserts = counters_.inserts.load(relaxed);
+  stats.rejects = counters_.rejects.load(relaxed);
+  stats.evictions = counters_.evictions.load(relaxed);
+  stats.bytes_evicted = counters_.bytes_evicted.load(relaxed);
+  stats.erased_in_use = counters_.erased_in_use.load(relaxed);
+  stats.lock_waits = counters_.lock_waits.load(relaxed);
+  stats.loads = counters_.loads.load(relaxed);
+  stats.load_failures = counters_.load_failures.load(relaxed);
+  stats.load_seconds = counters_.load_micros.load(relaxed) / 1e6;
+  return stats;
+}
+
+void ClockCache::GetEntries(int shard,
+                            std::vector<Cache::EntryInfo>* entries) const {
+  auto l = ReadLock();
+  for (const ClockHandle* e : ring_) {
+    Cache::EntryInfo entry;
+    entry.key = e->key().ToString();
+    entry.charge = e->charge;
+    // Not the cache's own reference.
+    entry.refs = e->state.load(std::memory_order_relaxed) / kRef;
+    entry.priority = e->priority;
+    entry.in_protected = false;
+    entry.shard = shard;
+    entry.inserted_at = e->inserted_at;
+    entry.last_access = e->last_access.load(std::memory_order_relaxed);
+    entries->push_back(std::move(entry));
+  }
+}
+
+// A cache split into 2^num_shard_bits independently locked shards, LRUCache
+// or ClockCache, picked by the top bits of the hash of the keys.  The shards
+// share the capacity of the cache, see CapacityBudget.
+template <typename Shard>
+class ShardedCache : public Cache {
+ private:
+  const int num_shard_bits_;
+  const int num_shards_;
+  CapacityBudget budget_;
+  std::unique_ptr<Shard[]> shard_;
   std::mutex id_mutex_;
   uint64_t last_id_;
 
@@ -391,52 +1356,133 @@ class ShardedLRUCache : public Cache {
     return Hash(s.data(), s.size(), 0);
   }
 
-  static uint32_t Shard(uint32_t hash) { return hash >> (32 - kNumShardBits); }
+  uint32_t ShardOf(uint32_t hash) const {
+    return num_shard_bits_ > 0 ? hash >> (32 - num_shard_bits_) : 0;
+  }
+
+  // Evict the least recently used evictable entries of the whole cache,
+  // whatever their shard, until it fits in its capacity again.  Only one
+  // shard is locked at a time.  Evictions are rare next to lookups (each
+  // one makes room for a whole index), so comparing the next victim of
+  // every shard is cheap enough.
+  void EnforceCapacity() {
+    while (budget_.Exceeded()) {
+      int victim_shard = -1;
+      Victim victim;
+      for (int s = 0; s < num_shards_; s++) {
+        Victim candidate;
+        if (shard_[s].PeekVictim(&candidate) &&
+            (victim_shard < 0 || candidate.Before(victim))) {
+          victim = candidate;
+          victim_shard = s;
+        }
+      }
+      if (victim_shard < 0) {  // everything left is in use or pinned
+        return;
+      }
+      shard_[victim_shard].EvictOne();
+    }
+  }
 
  public:
-  explicit ShardedLRUCache(size_t capacity) : last_id_(0) {
-    const size_t per_shard = (capacity + (kNumShards - 1)) / kNumShards;
-    for (int s = 0; s < kNumShards; s++) {
-      shard_[s].SetCapacity(per_shard);
+  ShardedCache(size_t capacity, int num_shard_bits)
+      : num_shard_bits_(num_shard_bits),
+        num_shards_(1 << num_shard_bits),
+        shard_(new Shard[1 << num_shard_bits]),
+        last_id_(0) {
+    budget_.capacity.store(capacity);
+    for (int s = 0; s < num_shards_; s++) {
+      shard_[s].SetBudget(&budget_);
     }
   }
-  ~ShardedLRUCache() override {}
+  ~ShardedCache() override {}
+  Shard* shard(int s) { return &shard_[s]; }
+  using Cache::Insert;
   Handle* Insert(const Slice& key, void* value, size_t charge,
+                 Priority priority,
                  void (*deleter)(const char *key, size_t keylen, void* value)) override {
     const uint32_t hash = HashSlice(key);
-    return shard_[Shard(hash)].Insert(key, hash, value, charge, deleter);
+    Handle* handle = shard_[ShardOf(hash)].Insert(key, hash, value, charge,
+                                                  priority, deleter);
+    EnforceCapacity();
+    return handle;
   }
   Handle* Lookup(const Slice& key) override {
     const uint32_t hash = HashSlice(key);
-    return shard_[Shard(hash)].Lookup(key, hash);
+    return shard_[ShardOf(hash)].Lookup(key, hash);
+  }
+  Handle* LookupOrLoad(const Slice& key, Loader loader, void* arg,
+                       Priority priority,
+                       void (*deleter)(const char *key, size_t keylen, void* value),
+                       LoadInfo* info) override {
+    const uint32_t hash = HashSlice(key);
+    LoadInfo unused;
+    Handle* handle = shard_[ShardOf(hash)].LookupOrLoad(
+        key, hash, loader, arg, priority, deleter,
+        info != nullptr ? info : &unused);
+    EnforceCapacity();
+    return handle;
   }
   void Release(Handle* handle) override {
-    LRUHandle* h = reinterpret_cast<LRUHandle*>(handle);
-    shard_[Shard(h->hash)].Release(handle);
+    shard_[ShardOf(Shard::HandleHash(handle))].Release(handle);
+    // The entry may have been kept over the capacity while it was in use.
+    EnforceCapacity();
   }
   void Erase(const Slice& key) override {
     const uint32_t hash = HashSlice(key);
-    shard_[Shard(hash)].Erase(key, hash);
-  }
-  void* Value(Handle* handle) override {
-    return reinterpret_cast<LRUHandle*>(handle)->value;
+    shard_[ShardOf(hash)].Erase(key, hash);
   }
+  void* Value(Handle* handle) override { return Shard::HandleValue(handle); }
   uint64_t NewId() override {
     MutexLock l(id_mutex_);
     return ++(last_id_);
   }
   void Prune() override {
-    for (int s = 0; s < kNumShards; s++) {
+    for (int s = 0; s < num_shards_; s++) {
       shard_[s].Prune();
     }
   }
   size_t TotalCharge() const override {
     size_t total = 0;
-    for (int s = 0; s < kNumShards; s++) {
+    for (int s = 0; s < num_shards_; s++) {
       total += shard_[s].TotalCharge();
     }
     return total;
   }
+  void SetCapacity(size_t capacity) override {
+    budget_.capacity.store(capacity);
+    for (int s = 0; s < num_shards_; s++) {
+      shard_[s].CapacityChanged();
+    }
+    EnforceCapacity();
+  }
+  void SetAdmissionRatio(double ratio) override {
+    budget_.admission_ratio.store(ratio);
+  }
+  int NumShards() const override { return num_shards_; }
+  Stats GetStats(int shard) const override {
+    assert(shard >= 0 && shard < num_shards_);
+    return shard_[shard].GetStats();
+  }
+  void GetEntries(std::vector<EntryInfo>* entries) const override {
+    for (int s = 0; s < num_shards_; s++) {
+      shard_[s].GetEntries(s, entries);
+    }
+  }
 };
 
-Cache* NewLRUCache(size_t capacity) { return new ShardedLRUCache(capacity); }
+Cache* NewLRUCache(size_t capacity, int num_shard_bits) {
+  return new ShardedCache<LRUCache>(capacity, num_shard_bits);
+}
+
+Cache* NewSLRUCache(size_t capacity, int num_shard_bits) {
+  auto* cache = new ShardedCache<LRUCache>(capacity, num_shard_bits);
+  for (int s = 0; s < cache->NumShards(); s++) {
+    cache->shard(s)->SetSegmented(true);
+  }
+  return cache;
+}
+
+Cache* NewClockCache(size_t capacity, int num_shard_bits) {
+  return new ShardedCache<ClockCache>(capacity, num_shard_bits);
+}
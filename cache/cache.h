@@ -10,10 +10,11 @@
 // length strings, may use the length of the string as the charge for
 // the string.
 //
-// A builtin cache implementation with a least-recently-used eviction
-// policy is provided.  Clients may use their own implementations if
-// they want something more sophisticated (like scan-resistance, a
-// custom eviction policy, variable cache sizing, etc.)
+// Builtin cache implementations with a least-recently-used, a
+// scan-resistant segmented LRU and a read-optimized CLOCK eviction policy
+// are provided.  Clients may
+// use their own implementations if they want something more sophisticated
+// (like a custom eviction policy, variable cache sizing, etc.)
 
 #ifndef CACHE_H_
 #define CACHE_H_
@@ -23,6 +24,7 @@
 #include <cstddef>
 #include <cstring>
 #include <string>
+#include <vector>
 
 #define LEVELDB_EXPORT
 
@@ -122,9 +124,31 @@ inline int Slice::compare(const Slice& b) const {
 
 class LEVELDB_EXPORT Cache;
 
+// The builtin caches are split into 2^num_shard_bits shards, each with its
+// own lock, picked by the hash of the keys.  The shards share the capacity:
+// a single entry may use most of it whatever its shard, and the least
+// recently used entries of the whole cache are evicted first.
+static const int kDefaultNumShardBits = 4;
+
 // Create a new cache with a fixed size capacity.  This implementation
 // of Cache uses a least-recently-used eviction policy.
-LEVELDB_EXPORT Cache* NewLRUCache(size_t capacity);
+LEVELDB_EXPORT Cache* NewLRUCache(size_t capacity,
+                                  int num_shard_bits = kDefaultNumShardBits);
+
+// Create a new cache with a fixed size capacity.  This implementation
+// of Cache uses a segmented LRU eviction policy: new entries are put on
+// probation and only promoted to a protected segment once they are looked
+// up again, so that a scan over many cold keys evicts the other cold keys
+// rather than the hot ones.
+LEVELDB_EXPORT Cache* NewSLRUCache(size_t capacity,
+                                   int num_shard_bits = kDefaultNumShardBits);
+
+// Create a new cache with a fixed size capacity.  This implementation
+// of Cache approximates LRU with the CLOCK algorithm and is optimized for
+// concurrent lookups of a few hot keys: lookups share the lock of their
+// shard and Release() takes none.
+LEVELDB_EXPORT Cache* NewClockCache(size_t capacity,
+                                    int num_shard_bits = kDefaultNumShardBits);
 
 class LEVELDB_EXPORT Cache {
  public:
@@ -140,6 +164,12 @@ class LEVELDB_EXPORT Cache {
   // Opaque handle to an entry stored in the cache.
   struct Handle {};
 
+  // Eviction priority of an entry.  kHigh entries are only evicted when no
+  // kLow entry is left to evict.  kPinned entries are never evicted, they
+  // only leave the cache through Erase(), or when a new entry is inserted
+  // under their key.
+  enum class Priority { kLow, kHigh, kPinned };
+
   // Insert a mapping from key->value into the cache and assign it
   // the specified charge against the total cache capacity.
   //
@@ -150,8 +180,15 @@ class LEVELDB_EXPORT Cache {
   // When the inserted entry is no longer needed, the key and
   // value will be passed to "deleter".
   virtual Handle* Insert(const Slice& key, void* value, size_t charge,
+                         Priority priority,
                          void (*deleter)(const char *key, size_t keylen, void* value)) = 0;
 
+  // Same as above, with Priority::kLow.
+  Handle* Insert(const Slice& key, void* value, size_t charge,
+                 void (*deleter)(const char *key, size_t keylen, void* value)) {
+    return Insert(key, value, charge, Priority::kLow, deleter);
+  }
+
   // If the cache has no mapping for "key", returns nullptr.
   //
   // Else return a handle that corresponds to the mapping.  The caller
@@ -159,6 +196,34 @@ class LEVELDB_EXPORT Cache {
   // longer needed.
   virtual Handle* Lookup(const Slice& key) = 0;
 
+  // Outcome of a LookupOrLoad().
+  struct LoadInfo {
+    bool loaded = false;  // Whether this call ran the loader.
+    bool waited = false;  // Whether this call waited for another caller's load.
+    int error = 0;        // The non-zero value returned by a failed loader.
+    double seconds = 0;   // Time spent loading or waiting, in seconds.
+  };
+
+  // Loader of LookupOrLoad(): store the value of key and its charge and
+  // return 0, or return a non-zero error code.
+  typedef int (*Loader)(void* arg, const char* key, size_t keylen,
+                        void** value, size_t* charge);
+
+  // Like Lookup(), but on a miss call loader and Insert() the value it
+  // loaded, with the given priority and deleter.  The loader runs without
+  // holding the cache's locks.  Concurrent callers missing on the same key
+  // do not run their loader, they wait for the first one and share its
+  // value instead.
+  //
+  // Returns nullptr if the load failed, both to the caller that ran the
+  // loader and to the callers waiting for it.  When info is not nullptr,
+  // it is filled with the outcome of the call.
+  // REQUIRES: loader must not call back into this cache for the same key.
+  virtual Handle* LookupOrLoad(const Slice& key, Loader loader, void* arg,
+                               Priority priority,
+                               void (*deleter)(const char *key, size_t keylen, void* value),
+                               LoadInfo* info) = 0;
+
   // Release a mapping returned by a previous Lookup().
   // REQUIRES: handle must not have been released yet.
   // REQUIRES: handle must have been returned by a method on *this.
@@ -181,7 +246,8 @@ class LEVELDB_EXPORT Cache {
   // its cache keys.
   virtual uint64_t NewId() = 0;
 
-  // Remove all cache entries that are not actively in use.  Memory-constrained
+  // Remove all cache entries that are not actively in use, except the pinned
+  // ones.  Memory-constrained
   // applications may wish to call this method to reduce memory usage.
   // Default implementation of Prune() does nothing.  Subclasses are strongly
   // encouraged to override the default implementation.  A future release of
@@ -192,6 +258,66 @@ class LEVELDB_EXPORT Cache {
   // cache.
   virtual size_t TotalCharge() const = 0;
 
+  // Change the capacity of the cache in place.  Shrinking evicts the least
+  // recently used entries until the cache fits; the entries in use or
+  // pinned stay, and are evicted once released (except the pinned ones).
+  // Default implementation of SetCapacity() does nothing.
+  virtual void SetCapacity(size_t capacity) { (void)capacity; }
+
+  // Do not cache the entries charged more than ratio of the capacity,
+  // except the pinned ones: Insert() and LookupOrLoad() hand them to their
+  // caller uncached, and they are deleted once released.  Defaults to 1, an
+  // entry larger than the whole cache is never cached.  Default
+  // implementation of SetAdmissionRatio() does nothing.
+  virtual void SetAdmissionRatio(double ratio) { (void)ratio; }
+
+  // Counters of a shard of the cache, since the cache was created.
+  struct Stats {
+    size_t capacity = 0;
+    size_t usage = 0;            // Combined charge of the entries.
+    size_t entries = 0;
+    uint64_t hits = 0;           // Lookups, and LookupOrLoad() calls that
+    uint64_t misses = 0;         // found the key without waiting, or not.
+    uint64_t inserts = 0;
+    uint64_t rejects = 0;        // Inserts not cached, see SetAdmissionRatio().
+    uint64_t evictions = 0;      // Entries evicted to make room, not erased.
+    uint64_t bytes_evicted = 0;  // Combined charge of the evicted entries.
+    uint64_t erased_in_use = 0;  // Entries erased or replaced while a
+                                 // handle to them was still held.
+    uint64_t lock_waits = 0;     // Operations that found the shard locked.
+    uint64_t loads = 0;          // Loaders run by LookupOrLoad().
+    uint64_t load_failures = 0;
+    double load_seconds = 0;     // Cumulative time spent in loaders.
+  };
+
+  // An entry of the cache, as listed by GetEntries().
+  struct EntryInfo {
+    std::string key;
+    size_t charge;
+    uint32_t refs;  // Handles held by clients.
+    Priority priority;
+    bool in_protected;    // Whether it is in the protected segment.
+    int shard;
+    int64_t inserted_at;  // Microseconds since the Unix epoch.
+    int64_t last_access;  // Last insert or lookup, idem.
+  };
+
+  // Return the number of shards of the cache, see GetStats().
+  virtual int NumShards() const { return 1; }
+
+  // Return the counters of shard, in [0, NumShards()).  Default
+  // implementation of GetStats() counts nothing.
+  virtual Stats GetStats(int shard) const {
+    (void)shard;
+    return Stats();
+  }
+
+  // Append a snapshot of the entries of the cache to *entries, shard by
+  // shard.  Default implementation of GetEntries() lists nothing.
+  virtual void GetEntries(std::vector<EntryInfo>* entries) const {
+    (void)entries;
+  }
+
  private:
   void LRU_Remove(Handle* e);
   void LRU_Append(Handle* e);
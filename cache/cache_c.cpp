@@ -4,11 +4,14 @@
     See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
 */
 
+#include <cstdlib>
 #include <functional>
 #include <iostream>
+#include <vector>
 
 #include "cache_c.h"
 #include "cache.h"
+#include "shared_image.h"
 
 #ifndef CATCH_AND_HANDLE
 #define CATCH_AND_HANDLE                                     \
@@ -19,11 +22,29 @@
   }
 #endif /* CATCH_AND_HANDLE */
 
-cache_t *cache_create_lru(size_t capacity)
+cache_t *cache_create_lru(size_t capacity, int num_shard_bits)
 {
   try
   {
-    return reinterpret_cast<cache_t *>(NewLRUCache(capacity));
+    return reinterpret_cast<cache_t *>(NewLRUCache(capacity, num_shard_bits));
+  }
+  CATCH_AND_HANDLE
+}
+
+cache_t *cache_create_slru(size_t capacity, int num_shard_bits)
+{
+  try
+  {
+    return reinterpret_cast<cache_t *>(NewSLRUCache(capacity, num_shard_bits));
+  }
+  CATCH_AND_HANDLE
+}
+
+cache_t *cache_create_clock(size_t capacity, int num_shard_bits)
+{
+  try
+  {
+    return reinterpret_cast<cache_t *>(NewClockCache(capacity, num_shard_bits));
   }
   CATCH_AND_HANDLE
 }
@@ -46,6 +67,15 @@ handle_t *cache_insert(cache_t *cache, const char *key, size_t keylen, void *val
   CATCH_AND_HANDLE
 }
 
+handle_t *cache_insert_priority(cache_t *cache, const char *key, size_t keylen, void *value, size_t charge, cache_priority priority, void (*deleter)(const char *key, size_t keylen, void *value))
+{
+  try
+  {
+    return reinterpret_cast<handle_t *>(reinterpret_cast<Cache *>(cache)->Insert(Slice(key, keylen), value, charge, static_cast<Cache::Priority>(priority), deleter));
+  }
+  CATCH_AND_HANDLE
+}
+
 handle_t *cache_lookup(cache_t *cache, const char *key, size_t keylen)
 {
   try
@@ -55,6 +85,24 @@ handle_t *cache_lookup(cache_t *cache, const char *key, size_t keylen)
   CATCH_AND_HANDLE
 }
 
+handle_t *cache_lookup_or_load(cache_t *cache, const char *key, size_t keylen, cache_loader loader, void *arg, cache_priority priority, void (*deleter)(const char *key, size_t keylen, void *value), cache_load_info *info)
+{
+  try
+  {
+    Cache::LoadInfo load_info;
+    Cache::Handle *handle = reinterpret_cast<Cache *>(cache)->LookupOrLoad(Slice(key, keylen), loader, arg, static_cast<Cache::Priority>(priority), deleter, &load_info);
+    if (info)
+    {
+      info->loaded = load_info.loaded;
+      info->waited = load_info.waited;
+      info->error = load_info.error;
+      info->seconds = load_info.seconds;
+    }
+    return reinterpret_cast<handle_t *>(handle);
+  }
+  CATCH_AND_HANDLE
+}
+
 void cache_release(cache_t *cache, handle_t *handle)
 {
   try
@@ -108,3 +156,153 @@ size_t cache_total_charge(cache_t *cache)
   }
   CATCH_AND_HANDLE
 }
+
+void cache_set_capacity(cache_t *cache, size_t capacity)
+{
+  try
+  {
+    reinterpret_cast<Cache *>(cache)->SetCapacity(capacity);
+  }
+  CATCH_AND_HANDLE
+}
+
+void cache_set_admission_ratio(cache_t *cache, double ratio)
+{
+  try
+  {
+    reinterpret_cast<Cache *>(cache)->SetAdmissionRatio(ratio);
+  }
+  CATCH_AND_HANDLE
+}
+
+int cache_num_shards(cache_t *cache)
+{
+  try
+  {
+    return reinterpret_cast<Cache *>(cache)->NumShards();
+  }
+  CATCH_AND_HANDLE
+}
+
+void cache_shard_counters(cache_t *cache, int shard, cache_counters *counters)
+{
+  try
+  {
+    Cache::Stats s = reinterpret_cast<Cache *>(cache)->GetStats(shard);
+    counters->capacity = s.capacity;
+    counters->usage = s.usage;
+    counters->entries = s.entries;
+    counters->hits = s.hits;
+    counters->misses = s.misses;
+    counters->inserts = s.inserts;
+    counters->rejects = s.rejects;
+    counters->evictions = s.evictions;
+    counters->bytes_evicted = s.bytes_evicted;
+    counters->erased_in_use = s.erased_in_use;
+    counters->lock_waits = s.lock_waits;
+    counters->loads = s.loads;
+    counters->load_failures = s.load_failures;
+    counters->load_seconds = s.load_seconds;
+  }
+  CATCH_AND_HANDLE
+}
+
+size_t cache_list_entries(cache_t *cache, cache_entry_info **entries)
+{
+  try
+  {
+    std::vector<Cache::EntryInfo> infos;
+    reinterpret_cast<Cache *>(cache)->GetEntries(&infos);
+    *entries = static_cast<cache_entry_info *>(calloc(infos.size() + 1, sizeof(cache_entry_info)));
+    if (*entries == nullptr)
+    {
+      throw std::bad_alloc();
+    }
+    for (size_t i = 0; i < infos.size(); i++)
+    {
+      cache_entry_info *entry = &(*entries)[i];
+      entry->key = static_cast<char *>(malloc(infos[i].key.size() + 1));
+      if (entry->key == nullptr)
+      {
+        cache_free_entries(*entries, i);
+        throw std::bad_alloc();
+      }
+      memcpy(entry->key, infos[i].key.data(), infos[i].key.size());
+      entry->key[infos[i].key.size()] = '\0';
+      entry->keylen = infos[i].key.size();
+      entry->charge = infos[i].charge;
+      entry->refs = infos[i].refs;
+      entry->priority = static_cast<cache_priority>(infos[i].priority);
+      entry->in_protected = infos[i].in_protected;
+      entry->shard = infos[i].shard;
+      entry->inserted_at = infos[i].inserted_at;
+      entry->last_access = infos[i].last_access;
+    }
+    return infos.size();
+  }
+  CATCH_AND_HANDLE
+}
+
+void cache_free_entries(cache_entry_info *entries, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    free(entries[i].key);
+  }
+  free(entries);
+}
+
+shared_image_t *shared_image_attach(const char *dir, const char *key, size_t keylen)
+{
+  try
+  {
+    return reinterpret_cast<shared_image_t *>(SharedImage::Attach(dir, Slice(key, keylen)));
+  }
+  CATCH_AND_HANDLE
+}
+
+int shared_image_publish(const char *dir, const char *key, size_t keylen, const void *data, size_t size, size_t capacity)
+{
+  try
+  {
+    return SharedImage::Publish(dir, Slice(key, keylen), data, size, capacity) ? 0 : -1;
+  }
+  CATCH_AND_HANDLE
+}
+
+int shared_image_remove(const char *dir, const char *key, size_t keylen)
+{
+  try
+  {
+    return SharedImage::Remove(dir, Slice(key, keylen)) ? 1 : 0;
+  }
+  CATCH_AND_HANDLE
+}
+
+long shared_image_clear(const char *dir)
+{
+  try
+  {
+    return SharedImage::Clear(dir);
+  }
+  CATCH_AND_HANDLE
+}
+
+const void *shared_image_data(shared_image_t *image)
+{
+  return reinterpret_cast<SharedImage *>(image)->data();
+}
+
+size_t shared_image_size(shared_image_t *image)
+{
+  return reinterpret_cast<SharedImage *>(image)->size();
+}
+
+void shared_image_detach(shared_image_t *image)
+{
+  try
+  {
+    delete reinterpret_cast<SharedImage *>(image);
+  }
+  CATCH_AND_HANDLE
+}
@@ -16,18 +16,94 @@ extern "C"
 #endif
     typedef struct cache_t cache_t;
     typedef struct handle_t handle_t;
+    typedef struct shared_image_t shared_image_t;
 
-    cache_t *cache_create_lru(size_t capacity);
+    /* eviction priority of an entry, see Cache::Priority */
+    typedef enum cache_priority
+    {
+        CACHE_PRIORITY_LOW,
+        CACHE_PRIORITY_HIGH,
+        CACHE_PRIORITY_PINNED,
+    } cache_priority;
+
+    /* outcome of cache_lookup_or_load(), see Cache::LoadInfo */
+    typedef struct cache_load_info
+    {
+        int loaded;     /* whether this call ran the loader */
+        int waited;     /* whether this call waited for another caller's load */
+        int error;      /* the non-zero value returned by a failed loader */
+        double seconds; /* time spent loading or waiting */
+    } cache_load_info;
+
+    /* counters of a cache shard since the cache was created, see Cache::Stats */
+    typedef struct cache_counters
+    {
+        size_t capacity;
+        size_t usage;
+        size_t entries;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t inserts;
+        uint64_t rejects; /* inserts not cached, see cache_set_admission_ratio() */
+        uint64_t evictions;
+        uint64_t bytes_evicted;
+        uint64_t erased_in_use; /* entries erased or replaced while a handle was still held */
+        uint64_t lock_waits;    /* operations that found the shard locked */
+        uint64_t loads;
+        uint64_t load_failures;
+        double load_seconds;
+    } cache_counters;
+
+    /* an entry of the cache, see Cache::EntryInfo */
+    typedef struct cache_entry_info
+    {
+        char *key;
+        size_t keylen;
+        size_t charge;
+        uint32_t refs; /* handles held by clients */
+        cache_priority priority;
+        int in_protected;
+        int shard;
+        int64_t inserted_at; /* microseconds since the unix epoch */
+        int64_t last_access;
+    } cache_entry_info;
+
+    /* loader of cache_lookup_or_load(): set *value and *charge and return 0, or return an error code */
+    typedef int (*cache_loader)(void *arg, const char *key, size_t keylen, void **value, size_t *charge);
+
+    /* the caches are split into 2^num_shard_bits independently locked shards, sharing the capacity */
+    cache_t *cache_create_lru(size_t capacity, int num_shard_bits);
+    cache_t *cache_create_slru(size_t capacity, int num_shard_bits);
+    cache_t *cache_create_clock(size_t capacity, int num_shard_bits);
     void cache_destroy(cache_t *cache);
 
     handle_t *cache_insert(cache_t *cache, const char *key, size_t keylen, void *value, size_t charge, void (*deleter)(const char *key, size_t keylen, void *value));
+    handle_t *cache_insert_priority(cache_t *cache, const char *key, size_t keylen, void *value, size_t charge, cache_priority priority, void (*deleter)(const char *key, size_t keylen, void *value));
     handle_t *cache_lookup(cache_t *cache, const char *key, size_t keylen);
+    handle_t *cache_lookup_or_load(cache_t *cache, const char *key, size_t keylen, cache_loader loader, void *arg, cache_priority priority, void (*deleter)(const char *key, size_t keylen, void *value), cache_load_info *info);
     void cache_release(cache_t *cache, handle_t *handle);
     void *cache_value(cache_t *cache, handle_t *handle);
     void cache_erase(cache_t *cache, const char *key, size_t keylen);
     uint64_t cache_new_id(cache_t *cache);
     void cache_prune(cache_t *cache);
     size_t cache_total_charge(cache_t *cache);
+    /* change the capacity in place, evicting the least recently used entries when shrinking */
+    void cache_set_capacity(cache_t *cache, size_t capacity);
+    /* entries charged more than ratio of the capacity are not cached, unless pinned */
+    void cache_set_admission_ratio(cache_t *cache, double ratio);
+    int cache_num_shards(cache_t *cache);
+    void cache_shard_counters(cache_t *cache, int shard, cache_counters *counters);
+    /* snapshot the entries into a malloc()ed *entries, to free with cache_free_entries(). return their number */
+    size_t cache_list_entries(cache_t *cache, cache_entry_info **entries);
+    void cache_free_entries(cache_entry_info *entries, size_t n);
+
+    shared_image_t *shared_image_attach(const char *dir, const char *key, size_t keylen);
+    int shared_image_publish(const char *dir, const char *key, size_t keylen, const void *data, size_t size, size_t capacity);
+    int shared_image_remove(const char *dir, const char *key, size_t keylen);
+    long shared_image_clear(const char *dir);
+    const void *shared_image_data(shared_image_t *image);
+    size_t shared_image_size(shared_image_t *image);
+    void shared_image_detach(shared_image_t *image);
 
 #ifdef __cplusplus
 } /* end extern "C" */
@@ -0,0 +1,237 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#include "shared_image.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+namespace {
+
+const char kMagic[8] = {'V', 'R', 'I', 'M', 'A', 'G', 'E', '\0'};
+const uint32_t kVersion = 1;
+const size_t kDataAlignment = 64;
+const char kSuffix[] = ".img";
+const char kTempSuffix[] = ".tmp";
+
+// On-disk layout: ImageHeader, key bytes, padding, data.
+struct ImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t key_length;
+  uint64_t data_offset;
+  uint64_t data_size;
+};
+
+// FNV-1a; only used to name the files, the key itself is stored in the image.
+uint64_t HashKey(const Slice& key) {
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < key.size(); i++) {
+    h ^= static_cast<uint8_t>(key[i]);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+std::string ImagePath(const std::string& dir, const Slice& key) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx%s",
+           static_cast<unsigned long long>(HashKey(key)), kSuffix);
+  return dir + "/" + name;
+}
+
+bool HasSuffix(const char* name, const char* suffix) {
+  const size_t len = strlen(name);
+  const size_t suffix_len = strlen(suffix);
+  return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+bool IsImageName(const char* name) { return HasSuffix(name, kSuffix); }
+
+bool WriteAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    size -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+// Remove the least recently attached images until "incoming" more bytes fit
+// in capacity.
+void EnsureCapacity(const std::string& dir, size_t incoming, size_t capacity) {
+  struct Entry {
+    time_t mtime;
+    size_t size;
+    std::string path;
+  };
+  std::vector<Entry> entries;
+  size_t total = 0;
+
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) {
+    return;
+  }
+  while (struct dirent* de = readdir(d)) {
+    if (!IsImageName(de->d_name)) {
+      continue;
+    }
+    std::string path = dir + "/" + de->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+      entries.push_back(Entry{st.st_mtime, static_cast<size_t>(st.st_size), path});
+      total += static_cast<size_t>(st.st_size);
+    }
+  }
+  closedir(d);
+
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+  for (size_t i = 0; i < entries.size() && total + incoming > capacity; i++) {
+    if (unlink(entries[i].path.c_str()) == 0) {
+      total -= entries[i].size;
+    }
+  }
+}
+
+}  // namespace
+
+SharedImage::~SharedImage() { munmap(base_, mapped_); }
+
+SharedImage* SharedImage::Attach(const std::string& dir, const Slice& key) {
+  const std::string path = ImagePath(dir, key);
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(ImageHeader)) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return nullptr;
+  }
+  const size_t mapped = static_cast<size_t>(st.st_size);
+  void* base = mmap(nullptr, mapped, PROT_READ, MAP_SHARED, fd, 0);
+  // Touch the image so that EnsureCapacity() evicts it last.
+  futimens(fd, nullptr);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return nullptr;
+  }
+
+  const ImageHeader* header = static_cast<const ImageHeader*>(base);
+  const char* stored_key = static_cast<const char*>(base) + sizeof(ImageHeader);
+  if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header->version != kVersion || header->key_length != key.size() ||
+      sizeof(ImageHeader) + header->key_length > mapped ||
+      Slice(stored_key, header->key_length) != key ||
+      header->data_offset > mapped ||
+      header->data_size > mapped - header->data_offset) {
+    // Another key hashing to the same file, or a foreign file.
+    munmap(base, mapped);
+    errno = ENOENT;
+    return nullptr;
+  }
+
+  return new SharedImage(base, mapped,
+                         static_cast<const char*>(base) + header->data_offset,
+                         header->data_size);
+}
+
+bool SharedImage::Publish(const std::string& dir, const Slice& key,
+                          const void* data, size_t size, size_t capacity) {
+  if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+    return false;
+  }
+
+  ImageHeader header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.key_length = static_cast<uint32_t>(key.size());
+  header.data_offset = (sizeof(ImageHeader) + key.size() + kDataAlignment - 1) /
+                       kDataAlignment * kDataAlignment;
+  header.data_size = size;
+  const size_t padding = header.data_offset - sizeof(ImageHeader) - key.size();
+  const char zeros[kDataAlignment] = {0};
+
+  if (capacity > 0) {
+    EnsureCapacity(dir, header.data_offset + size, capacity);
+  }
+
+  const std::string path = ImagePath(dir, key);
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d%s", static_cast<int>(getpid()),
+           kTempSuffix);
+  const std::string tmp_path = path + suffix;
+
+  int fd = open(tmp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = WriteAll(fd, &header, sizeof(header)) &&
+            WriteAll(fd, key.data(), key.size()) &&
+            WriteAll(fd, zeros, padding) && WriteAll(fd, data, size);
+  int saved_errno = errno;
+  if (close(fd) != 0 && ok) {
+    ok = false;
+    saved_errno = errno;
+  }
+  // Readers only ever see complete images.
+  if (ok && rename(tmp_path.c_str(), path.c_str()) != 0) {
+    ok = false;
+    saved_errno = errno;
+  }
+  if (!ok) {
+    unlink(tmp_path.c_str());
+    errno = saved_errno;
+  }
+  return ok;
+}
+
+bool SharedImage::Remove(const std::string& dir, const Slice& key) {
+  SharedImage* image = Attach(dir, key);
+  if (image == nullptr) {
+    return false;
+  }
+  delete image;
+  return unlink(ImagePath(dir, key).c_str()) == 0;
+}
+
+long SharedImage::Clear(const std::string& dir) {
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  long removed = 0;
+  while (struct dirent* de = readdir(d)) {
+    // Also drop the leftovers of interrupted Publish() calls.
+    if ((IsImageName(de->d_name) || HasSuffix(de->d_name, kTempSuffix)) &&
+        unlink((dir + "/" + de->d_name).c_str()) == 0) {
+      removed++;
+    }
+  }
+  closedir(d);
+  return removed;
+}
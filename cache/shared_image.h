@@ -0,0 +1,66 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+// A SharedImage is a read-only, memory mapped byte string published under a
+// key in a directory shared by every process of the host (typically on a
+// tmpfs such as /dev/shm).  The first process that needs a value publishes
+// it once; all the others attach the same physical pages instead of building
+// their own copy.
+//
+// Images are immutable: Publish() writes a temporary file and renames it over
+// the final name, so an attached image is always complete, and replacing or
+// removing an image never invalidates the mappings that are still attached.
+//
+// The images of a directory may be bounded by a capacity in bytes, in which
+// case Publish() removes the least recently attached images first.
+
+#ifndef SHARED_IMAGE_H_
+#define SHARED_IMAGE_H_
+
+#include <cstddef>
+#include <string>
+
+#include "cache.h"
+
+class SharedImage {
+ public:
+  SharedImage(const SharedImage&) = delete;
+  SharedImage& operator=(const SharedImage&) = delete;
+
+  // Unmaps the image.
+  ~SharedImage();
+
+  // Map the image published under key in dir.  Returns nullptr if there is
+  // none (or on error, with errno set).
+  static SharedImage* Attach(const std::string& dir, const Slice& key);
+
+  // Publish data[0,size) under key in dir, replacing any previous image.
+  // When capacity is not 0, older images are removed so that the directory
+  // stays within capacity bytes.  Returns false on error, with errno set.
+  static bool Publish(const std::string& dir, const Slice& key,
+                      const void* data, size_t size, size_t capacity);
+
+  // Remove the image published under key.  Returns false if there was none.
+  static bool Remove(const std::string& dir, const Slice& key);
+
+  // Remove every image of dir.  Returns the number of images removed, or -1
+  // on error with errno set.
+  static long Clear(const std::string& dir);
+
+  const void* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  SharedImage(void* base, size_t mapped, const void* data, size_t size)
+      : base_(base), mapped_(mapped), data_(data), size_(size) {}
+
+  void* base_;
+  size_t mapped_;
+  const void* data_;
+  size_t size_;
+};
+
+#endif  // SHARED_IMAGE_H_
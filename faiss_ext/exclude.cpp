@@ -0,0 +1,139 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#include "exclude.h"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexHNSW.h>
+#include <faiss/IndexIDMap.h>
+#include <faiss/IndexIVF.h>
+#include <faiss/impl/AuxIndexStructures.h>
+#include <faiss/impl/IDSelector.h>
+
+namespace faiss_ext {
+
+namespace {
+
+// Selects the ids missing from a sorted array, without copying it into a
+// hash set as faiss::IDSelectorBatch would.
+class IDSelectorNotSorted : public faiss::IDSelector {
+ public:
+  IDSelectorNotSorted(const int64_t* ids, size_t n) : ids_(ids), n_(n) {}
+
+  bool is_member(faiss::idx_t id) const override {
+    return !std::binary_search(ids_, ids_ + n_, id);
+  }
+
+ private:
+  const int64_t* ids_;
+  size_t n_;
+};
+
+// Search parameters filtering the search of index through sel, with the
+// settings of the index itself, or nullptr if index can't take a selector.
+std::unique_ptr<faiss::SearchParameters> SelectorParams(
+    const faiss::Index* index, const faiss::IDSelector* sel) {
+  if (auto idmap = dynamic_cast<const faiss::IndexIDMap*>(index)) {
+    // IndexIDMap translates sel to the ids of the index it wraps
+    return SelectorParams(idmap->index, sel);
+  }
+  if (auto ivf = dynamic_cast<const faiss::IndexIVF*>(index)) {
+    auto params = std::make_unique<faiss::SearchParametersIVF>();
+    params->nprobe = ivf->nprobe;
+    params->max_codes = ivf->max_codes;
+    params->sel = const_cast<faiss::IDSelector*>(sel);
+    return params;
+  }
+  if (auto hnsw = dynamic_cast<const faiss::IndexHNSW*>(index)) {
+    auto params = std::make_unique<faiss::SearchParametersHNSW>();
+    params->efSearch = hnsw->hnsw.efSearch;
+    params->sel = const_cast<faiss::IDSelector*>(sel);
+    return params;
+  }
+  if (dynamic_cast<const faiss::IndexFlat*>(index)) {
+    auto params = std::make_unique<faiss::SearchParameters>();
+    params->sel = const_cast<faiss::IDSelector*>(sel);
+    return params;
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+void SearchExcluding(const faiss::Index* index, int64_t n, const float* x,
+                     int64_t k, const int64_t* excluded, size_t nexcluded,
+                     float* distances, int64_t* labels) {
+  IDSelectorNotSorted sel(excluded, nexcluded);
+  std::unique_ptr<faiss::SearchParameters> params =
+      nexcluded ? SelectorParams(index, &sel) : nullptr;
+  if (nexcluded == 0 || params) {
+    index->search(n, x, k, distances, labels, params.get());
+    return;
+  }
+
+  // past ntotal, searching more neighbors only adds padding
+  int64_t fetch = std::max<int64_t>(
+      k, std::min<int64_t>(k + static_cast<int64_t>(nexcluded), index->ntotal));
+  std::vector<float> all_distances(n * fetch);
+  std::vector<int64_t> all_labels(n * fetch);
+  index->search(n, x, fetch, all_distances.data(), all_labels.data());
+
+  float padding = index->metric_type == faiss::METRIC_INNER_PRODUCT
+                      ? std::numeric_limits<float>::lowest()
+                      : std::numeric_limits<float>::max();
+  for (int64_t q = 0; q < n; q++) {
+    const float* from_distances = all_distances.data() + q * fetch;
+    const int64_t* from_labels = all_labels.data() + q * fetch;
+    float* to_distances = distances + q * k;
+    int64_t* to_labels = labels + q * k;
+    int64_t kept = 0;
+    for (int64_t i = 0; i < fetch && kept < k; i++) {
+      if (from_labels[i] < 0 || !sel.is_member(from_labels[i])) {
+        continue;
+      }
+      to_distances[kept] = from_distances[i];
+      to_labels[kept] = from_labels[i];
+      kept++;
+    }
+    std::fill(to_distances + kept, to_distances + k, padding);
+    std::fill(to_labels + kept, to_labels + k, -1);
+  }
+}
+
+void RangeSearchExcluding(const faiss::Index* index, int64_t n,
+                          const float* x, float radius,
+                          const int64_t* excluded, size_t nexcluded,
+                          faiss::RangeSearchResult* result) {
+  index->range_search(n, x, radius, result);
+  if (nexcluded == 0) {
+    return;
+  }
+
+  // compact the results in place, the kept ones never move forward
+  IDSelectorNotSorted sel(excluded, nexcluded);
+  size_t kept = 0;
+  for (int64_t q = 0; q < n; q++) {
+    size_t begin = result->lims[q];
+    size_t end = result->lims[q + 1];
+    result->lims[q] = kept;
+    for (size_t i = begin; i < end; i++) {
+      if (!sel.is_member(result->labels[i])) {
+        continue;
+      }
+      result->distances[kept] = result->distances[i];
+      result->labels[kept] = result->labels[i];
+      kept++;
+    }
+  }
+  result->lims[n] = kept;
+}
+
+}  // namespace faiss_ext
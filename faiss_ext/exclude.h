@@ -0,0 +1,38 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#ifndef FAISS_EXT_EXCLUDE_H_
+#define FAISS_EXT_EXCLUDE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <faiss/Index.h>
+
+namespace faiss_ext {
+
+// Search the k nearest neighbors of the n queries x in index, skipping the
+// nexcluded ids of excluded, sorted ascending.  Flat, IVF and HNSW indexes,
+// also under an IndexIDMap, skip them during the search through an
+// IDSelector, keeping their own nprobe or efSearch.  Others search the
+// k + nexcluded nearest neighbors, at most nexcluded of which are excluded,
+// and drop them.  Results are padded with -1 labels.
+void SearchExcluding(const faiss::Index* index, int64_t n, const float* x,
+                     int64_t k, const int64_t* excluded, size_t nexcluded,
+                     float* distances, int64_t* labels);
+
+// Search the neighbors within radius of the n queries x in index into
+// result, dropping the nexcluded ids of excluded, sorted ascending.  A range
+// search has no k to fill, so the results are filtered after the search and
+// the lims of result are recomputed.
+void RangeSearchExcluding(const faiss::Index* index, int64_t n,
+                          const float* x, float radius,
+                          const int64_t* excluded, size_t nexcluded,
+                          faiss::RangeSearchResult* result);
+
+}  // namespace faiss_ext
+
+#endif  // FAISS_EXT_EXCLUDE_H_
@@ -0,0 +1,190 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#include "faiss_ext_c.h"
+#include "exclude.h"
+#include "footprint.h"
+#include "index_store.h"
+#include "io.h"
+#include "shards.h"
+#include "threads.h"
+#include "train.h"
+
+#include "c_api/macros_impl.h"
+
+int faiss_read_index_buf_zero_copy(void)
+{
+  return faiss_ext::ZeroCopySupported() ? 1 : 0;
+}
+
+int faiss_read_index_buf(const void *buf, size_t size, int io_flags, int zero_copy, FaissIndex **p_out)
+{
+  try
+  {
+    *p_out = reinterpret_cast<FaissIndex *>(faiss_ext::ReadIndex(buf, size, io_flags, zero_copy != 0));
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_write_index_size(const FaissIndex *index, size_t *p_size)
+{
+  try
+  {
+    *p_size = faiss_ext::SerializedSize(reinterpret_cast<const faiss::Index *>(index));
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_write_index_buf(const FaissIndex *index, void *buf, size_t capacity, size_t *p_written)
+{
+  try
+  {
+    *p_written = faiss_ext::WriteIndex(reinterpret_cast<const faiss::Index *>(index), buf, capacity);
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_read_index_chunks(faiss_chunk_fetch_fn fetch, void *arg, size_t nchunks, int io_flags, FaissIndex **p_out)
+{
+  try
+  {
+    *p_out = reinterpret_cast<FaissIndex *>(faiss_ext::ReadIndexChunks(fetch, arg, nchunks, io_flags));
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_write_index_range(const FaissIndex *index, size_t offset, void *buf, size_t capacity, size_t *p_written)
+{
+  try
+  {
+    *p_written = faiss_ext::WriteIndexRange(reinterpret_cast<const faiss::Index *>(index), offset, buf, capacity);
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_index_memory_footprint(const FaissIndex *index, size_t *p_bytes)
+{
+  try
+  {
+    *p_bytes = faiss_ext::MemoryFootprint(reinterpret_cast<const faiss::Index *>(index));
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_index_store_open(const char *dir, const char *key, size_t keylen, const char *version, int io_flags, FaissIndex **p_out)
+{
+  try
+  {
+    *p_out = reinterpret_cast<FaissIndex *>(
+        faiss_ext::OpenStoredIndex(dir, std::string(key, keylen), version, io_flags));
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_index_store_save(const char *dir, const char *key, size_t keylen, const char *version, const FaissIndex *index, size_t capacity)
+{
+  try
+  {
+    faiss_ext::StoreIndex(dir, std::string(key, keylen), version,
+                          reinterpret_cast<const faiss::Index *>(index), capacity);
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_index_store_remove(const char *dir, const char *key, size_t keylen, long *p_removed)
+{
+  try
+  {
+    *p_removed = faiss_ext::RemoveStoredIndex(dir, std::string(key, keylen));
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_index_store_clear(const char *dir, long *p_removed)
+{
+  try
+  {
+    *p_removed = faiss_ext::ClearIndexStore(dir);
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_index_train_sample_size(const FaissIndex *index, size_t *p_size)
+{
+  try
+  {
+    *p_size = faiss_ext::TrainSampleSize(reinterpret_cast<const faiss::Index *>(index));
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_index_merge_from(FaissIndex *index, FaissIndex *other)
+{
+  try
+  {
+    faiss_ext::MergeIndex(reinterpret_cast<faiss::Index *>(index), reinterpret_cast<faiss::Index *>(other));
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_omp_set_num_threads(int num_threads)
+{
+  try
+  {
+    faiss_ext::SetNumThreads(num_threads);
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_omp_get_num_procs(void)
+{
+  return faiss_ext::NumProcs();
+}
+
+int faiss_omp_set_wait_policy(int passive)
+{
+  try
+  {
+    faiss_ext::SetWaitPolicy(passive ? faiss_ext::WaitPolicy::kPassive : faiss_ext::WaitPolicy::kActive);
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_search_shards(const FaissIndex **shards, size_t nshards, idx_t n, const float *x, idx_t k, const idx_t **excluded, const size_t *nexcluded, float *distances, idx_t *labels)
+{
+  try
+  {
+    faiss_ext::SearchShards(reinterpret_cast<const faiss::Index *const *>(shards), nshards, n, x, k, excluded, nexcluded, distances, labels);
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_merge_knn_results(idx_t n, idx_t k, size_t nresults, FaissMetricType metric_type, const float *all_distances, const idx_t *all_labels, float *distances, idx_t *labels)
+{
+  try
+  {
+    faiss_ext::MergeKnnResults(n, k, nresults, static_cast<faiss::MetricType>(metric_type), all_distances, all_labels, distances, labels);
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_search_excluding(const FaissIndex *index, idx_t n, const float *x, idx_t k, const idx_t *excluded, size_t nexcluded, float *distances, idx_t *labels)
+{
+  try
+  {
+    faiss_ext::SearchExcluding(reinterpret_cast<const faiss::Index *>(index), n, x, k, excluded, nexcluded, distances, labels);
+  }
+  CATCH_AND_HANDLE
+}
+
+int faiss_range_search_excluding(const FaissIndex *index, idx_t n, const float *x, float radius, const idx_t *excluded, size_t nexcluded, FaissRangeSearchResult *result)
+{
+  try
+  {
+    faiss_ext::RangeSearchExcluding(reinterpret_cast<const faiss::Index *>(index), n, x, radius, excluded, nexcluded, reinterpret_cast<faiss::RangeSearchResult *>(result));
+  }
+  CATCH_AND_HANDLE
+}
@@ -0,0 +1,136 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#ifndef FAISS_EXT_C_H_
+#define FAISS_EXT_C_H_
+
+#include <stddef.h>
+
+#include "faiss/c_api/Index_c.h"
+
+/*
+ * C wrappers for the faiss C++ helpers that have no counterpart in faiss's
+ * own C API. Like the faiss C API, every function returns 0 on success and
+ * a negative value on failure, with the message in faiss_get_last_error().
+ */
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    /* Whether faiss_read_index_buf() can leave the index referencing buf. */
+    int faiss_read_index_buf_zero_copy(void);
+
+    /*
+     * Read an index serialized in buf[0, size) without going through stdio.
+     * With zero_copy, the code arrays may stay backed by buf, so buf must
+     * outlive the index and the index must not be modified.
+     */
+    int faiss_read_index_buf(const void *buf, size_t size, int io_flags, int zero_copy, FaissIndex **p_out);
+
+    /* Compute the exact number of bytes faiss_write_index() would produce. */
+    int faiss_write_index_size(const FaissIndex *index, size_t *p_size);
+
+    /* Serialize the index into buf[0, capacity), *p_written is the number of bytes used. */
+    int faiss_write_index_buf(const FaissIndex *index, void *buf, size_t capacity, size_t *p_written);
+
+    /*
+     * Chunk callback of faiss_read_index_chunks(): return chunk chunk_no in *data and *size.
+     * The data must stay valid until the next call. Returning non-zero aborts the read.
+     */
+    typedef int (*faiss_chunk_fetch_fn)(void *arg, size_t chunk_no, const void **data, size_t *size);
+
+    /* Read an index serialized across nchunks chunks, fetched in order through fetch. */
+    int faiss_read_index_chunks(faiss_chunk_fetch_fn fetch, void *arg, size_t nchunks, int io_flags, FaissIndex **p_out);
+
+    /*
+     * Serialize the bytes [offset, offset + capacity) of the index into buf, *p_written is the
+     * number of bytes used: less than capacity only at the end of the index. The whole index is
+     * walked, but only that range is kept.
+     */
+    int faiss_write_index_range(const FaissIndex *index, size_t offset, void *buf, size_t capacity, size_t *p_written);
+
+    /*
+     * Estimate the heap memory held by the index in *p_bytes. Arrays that are views into
+     * the buffer of a zero-copy faiss_read_index_buf() are not counted.
+     */
+    int faiss_index_memory_footprint(const FaissIndex *index, size_t *p_bytes);
+
+    /*
+     * Open the index stored under key and version in the index store dir, memory mapping
+     * what faiss can map. *p_out is NULL if there is no such index.
+     */
+    int faiss_index_store_open(const char *dir, const char *key, size_t keylen, const char *version, int io_flags, FaissIndex **p_out);
+
+    /*
+     * Store the index under key and version in dir, removing the other versions of key.
+     * When capacity is not 0, the least recently opened files are removed first so that
+     * dir stays within capacity bytes.
+     */
+    int faiss_index_store_save(const char *dir, const char *key, size_t keylen, const char *version, const FaissIndex *index, size_t capacity);
+
+    /* Remove every version of key from dir, *p_removed is the number of files removed. */
+    int faiss_index_store_remove(const char *dir, const char *key, size_t keylen, long *p_removed);
+
+    /* Remove every index of dir, *p_removed is the number of files removed. */
+    int faiss_index_store_clear(const char *dir, long *p_removed);
+
+    /*
+     * Number of training vectors past which training the index gains nothing, as faiss
+     * subsamples them to a number of points per centroid.
+     */
+    int faiss_index_train_sample_size(const FaissIndex *index, size_t *p_size);
+
+    /*
+     * Move the vectors of other into index, keeping their ids. Both must have been built from
+     * copies of the same trained index.
+     */
+    int faiss_index_merge_from(FaissIndex *index, FaissIndex *other);
+
+    /* Set the number of OpenMP threads of the faiss calls made from the calling thread from now on. */
+    int faiss_omp_set_num_threads(int num_threads);
+
+    /* Number of processors available to the process. */
+    int faiss_omp_get_num_procs(void);
+
+    /*
+     * Make the idle OpenMP threads sleep (passive) or spin a while (active) between faiss calls.
+     * Fails if the OpenMP runtime only takes its wait policy from OMP_WAIT_POLICY and the
+     * environment asks for the other one.
+     */
+    int faiss_omp_set_wait_policy(int passive);
+
+    /*
+     * Search the k nearest neighbors of the n queries x in each of the nshards indexes, sharing
+     * their dimension and metric, and merge them into distances and labels[n * k]. Unless excluded
+     * is NULL, shard i skips the nexcluded[i] ids of excluded[i], sorted ascending.
+     */
+    int faiss_search_shards(const FaissIndex **shards, size_t nshards, idx_t n, const float *x, idx_t k, const idx_t **excluded, const size_t *nexcluded, float *distances, idx_t *labels);
+
+    /*
+     * Merge the nresults k nearest neighbor lists of each of the n queries into distances and
+     * labels[n * k]. The list of result r for query q is at (r * n + q) * k of all_distances and
+     * all_labels, padded with -1 labels.
+     */
+    int faiss_merge_knn_results(idx_t n, idx_t k, size_t nresults, FaissMetricType metric_type, const float *all_distances, const idx_t *all_labels, float *distances, idx_t *labels);
+
+    /*
+     * Search the k nearest neighbors of the n queries x in index into distances and labels[n * k],
+     * skipping the nexcluded ids of excluded, sorted ascending.
+     */
+    int faiss_search_excluding(const FaissIndex *index, idx_t n, const float *x, idx_t k, const idx_t *excluded, size_t nexcluded, float *distances, idx_t *labels);
+
+    /*
+     * Range search the n queries x in index into result, dropping the nexcluded ids of excluded,
+     * sorted ascending.
+     */
+    int faiss_range_search_excluding(const FaissIndex *index, idx_t n, const float *x, float radius, const idx_t *excluded, size_t nexcluded, FaissRangeSearchResult *result);
+
+#ifdef __cplusplus
+} /* end extern "C" */
+#endif
+
+#endif /* FAISS_EXT_C_H_ */
@@ -0,0 +1,141 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#include "footprint.h"
+
+#include <unordered_map>
+#include <vector>
+
+#include <faiss/IndexFlatCodes.h>
+#include <faiss/IndexHNSW.h>
+#include <faiss/IndexIDMap.h>
+#include <faiss/IndexIVF.h>
+#include <faiss/IndexIVFPQ.h>
+#include <faiss/IndexPQ.h>
+#include <faiss/IndexPreTransform.h>
+#include <faiss/VectorTransform.h>
+#include <faiss/invlists/InvertedLists.h>
+
+#include "io.h"
+
+#ifdef FAISS_EXT_HAVE_ZERO_COPY
+#include <faiss/impl/maybe_owned_vector.h>
+#endif
+
+namespace faiss_ext {
+
+namespace {
+
+template <typename T>
+size_t VectorBytes(const std::vector<T>& v) {
+  return v.capacity() * sizeof(T);
+}
+
+#ifdef FAISS_EXT_HAVE_ZERO_COPY
+// A view into the zero-copy buffer costs nothing on its own.
+template <typename T>
+size_t VectorBytes(const faiss::MaybeOwnedVector<T>& v) {
+  return v.is_owner ? VectorBytes(v.owned_data) : 0;
+}
+#endif
+
+template <typename K, typename V>
+size_t HashMapBytes(const std::unordered_map<K, V>& m) {
+  // one node (next pointer, value, cached hash) per element plus the buckets
+  return m.size() * (sizeof(typename std::unordered_map<K, V>::value_type) +
+                     2 * sizeof(void*)) +
+         m.bucket_count() * sizeof(void*);
+}
+
+size_t InvertedListsBytes(const faiss::InvertedLists* invlists) {
+  if (auto ails = dynamic_cast<const faiss::ArrayInvertedLists*>(invlists)) {
+    size_t bytes = VectorBytes(ails->codes) + VectorBytes(ails->ids);
+    for (size_t i = 0; i < ails->nlist; i++) {
+      bytes += VectorBytes(ails->codes[i]) + VectorBytes(ails->ids[i]);
+    }
+    return bytes;
+  }
+  // Other inverted lists (e.g. OnDiskInvertedLists) are not held in memory.
+  return 0;
+}
+
+size_t TransformBytes(const faiss::VectorTransform* vt) {
+  if (auto lt = dynamic_cast<const faiss::LinearTransform*>(vt)) {
+    return sizeof(*lt) + VectorBytes(lt->A) + VectorBytes(lt->b);
+  }
+  return sizeof(*vt);
+}
+
+}  // namespace
+
+size_t MemoryFootprint(const faiss::Index* index) {
+  if (index == nullptr) {
+    return 0;
+  }
+
+  if (auto pt = dynamic_cast<const faiss::IndexPreTransform*>(index)) {
+    size_t bytes = sizeof(*pt) + VectorBytes(pt->chain);
+    for (const faiss::VectorTransform* vt : pt->chain) {
+      bytes += TransformBytes(vt);
+    }
+    if (pt->own_fields) {
+      bytes += MemoryFootprint(pt->index);
+    }
+    return bytes;
+  }
+
+  if (auto idmap = dynamic_cast<const faiss::IndexIDMap*>(index)) {
+    size_t bytes = sizeof(*idmap) + VectorBytes(idmap->id_map);
+    if (auto idmap2 = dynamic_cast<const faiss::IndexIDMap2*>(index)) {
+      bytes += HashMapBytes(idmap2->rev_map);
+    }
+    if (idmap->own_fields) {
+      bytes += MemoryFootprint(idmap->index);
+    }
+    return bytes;
+  }
+
+  if (auto hnsw = dynamic_cast<const faiss::IndexHNSW*>(index)) {
+    const faiss::HNSW& graph = hnsw->hnsw;
+    size_t bytes = sizeof(*hnsw) + VectorBytes(graph.assign_probas) +
+                   VectorBytes(graph.cum_nneighbor_per_level) +
+                   VectorBytes(graph.levels) + VectorBytes(graph.offsets) +
+                   VectorBytes(graph.neighbors);
+    if (hnsw->own_fields) {
+      bytes += MemoryFootprint(hnsw->storage);
+    }
+    return bytes;
+  }
+
+  if (auto ivf = dynamic_cast<const faiss::IndexIVF*>(index)) {
+    size_t bytes = sizeof(*ivf) + VectorBytes(ivf->direct_map.array) +
+                   HashMapBytes(ivf->direct_map.hashtable);
+    if (ivf->own_invlists) {
+      bytes += InvertedListsBytes(ivf->invlists);
+    }
+    if (ivf->own_fields) {
+      bytes += MemoryFootprint(ivf->quantizer);
+    }
+    if (auto ivfpq = dynamic_cast<const faiss::IndexIVFPQ*>(index)) {
+      bytes += VectorBytes(ivfpq->pq.centroids) +
+               ivfpq->precomputed_table.size() * sizeof(float);
+    }
+    return bytes;
+  }
+
+  // IndexFlat, IndexPQ, IndexScalarQuantizer, IndexLSH...
+  if (auto flat = dynamic_cast<const faiss::IndexFlatCodes*>(index)) {
+    size_t bytes = sizeof(*flat) + VectorBytes(flat->codes);
+    if (auto pq = dynamic_cast<const faiss::IndexPQ*>(index)) {
+      bytes += VectorBytes(pq->pq.centroids);
+    }
+    return bytes;
+  }
+
+  return SerializedSize(index);
+}
+
+}  // namespace faiss_ext
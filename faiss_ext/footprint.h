@@ -0,0 +1,27 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#ifndef FAISS_EXT_FOOTPRINT_H_
+#define FAISS_EXT_FOOTPRINT_H_
+
+#include <cstddef>
+
+#include <faiss/Index.h>
+
+namespace faiss_ext {
+
+// Estimate the heap memory held by a deserialized index: codes, graph links,
+// inverted lists, id maps, transforms and the sub-indexes it owns.  Arrays
+// that are views into the buffer of a zero-copy read are not counted, the
+// caller accounts for that buffer itself.
+//
+// Index types that are not walked explicitly are estimated by their
+// serialized size.
+size_t MemoryFootprint(const faiss::Index* index);
+
+}  // namespace faiss_ext
+
+#endif  // FAISS_EXT_FOOTPRINT_H_
@@ -0,0 +1,211 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#include "index_store.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/index_io.h>
+
+#include "io.h"
+
+namespace faiss_ext {
+
+namespace {
+
+const char kSuffix[] = ".faiss";
+const char kTempSuffix[] = ".tmp";
+
+// FNV-1a, names the files after the key and the version.
+uint64_t Hash(const std::string& s) {
+  uint64_t h = 14695981039346656037ull;
+  for (char c : s) {
+    h ^= static_cast<uint8_t>(c);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// <hash of key>-, the prefix of all the versions of key.
+std::string KeyPrefix(const std::string& key) {
+  char prefix[32];
+  snprintf(prefix, sizeof(prefix), "%016llx-",
+           static_cast<unsigned long long>(Hash(key)));
+  return prefix;
+}
+
+// <hash of key>-<hash of version>.faiss
+std::string FileName(const std::string& key, const std::string& version) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s%016llx%s", KeyPrefix(key).c_str(),
+           static_cast<unsigned long long>(Hash(version)), kSuffix);
+  return name;
+}
+
+bool HasSuffix(const char* name, const char* suffix) {
+  const size_t len = strlen(name);
+  const size_t suffix_len = strlen(suffix);
+  return len > suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+bool HasPrefix(const char* name, const std::string& prefix) {
+  return strncmp(name, prefix.c_str(), prefix.size()) == 0;
+}
+
+// Remove the files of dir whose name satisfies pred, except keep.
+template <typename Pred>
+long RemoveFiles(const std::string& dir, Pred pred, const char* keep) {
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) {
+    FAISS_THROW_IF_NOT_FMT(errno == ENOENT, "could not open directory %s: %s",
+                           dir.c_str(), strerror(errno));
+    return 0;
+  }
+  long removed = 0;
+  while (struct dirent* de = readdir(d)) {
+    if (pred(de->d_name) && (keep == nullptr || strcmp(de->d_name, keep) != 0) &&
+        unlink((dir + "/" + de->d_name).c_str()) == 0) {
+      removed++;
+    }
+  }
+  closedir(d);
+  return removed;
+}
+
+// Remove the least recently opened files until "incoming" more bytes fit in
+// capacity.
+void EnsureCapacity(const std::string& dir, size_t incoming, size_t capacity) {
+  struct Entry {
+    time_t mtime;
+    size_t size;
+    std::string path;
+  };
+  std::vector<Entry> entries;
+  size_t total = 0;
+
+  DIR* d = opendir(dir.c_str());
+  if (d == nullptr) {
+    return;
+  }
+  while (struct dirent* de = readdir(d)) {
+    if (!HasSuffix(de->d_name, kSuffix)) {
+      continue;
+    }
+    std::string path = dir + "/" + de->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+      entries.push_back(Entry{st.st_mtime, static_cast<size_t>(st.st_size), path});
+      total += static_cast<size_t>(st.st_size);
+    }
+  }
+  closedir(d);
+
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry& a, const Entry& b) { return a.mtime < b.mtime; });
+  for (size_t i = 0; i < entries.size() && total + incoming > capacity; i++) {
+    if (unlink(entries[i].path.c_str()) == 0) {
+      total -= entries[i].size;
+    }
+  }
+}
+
+}  // namespace
+
+faiss::Index* OpenStoredIndex(const std::string& dir, const std::string& key,
+                              const std::string& version, int io_flags) {
+  const std::string path = dir + "/" + FileName(key, version);
+  if (access(path.c_str(), R_OK) != 0) {
+    FAISS_THROW_IF_NOT_FMT(errno == ENOENT, "could not access %s: %s",
+                           path.c_str(), strerror(errno));
+    return nullptr;
+  }
+  // Touch the file so that EnsureCapacity() removes it last.
+  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+
+#ifdef FAISS_EXT_HAVE_ZERO_COPY
+  try {
+    // code arrays of flat indexes and HNSW graphs are views into the mapping
+    return faiss::read_index(path.c_str(), io_flags | faiss::IO_FLAG_MMAP_IFC);
+  } catch (const faiss::FaissException&) {
+    // e.g. inverted lists, which faiss only maps from a plain file reader
+  }
+#endif
+  // inverted lists of IVF indexes are mapped
+  return faiss::read_index(path.c_str(), io_flags | faiss::IO_FLAG_MMAP);
+}
+
+void StoreIndex(const std::string& dir, const std::string& key,
+                const std::string& version, const faiss::Index* index,
+                size_t capacity) {
+  FAISS_THROW_IF_NOT_FMT(mkdir(dir.c_str(), 0700) == 0 || errno == EEXIST,
+                         "could not create directory %s: %s", dir.c_str(),
+                         strerror(errno));
+
+  const std::string name = FileName(key, version);
+  if (capacity > 0) {
+    EnsureCapacity(dir, SerializedSize(index), capacity);
+  }
+
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d%s", static_cast<int>(getpid()),
+           kTempSuffix);
+  const std::string path = dir + "/" + name;
+  const std::string tmp_path = path + suffix;
+  try {
+    faiss::write_index(index, tmp_path.c_str());
+  } catch (...) {
+    unlink(tmp_path.c_str());
+    throw;
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    int saved_errno = errno;
+    unlink(tmp_path.c_str());
+    FAISS_THROW_FMT("could not rename %s: %s", tmp_path.c_str(),
+                    strerror(saved_errno));
+  }
+
+  // The source of key changed: its older versions must not be opened again.
+  const std::string prefix = KeyPrefix(key);
+  RemoveFiles(
+      dir,
+      [&prefix](const char* n) {
+        return HasPrefix(n, prefix) && HasSuffix(n, kSuffix);
+      },
+      name.c_str());
+}
+
+long RemoveStoredIndex(const std::string& dir, const std::string& key) {
+  const std::string prefix = KeyPrefix(key);
+  return RemoveFiles(
+      dir,
+      [&prefix](const char* n) {
+        return HasPrefix(n, prefix) && HasSuffix(n, kSuffix);
+      },
+      nullptr);
+}
+
+long ClearIndexStore(const std::string& dir) {
+  // Also drop the leftovers of interrupted StoreIndex() calls.
+  return RemoveFiles(
+      dir,
+      [](const char* n) {
+        return HasSuffix(n, kSuffix) || HasSuffix(n, kTempSuffix);
+      },
+      nullptr);
+}
+
+}  // namespace faiss_ext
@@ -0,0 +1,50 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+// An index store is a local directory of indexes materialized in faiss's
+// native file format, so that they are opened with faiss's mmap I/O flags:
+// their data comes from the OS page cache, is shared by every process that
+// opens the same file and survives restarts.
+//
+// Every file holds one version of the index stored under a key.  Storing a
+// new version of a key removes the older ones, so that a reader asking for
+// the version of the current source never opens a stale index.  Files are
+// written to a temporary name and renamed, readers only see complete files.
+//
+// The files of a directory may be bounded by a capacity in bytes, in which
+// case StoreIndex() removes the least recently opened files first.
+
+#ifndef FAISS_EXT_INDEX_STORE_H_
+#define FAISS_EXT_INDEX_STORE_H_
+
+#include <cstddef>
+#include <string>
+
+#include <faiss/Index.h>
+
+namespace faiss_ext {
+
+// Open the index stored under key and version in dir, memory mapping what
+// faiss can map.  Returns nullptr if there is no such file.
+faiss::Index* OpenStoredIndex(const std::string& dir, const std::string& key,
+                              const std::string& version, int io_flags);
+
+// Store index under key and version in dir, removing the other versions of
+// key.  When capacity is not 0, older files are removed so that the
+// directory stays within capacity bytes.
+void StoreIndex(const std::string& dir, const std::string& key,
+                const std::string& version, const faiss::Index* index,
+                size_t capacity);
+
+// Remove every version of key.  Returns the number of files removed.
+long RemoveStoredIndex(const std::string& dir, const std::string& key);
+
+// Remove every file of dir.  Returns the number of files removed.
+long ClearIndexStore(const std::string& dir);
+
+}  // namespace faiss_ext
+
+#endif  // FAISS_EXT_INDEX_STORE_H_
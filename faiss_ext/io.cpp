@@ -0,0 +1,133 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#include "io.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/index_io.h>
+
+namespace faiss_ext {
+
+#ifndef FAISS_EXT_HAVE_ZERO_COPY
+size_t BufferIOReader::operator()(void* ptr, size_t size, size_t nitems) {
+  if (size == 0 || pos_ >= size_) {
+    return 0;
+  }
+  size_t avail = (size_ - pos_) / size;
+  if (nitems > avail) {
+    nitems = avail;
+  }
+  const size_t nbytes = size * nitems;
+  std::memcpy(ptr, data_ + pos_, nbytes);
+  pos_ += nbytes;
+  return nitems;
+}
+#endif
+
+size_t ChunkedIOReader::operator()(void* ptr, size_t size, size_t nitems) {
+  if (size == 0) {
+    return 0;
+  }
+  uint8_t* out = static_cast<uint8_t*>(ptr);
+  const size_t want = size * nitems;
+  size_t got = 0;
+  while (got < want) {
+    if (pos_ == size_) {
+      if (next_ == nchunks_) {
+        break;
+      }
+      const void* data = nullptr;
+      size_t data_size = 0;
+      FAISS_THROW_IF_NOT_FMT(fetch_(arg_, next_, &data, &data_size) == 0,
+                             "failed to fetch chunk %zu", next_);
+      data_ = static_cast<const uint8_t*>(data);
+      size_ = data_size;
+      pos_ = 0;
+      next_++;
+      continue;
+    }
+    const size_t n = std::min(want - got, size_ - pos_);
+    std::memcpy(out + got, data_ + pos_, n);
+    got += n;
+    pos_ += n;
+  }
+  return got / size;
+}
+
+size_t CountingIOWriter::operator()(const void* ptr, size_t size,
+                                    size_t nitems) {
+  (void)ptr;
+  size_ += size * nitems;
+  return nitems;
+}
+
+size_t BufferIOWriter::operator()(const void* ptr, size_t size,
+                                  size_t nitems) {
+  const size_t nbytes = size * nitems;
+  FAISS_THROW_IF_NOT_FMT(nbytes <= capacity_ - pos_,
+                         "write of %zu bytes overflows buffer (%zu/%zu used)",
+                         nbytes, pos_, capacity_);
+  std::memcpy(data_ + pos_, ptr, nbytes);
+  pos_ += nbytes;
+  return nitems;
+}
+
+size_t RangeIOWriter::operator()(const void* ptr, size_t size,
+                                 size_t nitems) {
+  const size_t nbytes = size * nitems;
+  const size_t begin = std::max(pos_, offset_);
+  const size_t end = std::min(pos_ + nbytes, offset_ + capacity_);
+  if (begin < end) {
+    std::memcpy(data_ + (begin - offset_),
+                static_cast<const uint8_t*>(ptr) + (begin - pos_), end - begin);
+    written_ += end - begin;
+  }
+  pos_ += nbytes;
+  return nitems;
+}
+
+faiss::Index* ReadIndex(const void* buf, size_t size, int io_flags,
+                        bool zero_copy) {
+  BufferIOReader reader(buf, size);
+#ifdef FAISS_EXT_HAVE_ZERO_COPY
+  if (zero_copy) {
+    io_flags |= faiss::IO_FLAG_MMAP_IFC;
+  }
+#else
+  (void)zero_copy;
+#endif
+  return faiss::read_index(&reader, io_flags);
+}
+
+faiss::Index* ReadIndexChunks(ChunkFetcher fetch, void* arg, size_t nchunks,
+                              int io_flags) {
+  ChunkedIOReader reader(fetch, arg, nchunks);
+  return faiss::read_index(&reader, io_flags);
+}
+
+size_t SerializedSize(const faiss::Index* index) {
+  CountingIOWriter writer;
+  faiss::write_index(index, &writer);
+  return writer.size();
+}
+
+size_t WriteIndex(const faiss::Index* index, void* buf, size_t capacity) {
+  BufferIOWriter writer(buf, capacity);
+  faiss::write_index(index, &writer);
+  return writer.size();
+}
+
+size_t WriteIndexRange(const faiss::Index* index, size_t offset, void* buf,
+                       size_t capacity) {
+  RangeIOWriter writer(buf, offset, capacity);
+  faiss::write_index(index, &writer);
+  return writer.size();
+}
+
+}  // namespace faiss_ext
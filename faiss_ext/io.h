@@ -0,0 +1,165 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#ifndef FAISS_EXT_IO_H_
+#define FAISS_EXT_IO_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <faiss/Index.h>
+#include <faiss/impl/io.h>
+
+// faiss >= 1.11 can back the code arrays of IndexFlatCodes and HNSW with the
+// reader's buffer instead of copying them (ZeroCopyIOReader + IO_FLAG_MMAP_IFC).
+#if FAISS_VERSION_MAJOR > 1 || (FAISS_VERSION_MAJOR == 1 && FAISS_VERSION_MINOR >= 11)
+#define FAISS_EXT_HAVE_ZERO_COPY 1
+#include <faiss/impl/zerocopy_io.h>
+#endif
+
+namespace faiss_ext {
+
+// BufferIOReader reads a serialized index straight out of a memory buffer
+// (e.g. a detoasted bytea), without stdio buffering in between.
+//
+// When zero-copy is supported, it is a faiss::ZeroCopyIOReader, so that
+// read_index() may keep pointers into the buffer: the buffer must then
+// outlive the index.
+#ifdef FAISS_EXT_HAVE_ZERO_COPY
+struct BufferIOReader : faiss::ZeroCopyIOReader {
+  BufferIOReader(const void* data, size_t size)
+      : faiss::ZeroCopyIOReader(static_cast<const uint8_t*>(data), size) {}
+};
+#else
+struct BufferIOReader : faiss::IOReader {
+  BufferIOReader(const void* data, size_t size)
+      : data_(static_cast<const uint8_t*>(data)), size_(size), pos_(0) {}
+
+  size_t operator()(void* ptr, size_t size, size_t nitems) override;
+
+ private:
+  const uint8_t* data_;
+  size_t size_;
+  size_t pos_;
+};
+#endif
+
+// ChunkedIOReader reads a serialized index split across chunks.  Chunks are
+// requested one at a time through fetch, in order, when the previous one has
+// been consumed; the data returned by fetch must stay valid until the next
+// call.  A non-zero return value from fetch aborts the read.
+typedef int (*ChunkFetcher)(void* arg, size_t chunk_no, const void** data,
+                            size_t* size);
+
+struct ChunkedIOReader : faiss::IOReader {
+  ChunkedIOReader(ChunkFetcher fetch, void* arg, size_t nchunks)
+      : fetch_(fetch),
+        arg_(arg),
+        nchunks_(nchunks),
+        next_(0),
+        data_(nullptr),
+        size_(0),
+        pos_(0) {}
+
+  size_t operator()(void* ptr, size_t size, size_t nitems) override;
+
+ private:
+  ChunkFetcher fetch_;
+  void* arg_;
+  size_t nchunks_;
+  size_t next_;  // number of the next chunk to fetch
+  const uint8_t* data_;
+  size_t size_;
+  size_t pos_;
+};
+
+// CountingIOWriter only sums up the bytes written, so that the exact
+// serialized size is known before the destination buffer is allocated.
+struct CountingIOWriter : faiss::IOWriter {
+  CountingIOWriter() : size_(0) {}
+
+  size_t operator()(const void* ptr, size_t size, size_t nitems) override;
+
+  size_t size() const { return size_; }
+
+ private:
+  size_t size_;
+};
+
+// BufferIOWriter writes into a caller-owned buffer of fixed capacity.
+// Writing past the capacity throws.
+struct BufferIOWriter : faiss::IOWriter {
+  BufferIOWriter(void* data, size_t capacity)
+      : data_(static_cast<uint8_t*>(data)), capacity_(capacity), pos_(0) {}
+
+  size_t operator()(const void* ptr, size_t size, size_t nitems) override;
+
+  size_t size() const { return pos_; }
+
+ private:
+  uint8_t* data_;
+  size_t capacity_;
+  size_t pos_;
+};
+
+// RangeIOWriter keeps only the bytes [offset, offset + capacity) of the
+// serialized stream, written into a caller-owned buffer; the bytes before and
+// after are counted and dropped.  Serializing an index once per range writes
+// it out piece by piece without ever holding all of it.
+struct RangeIOWriter : faiss::IOWriter {
+  RangeIOWriter(void* data, size_t offset, size_t capacity)
+      : data_(static_cast<uint8_t*>(data)),
+        offset_(offset),
+        capacity_(capacity),
+        pos_(0),
+        written_(0) {}
+
+  size_t operator()(const void* ptr, size_t size, size_t nitems) override;
+
+  // Number of bytes written into the buffer.
+  size_t size() const { return written_; }
+
+ private:
+  uint8_t* data_;
+  size_t offset_;
+  size_t capacity_;
+  size_t pos_;  // position in the serialized stream
+  size_t written_;
+};
+
+// Whether an index read through BufferIOReader may reference the buffer.
+inline bool ZeroCopySupported() {
+#ifdef FAISS_EXT_HAVE_ZERO_COPY
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Deserialize an index from buf[0, size).  With zero_copy, code arrays may
+// be views into buf (read-only indexes only: adding to such an index fails).
+faiss::Index* ReadIndex(const void* buf, size_t size, int io_flags,
+                        bool zero_copy);
+
+// Deserialize an index split across nchunks chunks, see ChunkedIOReader.
+faiss::Index* ReadIndexChunks(ChunkFetcher fetch, void* arg, size_t nchunks,
+                              int io_flags);
+
+// Return the number of bytes faiss::write_index() produces for index.
+size_t SerializedSize(const faiss::Index* index);
+
+// Serialize index into buf[0, capacity).  Returns the number of bytes written.
+size_t WriteIndex(const faiss::Index* index, void* buf, size_t capacity);
+
+// Serialize the bytes [offset, offset + capacity) of index into buf, see
+// RangeIOWriter.  Returns the number of bytes written, less than capacity
+// only for the last range.
+size_t WriteIndexRange(const faiss::Index* index, size_t offset, void* buf,
+                       size_t capacity);
+
+}  // namespace faiss_ext
+
+#endif  // FAISS_EXT_IO_H_
@@ -0,0 +1,185 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#include "shards.h"
+
+#include <omp.h>
+
+#include <algorithm>
+#include <exception>
+#include <limits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <faiss/impl/FaissAssert.h>
+
+#include "exclude.h"
+
+namespace faiss_ext {
+
+namespace {
+
+// Tournament tree of losers over the heads of n lists: tree_[0] is the
+// leaf of the overall winner, tree_[1, n) the losers of the matches played
+// at the inner nodes, whose children are 2i and 2i + 1 (leaves at n + leaf).
+// Advancing the winner replays its path to the root only, log2(n)
+// comparisons against the losers instead of the two per level of a heap.
+template <class Beats>
+class LoserTree {
+ public:
+  LoserTree(size_t n, Beats beats) : n_(n), beats_(beats), tree_(n) {}
+
+  void Build() {
+    std::vector<size_t> winners(2 * n_);
+    for (size_t leaf = 0; leaf < n_; leaf++) {
+      winners[n_ + leaf] = leaf;
+    }
+    for (size_t node = n_ - 1; node >= 1; node--) {
+      size_t left = winners[2 * node], right = winners[2 * node + 1];
+      if (beats_(right, left)) {
+        std::swap(left, right);
+      }
+      winners[node] = left;
+      tree_[node] = right;
+    }
+    tree_[0] = n_ == 1 ? 0 : winners[1];
+  }
+
+  size_t Winner() const { return tree_[0]; }
+
+  // The head of the winner changed: play its new head up the tree.
+  void Replay() {
+    size_t winner = tree_[0];
+    for (size_t node = (n_ + winner) / 2; node >= 1; node /= 2) {
+      if (beats_(tree_[node], winner)) {
+        std::swap(tree_[node], winner);
+      }
+    }
+    tree_[0] = winner;
+  }
+
+ private:
+  size_t n_;
+  Beats beats_;
+  std::vector<size_t> tree_;
+};
+
+}  // namespace
+
+void MergeKnnResults(int64_t n, int64_t k, size_t nresults,
+                     faiss::MetricType metric, const float* all_distances,
+                     const int64_t* all_labels, float* distances,
+                     int64_t* labels) {
+  FAISS_THROW_IF_NOT_MSG(nresults > 0, "no result to merge");
+  const bool larger_is_nearer = metric == faiss::METRIC_INNER_PRODUCT;
+  const float padding = larger_is_nearer ? -std::numeric_limits<float>::max()
+                                         : std::numeric_limits<float>::max();
+
+#pragma omp parallel if (n > 1)
+  {
+    int64_t q = 0;  // the query being merged, seen by the lambdas
+    std::vector<int64_t> heads(nresults);
+    std::unordered_set<int64_t> seen;
+    seen.reserve(k);
+
+    // exhausted lists lose every match, ties go to the first list
+    auto exhausted = [&](size_t r) {
+      return heads[r] == k || all_labels[(r * n + q) * k + heads[r]] == -1;
+    };
+    auto head = [&](size_t r) {
+      return all_distances[(r * n + q) * k + heads[r]];
+    };
+    auto beats = [&](size_t a, size_t b) {
+      if (exhausted(a)) {
+        return false;
+      }
+      if (exhausted(b)) {
+        return true;
+      }
+      const float da = head(a), db = head(b);
+      if (da != db) {
+        return larger_is_nearer ? da > db : da < db;
+      }
+      return a < b;
+    };
+    LoserTree<decltype(beats)> tree(nresults, beats);
+
+#pragma omp for
+    for (int64_t i = 0; i < n; i++) {
+      q = i;
+      std::fill(heads.begin(), heads.end(), 0);
+      seen.clear();
+      tree.Build();
+      float* out_distances = distances + q * k;
+      int64_t* out_labels = labels + q * k;
+      int64_t j = 0;
+      while (j < k && !exhausted(tree.Winner())) {
+        const size_t r = tree.Winner();
+        const size_t ofs = (r * n + q) * k + heads[r];
+        // an id found in several lists, e.g. by replicas of a shard, takes
+        // a single slot, at its nearest distance
+        if (seen.insert(all_labels[ofs]).second) {
+          out_distances[j] = all_distances[ofs];
+          out_labels[j] = all_labels[ofs];
+          j++;
+        }
+        heads[r]++;
+        tree.Replay();
+      }
+      for (; j < k; j++) {
+        out_distances[j] = padding;
+        out_labels[j] = -1;
+      }
+    }
+  }
+}
+
+void SearchShards(const faiss::Index* const* shards, size_t nshards,
+                  int64_t n, const float* x, int64_t k,
+                  const int64_t* const* excluded, const size_t* nexcluded,
+                  float* distances, int64_t* labels) {
+  FAISS_THROW_IF_NOT_MSG(nshards > 0, "no shard to search");
+  for (size_t i = 1; i < nshards; i++) {
+    FAISS_THROW_IF_NOT_FMT(shards[i]->d == shards[0]->d,
+                           "shard %zu has dimension %d instead of %d", i,
+                           int(shards[i]->d), int(shards[0]->d));
+    FAISS_THROW_IF_NOT_FMT(shards[i]->metric_type == shards[0]->metric_type,
+                           "shard %zu has another metric than shard 0", i);
+  }
+  if (nshards == 1) {
+    SearchExcluding(shards[0], n, x, k, excluded ? excluded[0] : nullptr,
+                    excluded ? nexcluded[0] : 0, distances, labels);
+    return;
+  }
+
+  std::vector<float> all_distances(nshards * n * k);
+  std::vector<int64_t> all_labels(nshards * n * k);
+  std::vector<std::exception_ptr> errors(nshards);
+
+  // exceptions must not leave the parallel region
+#pragma omp parallel for if (n < omp_get_max_threads())
+  for (size_t i = 0; i < nshards; i++) {
+    try {
+      SearchExcluding(shards[i], n, x, k, excluded ? excluded[i] : nullptr,
+                      excluded ? nexcluded[i] : 0,
+                      all_distances.data() + i * n * k,
+                      all_labels.data() + i * n * k);
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  }
+  for (const std::exception_ptr& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  MergeKnnResults(n, k, nshards, shards[0]->metric_type, all_distances.data(),
+                  all_labels.data(), distances, labels);
+}
+
+}  // namespace faiss_ext
@@ -0,0 +1,43 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#ifndef FAISS_EXT_SHARDS_H_
+#define FAISS_EXT_SHARDS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <faiss/Index.h>
+
+namespace faiss_ext {
+
+// Merge, for each of the n queries, the nresults k nearest neighbor lists of
+// all_distances and all_labels into distances and labels, with a loser
+// tree.  The list of result r for query q starts at (r * n + q) * k.  Lists
+// are padded with -1 labels like the results of faiss::Index::search(), and
+// so is the merged one.  metric tells whether smaller or larger distances
+// are nearer.  A label found in several lists is kept once, at its nearest.
+void MergeKnnResults(int64_t n, int64_t k, size_t nresults,
+                     faiss::MetricType metric, const float* all_distances,
+                     const int64_t* all_labels, float* distances,
+                     int64_t* labels);
+
+// Search the k nearest neighbors of the n queries x in each of the nshards
+// indexes and merge them, the way faiss::IndexShards does but without
+// owning the shards or starting threads of its own.  The shards must share
+// their dimension and metric, their ids are returned as is.  Unless excluded
+// is nullptr, shard i skips the nexcluded[i] ids of excluded[i], sorted
+// ascending, see SearchExcluding().  Batches with fewer queries than OpenMP
+// threads search the shards in parallel, a thread each, larger ones leave
+// the threads to faiss.
+void SearchShards(const faiss::Index* const* shards, size_t nshards,
+                  int64_t n, const float* x, int64_t k,
+                  const int64_t* const* excluded, const size_t* nexcluded,
+                  float* distances, int64_t* labels);
+
+}  // namespace faiss_ext
+
+#endif  // FAISS_EXT_SHARDS_H_
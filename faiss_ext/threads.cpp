@@ -0,0 +1,58 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#include "threads.h"
+
+#include <dlfcn.h>
+#include <omp.h>
+#include <strings.h>
+
+#include <cstdlib>
+
+#include <faiss/impl/FaissAssert.h>
+
+namespace faiss_ext {
+
+namespace {
+
+// Block time of kmp_set_blocktime() for an active policy, in milliseconds:
+// the default of LLVM's runtime.
+const int kActiveBlockTime = 200;
+
+typedef void (*SetBlockTimeFn)(int milliseconds);
+
+// kmp_set_blocktime() of LLVM's or Intel's runtime, nullptr with GNU's.
+SetBlockTimeFn BlockTimeSetter() {
+  static SetBlockTimeFn setter = reinterpret_cast<SetBlockTimeFn>(
+      dlsym(RTLD_DEFAULT, "kmp_set_blocktime"));
+  return setter;
+}
+
+}  // namespace
+
+void SetNumThreads(int num_threads) {
+  FAISS_THROW_IF_NOT_FMT(num_threads > 0, "invalid number of threads %d",
+                         num_threads);
+  omp_set_num_threads(num_threads);
+}
+
+int NumProcs() { return omp_get_num_procs(); }
+
+void SetWaitPolicy(WaitPolicy policy) {
+  if (SetBlockTimeFn setter = BlockTimeSetter()) {
+    setter(policy == WaitPolicy::kPassive ? 0 : kActiveBlockTime);
+    return;
+  }
+  // GNU's runtime spins by default, a while unless OMP_WAIT_POLICY=ACTIVE.
+  const char* env = getenv("OMP_WAIT_POLICY");
+  const bool passive = env != nullptr && strcasecmp(env, "PASSIVE") == 0;
+  FAISS_THROW_IF_NOT_MSG(
+      passive == (policy == WaitPolicy::kPassive),
+      "the OpenMP runtime only takes its wait policy from OMP_WAIT_POLICY, "
+      "set in the environment the server is started from");
+}
+
+}  // namespace faiss_ext
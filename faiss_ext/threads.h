@@ -0,0 +1,31 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#ifndef FAISS_EXT_THREADS_H_
+#define FAISS_EXT_THREADS_H_
+
+namespace faiss_ext {
+
+// Number of OpenMP threads of the parallel regions faiss runs from the
+// calling thread from now on.
+void SetNumThreads(int num_threads);
+
+// Number of processors available to the process.
+int NumProcs();
+
+// Whether idle OpenMP threads sleep (passive) or keep spinning for a while
+// (active) between two parallel regions.
+enum class WaitPolicy { kPassive, kActive };
+
+// Apply policy to the OpenMP runtime faiss is linked with.  Runtimes with a
+// block time (LLVM's and Intel's) switch at once.  GNU's only reads
+// OMP_WAIT_POLICY from the environment when it is loaded: SetWaitPolicy()
+// throws if the environment asks for another policy.
+void SetWaitPolicy(WaitPolicy policy);
+
+}  // namespace faiss_ext
+
+#endif  // FAISS_EXT_THREADS_H_
@@ -0,0 +1,57 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#include "train.h"
+
+#include <algorithm>
+
+#include <faiss/impl/FaissAssert.h>
+
+#include <faiss/Clustering.h>
+#include <faiss/IndexIDMap.h>
+#include <faiss/IndexIVF.h>
+#include <faiss/IndexPreTransform.h>
+
+namespace faiss_ext {
+
+namespace {
+
+// Centroids of the product quantizers faiss builds with 8 bits per code.
+const size_t kQuantizerCentroids = 256;
+
+}  // namespace
+
+size_t TrainSampleSize(const faiss::Index* index) {
+  size_t centroids = kQuantizerCentroids;
+  size_t points_per_centroid =
+      faiss::ClusteringParameters().max_points_per_centroid;
+
+  while (index != nullptr) {
+    if (auto idmap = dynamic_cast<const faiss::IndexIDMap*>(index)) {
+      index = idmap->index;
+    } else if (auto pt = dynamic_cast<const faiss::IndexPreTransform*>(index)) {
+      index = pt->index;
+    } else {
+      if (auto ivf = dynamic_cast<const faiss::IndexIVF*>(index)) {
+        centroids = std::max(centroids, ivf->nlist);
+        points_per_centroid = ivf->cp.max_points_per_centroid;
+      }
+      break;
+    }
+  }
+  return centroids * points_per_centroid;
+}
+
+void MergeIndex(faiss::Index* index, faiss::Index* other) {
+  FAISS_THROW_IF_NOT_MSG(index->d == other->d, "dimensions differ");
+  FAISS_THROW_IF_NOT_MSG(index->metric_type == other->metric_type,
+                         "metrics differ");
+  FAISS_THROW_IF_NOT_MSG(index->is_trained && other->is_trained,
+                         "merging untrained indexes");
+  index->merge_from(*other, 0);
+}
+
+}  // namespace faiss_ext
@@ -0,0 +1,30 @@
+/*  Copyright 2022 Alibaba Group. All rights reserved.
+
+    Distributed under MIT license.
+    See file LICENSE for detail or copy at https://opensource.org/licenses/MIT
+*/
+
+#ifndef FAISS_EXT_TRAIN_H_
+#define FAISS_EXT_TRAIN_H_
+
+#include <cstddef>
+
+#include <faiss/Index.h>
+
+namespace faiss_ext {
+
+// Number of training vectors past which training the index gains nothing:
+// the k-means of faiss subsample their input to max_points_per_centroid
+// points per centroid, be it the nlist centroids of the coarse quantizer of
+// an IVF index or the 256 centroids of a product quantizer.  The IVF index
+// is looked up through IndexIDMap and IndexPreTransform.
+size_t TrainSampleSize(const faiss::Index* index);
+
+// Move the vectors of other into index, leaving other empty.  Both must have
+// been built from the same trained index, so that their quantizers match:
+// faiss only checks that their structures do.  The ids of other are kept.
+void MergeIndex(faiss::Index* index, faiss::Index* other);
+
+}  // namespace faiss_ext
+
+#endif  // FAISS_EXT_TRAIN_H_
@@ -218,6 +218,240 @@ FROM (
         WHERE sharding_id = 0
     ) AS foo;
 
+SELECT (m).*
+FROM (
+        SELECT faiss_index_search_flat(
+                faiss_index,
+                ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5],
+                10,
+                5,
+                ARRAY [7]::BIGINT[],
+                k
+            ) AS m
+        FROM index_table
+        WHERE sharding_id = 0
+    ) AS foo;
+
+SELECT (m).*
+FROM (
+        SELECT faiss_index_search_flat(
+                faiss_index,
+                ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5],
+                10,
+                5,
+                ARRAY [7]::BIGINT[],
+                k,
+                ARRAY [30,0,90]::BIGINT[]
+            ) AS m
+        FROM index_table
+        WHERE sharding_id = 0
+    ) AS foo;
+
+SELECT (m).*
+FROM (
+        SELECT faiss_index_search_flat(
+                faiss_index_remove_ids(faiss_index, ARRAY [0,30]::BIGINT[]),
+                ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5],
+                10,
+                5,
+                ARRAY [7]::BIGINT[]
+            ) AS m
+        FROM index_table
+        WHERE sharding_id = 0
+    ) AS foo;
+
+SELECT (m).*
+FROM (
+        SELECT unnest_search_results(
+                ROW(
+                    NULL::BIGINT [],
+                    ARRAY [0,100,3]::BIGINT [],
+                    ARRAY [1,2,3]::BIGINT [],
+                    ARRAY [0.5,1.5,2.5]::REAL []
+                )::__vector_index_search_flat_results
+            ) AS m
+    ) AS foo;
+
+SELECT (m).*
+FROM (
+        SELECT unnest_search_results(
+                ROW(
+                    NULL::BIGINT [],
+                    ARRAY [0,-1,3]::BIGINT [],
+                    ARRAY [1,2,3]::BIGINT [],
+                    ARRAY [0.5,1.5,2.5]::REAL []
+                )::__vector_index_search_flat_results
+            ) AS m
+    ) AS foo;
+
+SELECT (m).*
+FROM (
+        SELECT unnest_search_results(
+                ROW(
+                    NULL::BIGINT [],
+                    ARRAY [0,1,2]::BIGINT [],
+                    ARRAY [1,2,3]::BIGINT [],
+                    ARRAY [0.5,1.5,2.5]::REAL []
+                )::__vector_index_search_flat_results
+            ) AS m
+    ) AS foo;
+
+SELECT (m).*
+FROM (
+        SELECT unnest_search_results(
+                ROW(
+                    NULL::BIGINT [],
+                    ARRAY [0,1,3]::BIGINT [],
+                    ARRAY [1,2,3]::BIGINT [],
+                    ARRAY [0.5,1.5,2.5]::REAL []
+                )::__vector_index_search_flat_results
+            ) AS m
+    ) AS foo;
+
+SELECT tombstones_add(ARRAY [5,1,3]::BIGINT[], ARRAY [3,2,2]::BIGINT[]);
+
+SELECT tombstones_add(NULL, ARRAY [4]::BIGINT[]);
+
+SELECT (m).*
+FROM (
+        SELECT faiss_index_range_search_flat(
+                faiss_index,
+                ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5],
+                10,
+                100::REAL,
+                ARRAY [7]::BIGINT[],
+                k
+            ) AS m
+        FROM index_table
+        WHERE sharding_id = 0
+    ) AS foo;
+
+SELECT (m).query_idx,
+    (m).vector_idxs,
+    (m).distances
+FROM (
+        SELECT unnest_search_results(r) AS m
+        FROM (
+                SELECT faiss_index_search_batch(
+                        index_table.faiss_index,
+                        queries.vector,
+                        queries.id,
+                        5,
+                        index_table.k
+                    ) AS r
+                FROM index_table,
+                    (
+                        VALUES (7::BIGINT, ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5]::REAL[]),
+                            (8::BIGINT, ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5]::REAL[])
+                    ) AS queries(id, vector)
+                WHERE sharding_id = 0
+                GROUP BY index_table.sharding_id
+            ) AS batch
+    ) AS foo
+ORDER BY 1;
+
+SELECT faiss_index_search_batch(
+        index_table.faiss_index,
+        queries.vector,
+        queries.id,
+        5,
+        index_table.k
+    ) AS r
+FROM index_table,
+    (
+        VALUES (7::BIGINT, ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5]::REAL[]),
+            (8::BIGINT, ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5]::REAL[])
+    ) AS queries(id, vector)
+WHERE sharding_id IN (0, 1);
+
+SELECT faiss_index_search_batch(
+        index_table.faiss_index,
+        queries.vector,
+        queries.id,
+        CAST(queries.id AS INT) - 2,
+        index_table.k
+    ) AS r
+FROM index_table,
+    (
+        VALUES (7::BIGINT, ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5]::REAL[]),
+            (8::BIGINT, ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5]::REAL[])
+    ) AS queries(id, vector)
+WHERE sharding_id = 0;
+
+SELECT (m).*
+FROM (
+        SELECT faiss_index_range_search_flat(
+                faiss_index,
+                ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5],
+                10,
+                10000::REAL,
+                ARRAY [7]::BIGINT[],
+                k,
+                ARRAY [0]::BIGINT[]
+            ) AS m
+        FROM index_table
+        WHERE sharding_id = 0
+    ) AS foo;
+
+SELECT (m).query_idx,
+    (m).vector_idxs,
+    (m).distances
+FROM (
+        SELECT unnest_search_results(r) AS m
+        FROM (
+                SELECT faiss_index_search_batch(
+                        index_table.faiss_index,
+                        queries.vector,
+                        queries.id,
+                        5,
+                        index_table.k,
+                        ARRAY [30,0]::BIGINT[]
+                    ) AS r
+                FROM index_table,
+                    (
+                        VALUES (7::BIGINT, ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5]::REAL[]),
+                            (8::BIGINT, ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5]::REAL[])
+                    ) AS queries(id, vector)
+                WHERE sharding_id = 0
+                GROUP BY index_table.sharding_id
+            ) AS batch
+    ) AS foo
+ORDER BY 1;
+
+SELECT faiss_index_search_batch(
+        index_table.faiss_index,
+        queries.vector,
+        queries.id,
+        5,
+        index_table.k,
+        CASE WHEN queries.id = 7 THEN ARRAY [0]::BIGINT[] END
+    ) AS r
+FROM index_table,
+    (
+        VALUES (7::BIGINT, ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5]::REAL[]),
+            (8::BIGINT, ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5]::REAL[])
+    ) AS queries(id, vector)
+WHERE sharding_id = 0;
+
+SELECT (m).query_idx,
+    (m).vector_idxs,
+    (m).distances
+FROM (
+        SELECT unnest_search_results(r) AS m
+        FROM (
+                SELECT faiss_index_search_shards(
+                        faiss_index,
+                        ARRAY [0.5,1.5,2.5,3.5,4.5,5.5,6.5,7.5,8.5,9.5],
+                        10,
+                        5,
+                        ARRAY [7]::BIGINT[],
+                        k,
+                        ARRAY [0,10]::BIGINT[]
+                    ) AS r
+                FROM index_table
+            ) AS global_topk_table
+    ) AS foo;
+
 SELECT query_idx,
     idx,
     distance,
@@ -248,6 +482,411 @@ FROM (unnest((t).idxs), unnest((t).distances)) WITH ORDINALITY ALIAS (idx, dista
 ORDER BY query_idx,
     distance;
 
+SELECT (m).query_idx,
+    idx,
+    distance,
+    ranking
+FROM (
+        SELECT unnest_search_results(r) AS m
+        FROM (
+                SELECT faiss_index_search_shards(
+                        index_table.faiss_index,
+                        queries.vectors,
+                        10,
+                        5,
+                        queries.ids,
+                        index_table.k
+                    ) AS r
+                FROM index_table,
+                    (
+                        SELECT array_agg(id) AS ids,
+                            array_1d_extend(vector) AS vectors
+                        FROM vector_query
+                    ) AS queries
+            ) AS global_topk_table
+    ) AS foo,
+    LATERAL ROWS
+FROM (unnest((m).vector_idxs), unnest((m).distances)) WITH ORDINALITY ALIAS (idx, distance, ranking)
+ORDER BY query_idx,
+    distance;
+
+CREATE TABLE trained_index_table AS (
+    SELECT faiss_index_train(
+            faiss_index_create(10, 'IVF1,Flat', 1),
+            array_1d_extend(vector),
+            10
+        ) AS faiss_index
+    FROM vector_queried
+    WHERE id % 1000 = 0
+) DISTRIBUTED RANDOMLY;
+
+SELECT count(*) AS queries,
+    bool_and(
+        (added.m).vector_idxs = (single.m).vector_idxs
+        AND (added.m).distances = (single.m).distances
+    ) AS same
+FROM (
+        SELECT faiss_index_search(
+                index_table.faiss_index,
+                queries.vectors,
+                10,
+                5,
+                queries.ids,
+                FALSE
+            ) AS m
+        FROM (
+                SELECT faiss_index_add_agg(faiss_index, vector, id) AS faiss_index
+                FROM trained_index_table,
+                    vector_queried
+            ) AS index_table,
+            (
+                SELECT array_agg(id) AS ids,
+                    array_1d_extend(vector) AS vectors
+                FROM vector_query
+            ) AS queries
+    ) AS added,
+    (
+        SELECT faiss_index_search(
+                faiss_index_add(
+                    trained_index_table.faiss_index,
+                    querieds.vectors,
+                    10,
+                    querieds.ids
+                ),
+                queries.vectors,
+                10,
+                5,
+                queries.ids,
+                FALSE
+            ) AS m
+        FROM trained_index_table,
+            (
+                SELECT array_agg(id) AS ids,
+                    array_1d_extend(vector) AS vectors
+                FROM vector_queried
+            ) AS querieds,
+            (
+                SELECT array_agg(id) AS ids,
+                    array_1d_extend(vector) AS vectors
+                FROM vector_query
+            ) AS queries
+    ) AS single
+WHERE (added.m).query_idx = (single.m).query_idx;
+
+SELECT faiss_index_add_agg(
+        faiss_index_create(10, 'IVF1,Flat', 1),
+        vector,
+        id
+    )
+FROM (
+        VALUES (ARRAY [0,1,2,3,4,5,6,7,8,9]::REAL [], 0::BIGINT)
+    ) AS foo (vector, id);
+
+SELECT faiss_index_add_agg(
+        faiss_index_add(
+            faiss_index_create(10, 'IDMap,Flat', 1),
+            ARRAY [0,1,2,3,4,5,6,7,8,9],
+            10,
+            ARRAY [1]
+        ),
+        vector,
+        id
+    )
+FROM (
+        VALUES (ARRAY [0,1,2,3,4,5,6,7,8,9]::REAL [], 0::BIGINT)
+    ) AS foo (vector, id);
+
+SELECT (m).query_idx,
+    idx,
+    distance,
+    ranking
+FROM (
+        SELECT unnest_search_results(r) AS m
+        FROM (
+                SELECT faiss_index_search_shards(
+                        delta_table.faiss_index,
+                        queries.vectors,
+                        10,
+                        5,
+                        queries.ids,
+                        NULL
+                    ) AS r
+                FROM (
+                        SELECT faiss_index_merge_agg(faiss_index) AS faiss_index
+                        FROM (
+                                SELECT faiss_index_add_agg(faiss_index, vector, id) AS faiss_index
+                                FROM trained_index_table,
+                                    vector_queried
+                                WHERE id % 3 > 0
+                                GROUP BY id % 3
+                            ) AS base_table
+                        UNION ALL
+                        SELECT faiss_index_add_agg(faiss_index, vector, id)
+                        FROM trained_index_table,
+                            vector_queried
+                        WHERE id % 3 = 0
+                    ) AS delta_table,
+                    (
+                        SELECT array_agg(id) AS ids,
+                            array_1d_extend(vector) AS vectors
+                        FROM vector_query
+                    ) AS queries
+            ) AS global_topk_table
+    ) AS foo,
+    LATERAL ROWS
+FROM (unnest((m).vector_idxs), unnest((m).distances)) WITH ORDINALITY ALIAS (idx, distance, ranking)
+ORDER BY query_idx,
+    distance;
+
+SELECT count(*) AS queries,
+    bool_and(
+        (merged.m).vector_idxs = (single.m).vector_idxs
+        AND (merged.m).distances = (single.m).distances
+    ) AS same
+FROM (
+        SELECT faiss_index_search(
+                index_table.faiss_index,
+                queries.vectors,
+                10,
+                5,
+                queries.ids,
+                FALSE
+            ) AS m
+        FROM (
+                SELECT faiss_index_merge_agg(faiss_index) AS faiss_index
+                FROM (
+                        SELECT faiss_index_add_agg(faiss_index, vector, id) AS faiss_index
+                        FROM trained_index_table,
+                            vector_queried
+                        GROUP BY id % 3
+                    ) AS delta_table
+            ) AS index_table,
+            (
+                SELECT array_agg(id) AS ids,
+                    array_1d_extend(vector) AS vectors
+                FROM vector_query
+            ) AS queries
+    ) AS merged,
+    (
+        SELECT faiss_index_search(
+                index_table.faiss_index,
+                queries.vectors,
+                10,
+                5,
+                queries.ids,
+                FALSE
+            ) AS m
+        FROM (
+                SELECT faiss_index_add_agg(faiss_index, vector, id) AS faiss_index
+                FROM trained_index_table,
+                    vector_queried
+            ) AS index_table,
+            (
+                SELECT array_agg(id) AS ids,
+                    array_1d_extend(vector) AS vectors
+                FROM vector_query
+            ) AS queries
+    ) AS single
+WHERE (merged.m).query_idx = (single.m).query_idx;
+
+CREATE TABLE chunk_table AS (
+    SELECT (c).chunk_no,
+        (c).chunk
+    FROM (
+            SELECT faiss_index_cache_chunks(
+                    create_index_cache_agg(
+                        vector,
+                        'IVF1,Flat',
+                        id,
+                        1,
+                        NULL,
+                        'regress_built'
+                    ),
+                    100000
+                ) AS c
+            FROM vector_queried
+        ) AS foo
+) DISTRIBUTED RANDOMLY;
+
+SELECT count(*) > 1 AS chunked,
+    max(length(chunk)) = 100000 AS full_chunks
+FROM chunk_table;
+
+SELECT faiss_index_load_chunks('regress_loaded', chunk_no, chunk) = sum(length(chunk)) AS loaded
+FROM chunk_table;
+
+SELECT count(*) AS queries,
+    bool_and(
+        (loaded.m).vector_idxs = (built.m).vector_idxs
+        AND (loaded.m).distances = (built.m).distances
+    ) AS same
+FROM (
+        SELECT faiss_index_search(
+                NULL,
+                queries.vectors,
+                10,
+                5,
+                queries.ids,
+                FALSE,
+                'regress_loaded'
+            ) AS m
+        FROM (
+                SELECT array_agg(id) AS ids,
+                    array_1d_extend(vector) AS vectors
+                FROM vector_query
+            ) AS queries
+    ) AS loaded,
+    (
+        SELECT faiss_index_search(
+                index_table.faiss_index,
+                queries.vectors,
+                10,
+                5,
+                queries.ids,
+                FALSE
+            ) AS m
+        FROM (
+                SELECT create_index_agg(
+                        vector,
+                        'IVF1,Flat',
+                        id,
+                        1,
+                        NULL
+                    ) AS faiss_index
+                FROM vector_queried
+            ) AS index_table,
+            (
+                SELECT array_agg(id) AS ids,
+                    array_1d_extend(vector) AS vectors
+                FROM vector_query
+            ) AS queries
+    ) AS built
+WHERE (loaded.m).query_idx = (built.m).query_idx;
+
+SELECT resize_cache(1) AS shrunk;
+
+SELECT faiss_index_load_chunks('regress_loaded', chunk_no, chunk)
+FROM chunk_table;
+
+SELECT resize_cache(32 * 1024 * 1024) AS restored;
+
+SELECT sharding_id,
+    count(*) > 1 AS chunked,
+    string_agg((c).chunk, ''::BYTEA ORDER BY (c).chunk_no) = faiss_index AS same
+FROM (
+        SELECT sharding_id,
+            faiss_index,
+            faiss_index_chunks(faiss_index, 1000) AS c
+        FROM index_table
+        WHERE sharding_id = 0
+    ) AS foo
+GROUP BY sharding_id,
+    faiss_index;
+
+SELECT publish_cache(
+        'regress_key',
+        faiss_index_add(
+            faiss_index_create(10, 'IDMap,Flat', 1),
+            ARRAY [0,1,2,3,4,5,6,7,8,9],
+            10,
+            ARRAY [1]
+        )
+    ) > 0 AS published;
+
+SELECT key,
+    refs,
+    priority,
+    charge = charge_cache('regress_key') AS same_charge
+FROM cache_entries()
+WHERE key = 'regress_key';
+
+SELECT count(*) AS shards,
+    count(DISTINCT capacity) AS capacities,
+    sum(entries) >= 1 AS cached,
+    sum(inserts) >= sum(entries) AS inserted
+FROM cache_stats();
+
+SELECT resize_cache(64 * 1024 * 1024) > 0 AS resized;
+
+SELECT DISTINCT capacity
+FROM cache_stats();
+
+SELECT charge_cache('regress_key') IS NOT NULL AS kept;
+
+SELECT resize_cache(1) AS shrunk;
+
+SELECT charge_cache('regress_key') IS NOT NULL AS kept;
+
+SELECT resize_cache(32 * 1024 * 1024) AS restored;
+
+SELECT publish_cache(
+        'regress_key',
+        faiss_index_add(
+            faiss_index_create(10, 'IDMap,Flat', 1),
+            ARRAY [0,1,2,3,4,5,6,7,8,9],
+            10,
+            ARRAY [1]
+        )
+    ) > 0 AS published;
+
+SELECT erase_cache('regress_key') AS erased;
+
+SELECT erase_cache('regress_key') AS erased;
+
+SELECT charge_cache('regress_key') IS NULL AS erased;
+
+SET vector_recall.cache_key_version = 'v1';
+
+SELECT publish_cache(
+        'regress_key',
+        faiss_index_add(
+            faiss_index_create(10, 'IDMap,Flat', 1),
+            ARRAY [0,1,2,3,4,5,6,7,8,9],
+            10,
+            ARRAY [1]
+        )
+    ) > 0 AS published;
+
+SET vector_recall.cache_key_version = 'v2';
+
+SELECT publish_cache(
+        'regress_key',
+        faiss_index_add(
+            faiss_index_create(10, 'IDMap,Flat', 1),
+            ARRAY [0,1,2,3,4,5,6,7,8,9],
+            10,
+            ARRAY [1]
+        )
+    ) > 0 AS published;
+
+SELECT key
+FROM cache_entries()
+WHERE key LIKE 'regress_key%'
+ORDER BY key;
+
+SELECT erase_cache_versions('regress_key') AS erased;
+
+SELECT key
+FROM cache_entries()
+WHERE key LIKE 'regress_key%'
+ORDER BY key;
+
+RESET vector_recall.cache_key_version;
+
+SELECT erase_cache_versions('regress_key') AS erased;
+
+SELECT key
+FROM cache_entries()
+WHERE key LIKE 'regress_key%'
+ORDER BY key;
+
+SELECT vector_recall_register_warm('index_table', 'faiss_index', NULL, 10);
+
+SELECT relid, index_col, key_col, priority
+FROM vector_recall_warm_list;
+
+SELECT vector_recall_unregister_warm('index_table', 'faiss_index');
+
 DROP TABLE vector_queried;
 
 DROP TABLE vector_query;
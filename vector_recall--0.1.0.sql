@@ -2,7 +2,9 @@
 \echo Use "CREATE EXTENSION vector_recall" to load this file. \quit
 
 CREATE TYPE __vector_index_search_results AS (query_vector REAL[], query_idx BIGINT, vector_idxs BIGINT[], distances REAL[]);
+CREATE TYPE __vector_index_search_flat_results AS (query_idxs BIGINT[], lims BIGINT[], vector_idxs BIGINT[], distances REAL[]);
 CREATE TYPE __topk_merge_result AS (idxs BIGINT[], distances REAL[]);
+CREATE TYPE __faiss_index_chunk AS (chunk_no INT, chunk BYTEA);
 
 CREATE OR REPLACE FUNCTION array_1d_extend_transfn(internal, real_array REAL[])
     RETURNS internal
@@ -46,6 +48,16 @@ CREATE OR REPLACE FUNCTION faiss_index_reset(faiss_index BYTEA)
     AS 'MODULE_PATHNAME', 'faiss_index_reset'
     LANGUAGE C IMMUTABLE STRICT;
 
+CREATE OR REPLACE FUNCTION faiss_index_remove_ids(faiss_index BYTEA, ids BIGINT[])
+    RETURNS BYTEA
+    AS 'MODULE_PATHNAME', 'faiss_index_remove_ids'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tombstones_add(tombstones BIGINT[], ids BIGINT[])
+    RETURNS BIGINT[]
+    AS 'MODULE_PATHNAME', 'tombstones_add'
+    LANGUAGE C IMMUTABLE;
+
 CREATE OR REPLACE FUNCTION create_index_transfn(internal, vector REAL[], index_desc TEXT, vector_idx BIGINT, metric_type INT, runtime_parameters TEXT)
     RETURNS internal
     AS 'MODULE_PATHNAME', 'create_index_transfn'
@@ -62,16 +74,205 @@ CREATE AGGREGATE create_index_agg(vector REAL[], index_desc TEXT, vector_idx BIG
     FINALFUNC = create_index_finalfn
 );
 
-CREATE OR REPLACE FUNCTION faiss_index_search(faiss_index BYTEA, query_vectors REAL[], dim INT, topk INT, query_idxs BIGINT[] = NULL, preserve_vector bool = TRUE, faiss_index_key TEXT = NULL)
+CREATE OR REPLACE FUNCTION create_index_transfn(internal, vector REAL[], index_desc TEXT, vector_idx BIGINT, metric_type INT, runtime_parameters TEXT, faiss_index_key TEXT)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'create_index_transfn'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION create_index_cache_finalfn(internal)
+    RETURNS TEXT
+    AS 'MODULE_PATHNAME', 'create_index_cache_finalfn'
+    LANGUAGE C;
+
+CREATE AGGREGATE create_index_cache_agg(vector REAL[], index_desc TEXT, vector_idx BIGINT, metric_type INT, runtime_parameters TEXT, faiss_index_key TEXT) (
+    SFUNC = create_index_transfn,
+    STYPE = internal,
+    FINALFUNC = create_index_cache_finalfn
+);
+
+CREATE OR REPLACE FUNCTION faiss_index_add_agg_transfn(internal, faiss_index BYTEA, vector REAL[], vector_idx BIGINT)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_add_agg_transfn'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION faiss_index_add_agg_combinefn(internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_add_agg_combinefn'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION faiss_index_add_agg_serialfn(internal)
+    RETURNS BYTEA
+    AS 'MODULE_PATHNAME', 'faiss_index_add_agg_serialfn'
+    LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION faiss_index_add_agg_deserialfn(BYTEA, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_add_agg_deserialfn'
+    LANGUAGE C STRICT;
+
+CREATE AGGREGATE faiss_index_add_agg(faiss_index BYTEA, vector REAL[], vector_idx BIGINT) (
+    SFUNC = faiss_index_add_agg_transfn,
+    STYPE = internal,
+    FINALFUNC = create_index_finalfn,
+    COMBINEFUNC = faiss_index_add_agg_combinefn,
+    SERIALFUNC = faiss_index_add_agg_serialfn,
+    DESERIALFUNC = faiss_index_add_agg_deserialfn
+);
+
+CREATE OR REPLACE FUNCTION faiss_index_add_agg_transfn(internal, faiss_index BYTEA, vector REAL[], vector_idx BIGINT, faiss_index_key TEXT)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_add_agg_transfn'
+    LANGUAGE C;
+
+CREATE AGGREGATE faiss_index_add_cache_agg(faiss_index BYTEA, vector REAL[], vector_idx BIGINT, faiss_index_key TEXT) (
+    SFUNC = faiss_index_add_agg_transfn,
+    STYPE = internal,
+    FINALFUNC = create_index_cache_finalfn,
+    COMBINEFUNC = faiss_index_add_agg_combinefn,
+    SERIALFUNC = faiss_index_add_agg_serialfn,
+    DESERIALFUNC = faiss_index_add_agg_deserialfn
+);
+
+CREATE OR REPLACE FUNCTION faiss_index_merge_agg_transfn(internal, faiss_index BYTEA)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_merge_agg_transfn'
+    LANGUAGE C;
+
+CREATE AGGREGATE faiss_index_merge_agg(faiss_index BYTEA) (
+    SFUNC = faiss_index_merge_agg_transfn,
+    STYPE = internal,
+    FINALFUNC = create_index_finalfn,
+    COMBINEFUNC = faiss_index_add_agg_combinefn,
+    SERIALFUNC = faiss_index_add_agg_serialfn,
+    DESERIALFUNC = faiss_index_add_agg_deserialfn
+);
+
+CREATE OR REPLACE FUNCTION faiss_index_search(faiss_index BYTEA, query_vectors REAL[], dim INT, topk INT, query_idxs BIGINT[] = NULL, preserve_vector bool = TRUE, faiss_index_key TEXT = NULL, tombstones BIGINT[] = NULL)
     RETURNS SETOF __vector_index_search_results
     AS 'MODULE_PATHNAME', 'faiss_index_search'
     LANGUAGE C IMMUTABLE;
 
-CREATE OR REPLACE FUNCTION faiss_index_range_search(faiss_index BYTEA, query_vectors REAL[], dim INT, radius REAL, query_idxs BIGINT[] = NULL, preserve_vector bool = TRUE, faiss_index_key TEXT = NULL)
+CREATE OR REPLACE FUNCTION faiss_index_range_search(faiss_index BYTEA, query_vectors REAL[], dim INT, radius REAL, query_idxs BIGINT[] = NULL, preserve_vector bool = TRUE, faiss_index_key TEXT = NULL, tombstones BIGINT[] = NULL)
     RETURNS SETOF __vector_index_search_results
     AS 'MODULE_PATHNAME', 'faiss_index_range_search'
     LANGUAGE C IMMUTABLE;
 
+CREATE OR REPLACE FUNCTION faiss_index_search_flat(faiss_index BYTEA, query_vectors REAL[], dim INT, topk INT, query_idxs BIGINT[] = NULL, faiss_index_key TEXT = NULL, tombstones BIGINT[] = NULL)
+    RETURNS __vector_index_search_flat_results
+    AS 'MODULE_PATHNAME', 'faiss_index_search_flat'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION faiss_index_range_search_flat(faiss_index BYTEA, query_vectors REAL[], dim INT, radius REAL, query_idxs BIGINT[] = NULL, faiss_index_key TEXT = NULL, tombstones BIGINT[] = NULL)
+    RETURNS __vector_index_search_flat_results
+    AS 'MODULE_PATHNAME', 'faiss_index_range_search_flat'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION faiss_index_chunks(faiss_index BYTEA, chunk_size INT = 268435456)
+    RETURNS SETOF __faiss_index_chunk
+    AS 'MODULE_PATHNAME', 'faiss_index_chunks'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION faiss_index_cache_chunks(faiss_index_key TEXT, chunk_size INT = 268435456)
+    RETURNS SETOF __faiss_index_chunk
+    AS 'MODULE_PATHNAME', 'faiss_index_cache_chunks'
+    LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION faiss_index_load_chunks_transfn(internal, faiss_index_key TEXT, chunk_no INT, chunk BYTEA)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_load_chunks_transfn'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION faiss_index_load_chunks_finalfn(internal)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME', 'faiss_index_load_chunks_finalfn'
+    LANGUAGE C;
+
+CREATE AGGREGATE faiss_index_load_chunks(faiss_index_key TEXT, chunk_no INT, chunk BYTEA) (
+    SFUNC = faiss_index_load_chunks_transfn,
+    STYPE = internal,
+    FINALFUNC = faiss_index_load_chunks_finalfn
+);
+
+CREATE OR REPLACE FUNCTION faiss_index_search_batch_transfn(internal, faiss_index BYTEA, query_vector REAL[], query_idx BIGINT, topk INT, faiss_index_key TEXT)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_search_batch_transfn'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION faiss_index_search_batch_finalfn(internal)
+    RETURNS __vector_index_search_flat_results
+    AS 'MODULE_PATHNAME', 'faiss_index_search_batch_finalfn'
+    LANGUAGE C;
+
+CREATE AGGREGATE faiss_index_search_batch(faiss_index BYTEA, query_vector REAL[], query_idx BIGINT, topk INT, faiss_index_key TEXT) (
+    SFUNC = faiss_index_search_batch_transfn,
+    STYPE = internal,
+    FINALFUNC = faiss_index_search_batch_finalfn
+);
+
+CREATE OR REPLACE FUNCTION faiss_index_search_batch_transfn(internal, faiss_index BYTEA, query_vector REAL[], query_idx BIGINT, topk INT, faiss_index_key TEXT, tombstones BIGINT[])
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_search_batch_transfn'
+    LANGUAGE C;
+
+CREATE AGGREGATE faiss_index_search_batch(faiss_index BYTEA, query_vector REAL[], query_idx BIGINT, topk INT, faiss_index_key TEXT, tombstones BIGINT[]) (
+    SFUNC = faiss_index_search_batch_transfn,
+    STYPE = internal,
+    FINALFUNC = faiss_index_search_batch_finalfn
+);
+
+CREATE OR REPLACE FUNCTION faiss_index_search_shards_transfn(internal, faiss_index BYTEA, query_vectors REAL[], dim INT, topk INT, query_idxs BIGINT[], faiss_index_key TEXT)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_search_shards_transfn'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION faiss_index_search_shards_finalfn(internal)
+    RETURNS __vector_index_search_flat_results
+    AS 'MODULE_PATHNAME', 'faiss_index_search_shards_finalfn'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION faiss_index_search_shards_combinefn(internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_search_shards_combinefn'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION faiss_index_search_shards_serialfn(internal)
+    RETURNS BYTEA
+    AS 'MODULE_PATHNAME', 'faiss_index_search_shards_serialfn'
+    LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION faiss_index_search_shards_deserialfn(BYTEA, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_search_shards_deserialfn'
+    LANGUAGE C STRICT;
+
+CREATE AGGREGATE faiss_index_search_shards(faiss_index BYTEA, query_vectors REAL[], dim INT, topk INT, query_idxs BIGINT[], faiss_index_key TEXT) (
+    SFUNC = faiss_index_search_shards_transfn,
+    STYPE = internal,
+    FINALFUNC = faiss_index_search_shards_finalfn,
+    COMBINEFUNC = faiss_index_search_shards_combinefn,
+    SERIALFUNC = faiss_index_search_shards_serialfn,
+    DESERIALFUNC = faiss_index_search_shards_deserialfn
+);
+
+CREATE OR REPLACE FUNCTION faiss_index_search_shards_transfn(internal, faiss_index BYTEA, query_vectors REAL[], dim INT, topk INT, query_idxs BIGINT[], faiss_index_key TEXT, tombstones BIGINT[])
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'faiss_index_search_shards_transfn'
+    LANGUAGE C;
+
+CREATE AGGREGATE faiss_index_search_shards(faiss_index BYTEA, query_vectors REAL[], dim INT, topk INT, query_idxs BIGINT[], faiss_index_key TEXT, tombstones BIGINT[]) (
+    SFUNC = faiss_index_search_shards_transfn,
+    STYPE = internal,
+    FINALFUNC = faiss_index_search_shards_finalfn,
+    COMBINEFUNC = faiss_index_search_shards_combinefn,
+    SERIALFUNC = faiss_index_search_shards_serialfn,
+    DESERIALFUNC = faiss_index_search_shards_deserialfn
+);
+
+CREATE OR REPLACE FUNCTION unnest_search_results(results __vector_index_search_flat_results)
+    RETURNS SETOF __vector_index_search_results
+    AS 'MODULE_PATHNAME', 'unnest_search_results'
+    LANGUAGE C IMMUTABLE STRICT;
+
 CREATE OR REPLACE FUNCTION topk_merge_transfn(internal, idxs BIGINT[], distance REAL[], topk INT)
     RETURNS internal
     AS 'MODULE_PATHNAME', 'topk_merge_transfn'
@@ -82,10 +283,42 @@ CREATE OR REPLACE FUNCTION topk_merge_finalfn(internal)
     AS 'MODULE_PATHNAME', 'topk_merge_finalfn'
     LANGUAGE C;
 
+CREATE OR REPLACE FUNCTION topk_merge_combinefn(internal, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'topk_merge_combinefn'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION topk_merge_serialfn(internal)
+    RETURNS BYTEA
+    AS 'MODULE_PATHNAME', 'topk_merge_serialfn'
+    LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION topk_merge_deserialfn(BYTEA, internal)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'topk_merge_deserialfn'
+    LANGUAGE C STRICT;
+
 CREATE AGGREGATE topk_merge(idxs BIGINT[], distance REAL[], topk INT) (
     SFUNC = topk_merge_transfn,
     STYPE = internal,
-    FINALFUNC = topk_merge_finalfn
+    FINALFUNC = topk_merge_finalfn,
+    COMBINEFUNC = topk_merge_combinefn,
+    SERIALFUNC = topk_merge_serialfn,
+    DESERIALFUNC = topk_merge_deserialfn
+);
+
+CREATE OR REPLACE FUNCTION topk_merge_transfn(internal, idxs BIGINT[], distance REAL[], topk INT, metric_type INT)
+    RETURNS internal
+    AS 'MODULE_PATHNAME', 'topk_merge_transfn'
+    LANGUAGE C;
+
+CREATE AGGREGATE topk_merge(idxs BIGINT[], distance REAL[], topk INT, metric_type INT) (
+    SFUNC = topk_merge_transfn,
+    STYPE = internal,
+    FINALFUNC = topk_merge_finalfn,
+    COMBINEFUNC = topk_merge_combinefn,
+    SERIALFUNC = topk_merge_serialfn,
+    DESERIALFUNC = topk_merge_deserialfn
 );
 
 CREATE OR REPLACE FUNCTION reset_cache(capacity BIGINT)
@@ -93,12 +326,102 @@ CREATE OR REPLACE FUNCTION reset_cache(capacity BIGINT)
     AS 'MODULE_PATHNAME', 'reset_cache'
     LANGUAGE C;
 
+CREATE OR REPLACE FUNCTION resize_cache(capacity BIGINT)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME', 'resize_cache'
+    LANGUAGE C STRICT;
+
 CREATE OR REPLACE FUNCTION total_charge_cache()
     RETURNS BIGINT
     AS 'MODULE_PATHNAME', 'total_charge_cache'
     LANGUAGE C;
 
+CREATE OR REPLACE FUNCTION charge_cache(faiss_index_key TEXT)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME', 'charge_cache'
+    LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION erase_cache(faiss_index_key TEXT)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME', 'erase_cache'
+    LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION erase_cache_versions(faiss_index_key TEXT)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME', 'erase_cache_versions'
+    LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION publish_cache(faiss_index_key TEXT, faiss_index BYTEA)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME', 'publish_cache'
+    LANGUAGE C STRICT;
+
 CREATE OR REPLACE FUNCTION prune_cache()
     RETURNS void
     AS 'MODULE_PATHNAME', 'prune_cache'
     LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION cache_stats(OUT shard INT, OUT capacity BIGINT, OUT usage BIGINT, OUT entries BIGINT,
+                                       OUT hits BIGINT, OUT misses BIGINT, OUT inserts BIGINT, OUT rejects BIGINT, OUT evictions BIGINT, OUT bytes_evicted BIGINT,
+                                       OUT erased_in_use BIGINT, OUT lock_waits BIGINT, OUT loads BIGINT, OUT load_failures BIGINT, OUT load_seconds FLOAT8)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'cache_stats'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION cache_entries(OUT key TEXT, OUT shard INT, OUT charge BIGINT, OUT refs INT, OUT priority TEXT, OUT protected BOOLEAN,
+                                         OUT age INTERVAL, OUT last_access TIMESTAMPTZ)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'cache_entries'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION shared_cache_remove(faiss_index_key TEXT)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME', 'shared_cache_remove'
+    LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION shared_cache_clear()
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME', 'shared_cache_clear'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION index_store_remove(faiss_index_key TEXT)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME', 'index_store_remove'
+    LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION index_store_clear()
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME', 'index_store_clear'
+    LANGUAGE C;
+
+-- faiss indexes the warm-up worker of every segment publishes to the shared tier, by decreasing priority
+CREATE TABLE vector_recall_warm_list (
+    relid REGCLASS NOT NULL,
+    index_col NAME NOT NULL,
+    key_col NAME,
+    priority INT NOT NULL DEFAULT 0,
+    PRIMARY KEY (relid, index_col)
+) DISTRIBUTED REPLICATED;
+SELECT pg_catalog.pg_extension_config_dump('vector_recall_warm_list', '');
+
+CREATE OR REPLACE FUNCTION vector_recall_register_warm(index_table REGCLASS, index_col NAME, key_col NAME = NULL, priority INT = 0)
+    RETURNS void
+    AS 'MODULE_PATHNAME', 'vector_recall_register_warm'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION vector_recall_unregister_warm(index_table REGCLASS, index_col NAME)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME', 'vector_recall_unregister_warm'
+    LANGUAGE C STRICT;
+
+CREATE OR REPLACE FUNCTION vector_recall_warm()
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME', 'vector_recall_warm'
+    LANGUAGE C;
+
+CREATE OR REPLACE FUNCTION vector_recall_warm_progress(OUT running BOOLEAN, OUT started_at TIMESTAMPTZ, OUT finished_at TIMESTAMPTZ,
+                                                       OUT indexes_total INT, OUT indexes_warmed INT, OUT indexes_cached INT, OUT indexes_skipped INT,
+                                                       OUT bytes BIGINT, OUT last_error TEXT)
+    RETURNS record
+    AS 'MODULE_PATHNAME', 'vector_recall_warm_progress'
+    LANGUAGE C;
@@ -8,11 +8,33 @@
 
 #include "postgres.h"
 #include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "access/tuptoaster.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "cdb/cdbvars.h"
+#include "executor/spi.h"
+#include "libpq/md5.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/postmaster.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
 #include "utils/array.h"
+#include "utils/datum.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
 #include "utils/lsyscache.h"
 #include "utils/builtins.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
 
 #include "cache/cache_c.h"
+#include "faiss_ext/faiss_ext_c.h"
 
 #include "faiss/c_api/Index_c.h"
 #include "faiss/c_api/error_c.h"
@@ -30,6 +52,116 @@ PG_MODULE_MAGIC;
 
 #define ARRNELEMS(x) ArrayGetNItems(ARR_NDIM(x), ARR_DIMS(x))
 
+/* the index store, relative to the data directory of the segment */
+#define INDEX_STORE_DIR "vector_recall_store"
+
+/* in vector_recall.omp_threads' automatic mode, a search gets one thread per this many query vectors */
+#define OMP_QUERIES_PER_THREAD 16
+
+/* greenplum only dispatches the custom GUCs flagged GUC_GPDB_NEED_SYNC to the segments */
+#ifdef GUC_GPDB_NEED_SYNC
+#define VECTOR_RECALL_GUC_FLAGS GUC_GPDB_NEED_SYNC
+#else
+#define VECTOR_RECALL_GUC_FLAGS 0
+#endif
+
+typedef enum auto_cache_key_mode
+{
+    AUTO_CACHE_KEY_OFF,         // only cache the indexes given a faiss_index_key
+    AUTO_CACHE_KEY_TOAST,       // also key toasted indexes by their toast pointer
+    AUTO_CACHE_KEY_FINGERPRINT, // also key the other indexes by a fingerprint of their content
+} auto_cache_key_mode;
+
+static const struct config_enum_entry auto_cache_key_options[] = {
+    {"off", AUTO_CACHE_KEY_OFF, false},
+    {"toast", AUTO_CACHE_KEY_TOAST, false},
+    {"fingerprint", AUTO_CACHE_KEY_FINGERPRINT, false},
+    {NULL, 0, false}};
+
+typedef enum cache_policy
+{
+    CACHE_POLICY_LRU,
+    CACHE_POLICY_SLRU,  // segmented LRU, scan-resistant
+    CACHE_POLICY_CLOCK, // CLOCK, for concurrent lookups of a few hot indexes
+} cache_policy;
+
+static const struct config_enum_entry cache_policy_options[] = {
+    {"lru", CACHE_POLICY_LRU, false},
+    {"slru", CACHE_POLICY_SLRU, false},
+    {"clock", CACHE_POLICY_CLOCK, false},
+    {NULL, 0, false}};
+
+typedef enum omp_wait_policy_mode
+{
+    OMP_WAIT_POLICY_DEFAULT, // as the OpenMP runtime is configured, see OMP_WAIT_POLICY
+    OMP_WAIT_POLICY_PASSIVE, // idle threads sleep
+    OMP_WAIT_POLICY_ACTIVE,  // idle threads spin a while
+} omp_wait_policy_mode;
+
+static const struct config_enum_entry omp_wait_policy_options[] = {
+    {"default", OMP_WAIT_POLICY_DEFAULT, false},
+    {"passive", OMP_WAIT_POLICY_PASSIVE, false},
+    {"active", OMP_WAIT_POLICY_ACTIVE, false},
+    {NULL, 0, false}};
+
+static const struct config_enum_entry cache_priority_options[] = {
+    {"low", CACHE_PRIORITY_LOW, false},
+    {"high", CACHE_PRIORITY_HIGH, false},
+    {"pinned", CACHE_PRIORITY_PINNED, false},
+    {NULL, 0, false}};
+
+static int auto_cache_key = AUTO_CACHE_KEY_TOAST;
+static int cache_policy_option = CACHE_POLICY_LRU; // eviction policy of the caches created from now on
+static int cache_priority_option = CACHE_PRIORITY_LOW; // eviction priority of the entries inserted from now on
+static int cache_shard_bits = 4;      // the caches created from now on have 2^cache_shard_bits shards
+static int cache_capacity = 32768;    // in kB, capacity of the caches created from now on without an explicit one
+static int cache_admission_percent = 100; // entries charged more than this percent of the capacity are not cached
+static char *cache_key_version = NULL; // version the faiss_index_keys are tagged with, empty for none
+static char *shared_cache_dir = NULL; // directory of the index images shared by the backends, empty to disable
+static int shared_cache_capacity = 0; // in kB, 0 for unlimited
+static bool index_store = false;      // materialize the loaded indexes in the index store of the segment
+static int index_store_capacity = 0;  // in kB, 0 for unlimited
+static char *warm_database = NULL;    // database of the warm-up worker, empty to disable it
+static int omp_threads = 0;           // OpenMP threads of each faiss call, 0 for automatic
+static int omp_max_threads = 4;       // at most that many in automatic mode, 0 for the number of processors
+static int omp_wait_policy = OMP_WAIT_POLICY_DEFAULT;
+static int train_sample_size = 0;     // rows create_index_agg trains on, 0 for automatic
+static int add_batch_size = 65536;    // rows create_index_agg adds at once once trained
+static int warm_budget = 0;           // in kB, 0 for unlimited
+
+/**
+ * warm_state
+ * state of the cache warm-up worker of the segment, in shared memory.
+ * only allocated when vector_recall is in shared_preload_libraries.
+ */
+typedef struct warm_state
+{
+    slock_t mutex;
+    PGPROC *worker; // the warm-up worker, NULL if not running
+    bool requested; // a warm-up is due
+    bool running;
+    TimestampTz started_at;
+    TimestampTz finished_at;
+    int32 indexes_total;   // indexes found in the registered columns so far
+    int32 indexes_warmed;  // indexes published to the shared tier
+    int32 indexes_cached;  // indexes found already published
+    int32 indexes_skipped; // NULL, not cacheable, over the budget or failed
+    int64 bytes;           // size of the warmed and cached indexes
+    char last_error[256];
+} warm_state;
+
+typedef enum warm_outcome
+{
+    WARM_WARMED,
+    WARM_CACHED,
+    WARM_SKIPPED,
+} warm_outcome;
+
+static warm_state *warm_shared_state = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static volatile sig_atomic_t warm_got_sigterm = false;
+static volatile sig_atomic_t warm_got_sighup = false;
+
 typedef struct array_1d_extend_state
 {
     uint8 *data;
@@ -44,7 +176,8 @@ typedef struct array_1d_extend_state
  */
 typedef struct faiss_search_result
 {
-    uint32 dim; // the length of query_vector
+    uint32 dim;               // the length of query_vector
+    uint32 query_vectors_num; // the number of query_vectors
     union
     {
         uint32 topk;   // the input value of k
@@ -53,6 +186,9 @@ typedef struct faiss_search_result
     float4 *query_vectors; // the data of query_vectors. float array [query_vectors_num * dim]
     int64 *query_idxs;     // the id of query_vectors. int64 array [query_idxs_num]
 
+    int64 *excluded_ids;      // ids the search skips, sorted ascending. NULL if none
+    uint32 excluded_ids_num;
+
     float4 *distances; // the distances result of faiss search.
     int64 *idxs;       // the id result of faiss search.
 
@@ -60,57 +196,348 @@ typedef struct faiss_search_result
     FaissRangeSearchResult *faiss_range_search_result; //  for faiss range search
 } faiss_search_result;
 
+/**
+ * cache_item
+ * value of the cache entries. the faiss index may be deserialized zero-copy,
+ * in that case its code arrays point into the serialized buffer held by context.
+ * charge is what the entry costs in memory, see cache_item_charge().
+ */
+typedef struct cache_item
+{
+    FaissIndex *index;
+    MemoryContext context; // owns the cache_item itself and the serialized buffer. NULL if no buffer is kept
+    shared_image_t *image; // the shared image the index was read from, if any
+    size_t charge;
+} cache_item;
+
+/**
+ * cache_item_loader
+ * argument of load_cache_item()
+ */
+typedef struct cache_item_loader
+{
+    const char *key;
+    Datum index_datum;
+    bool index_isnull;
+    ErrorData *edata; // error raised while loading
+} cache_item_loader;
+
+typedef struct index_chunk
+{
+    int32 chunk_no;
+    Datum chunk; // the raw input datum, may still be a toast pointer until the reader reaches it
+} index_chunk;
+
+typedef struct load_chunks_state
+{
+    char *key;
+    uint32 chunk_num;
+    uint32 capacity;
+    index_chunk *chunks;
+} load_chunks_state;
+
+/**
+ * cache_chunks_state
+ * the cached faiss index faiss_index_cache_chunks() serializes, one chunk per call
+ */
+typedef struct cache_chunks_state
+{
+    char *key;
+    cache_item *item; // the entry of the first call, the later calls check they still find it
+    size_t total_size;
+    size_t chunk_size;
+} cache_chunks_state;
+
+/**
+ * chunk_reader
+ * argument of fetch_index_chunk(). the chunks are detoasted one by one while faiss reads them,
+ * so that the whole serialized index is never materialized.
+ */
+typedef struct chunk_reader
+{
+    index_chunk *chunks;
+    bytea *detoasted; // detoasted copy of the current chunk, if any
+    ErrorData *edata; // error raised while fetching a chunk
+} chunk_reader;
+
+/**
+ * building_index
+ * a faiss index create_index_agg adds to. faiss allocates it outside of the memory contexts, so the
+ * ones still building when the transaction ends, e.g. on error, are freed by building_index_xact_callback().
+ */
+typedef struct building_index
+{
+    FaissIndex *index;
+    struct building_index *next;
+} building_index;
+
+static building_index *building_indexes = NULL;
+
+/**
+ * create_index_state
+ * the rows of create_index_agg are buffered until the index is trained on the first train_size
+ * of them, then added add_batch_size at a time: the state never holds more than that many rows.
+ */
 typedef struct create_index_state
 {
     uint32 dim;
-    uint32 size;
+    uint32 size;     // rows buffered
     uint32 capacity;
-    FaissMetricType metric_type;
+    uint32 train_size; // rows the index is trained on, 0 once it is trained
+    uint32 batch_size; // rows added to the trained index at once
+    uint64 total;      // rows added to the index
+    bool with_ids;
+    char *key; // faiss_index_key the index is cached under by create_index_cache_finalfn(), NULL for a bytea
     float4 *data;
     idx_t *idxs;
-    char description[256];
-    char runtime_parameters[1000];
+    building_index *building;
 } create_index_state;
 
+/**
+ * search_batch_state
+ * the query vectors of faiss_index_search_batch(), searched at once by its finalfn
+ */
+typedef struct search_batch_state
+{
+    char *key;         // NULL if the index is not cached, see index_cache_key()
+    Datum index_datum; // copy of the faiss index argument of the first row, may still be a toast pointer
+    bool index_isnull;
+    uint32 dim;
+    uint32 topk;
+    uint32 size;
+    uint32 capacity;
+    float4 *query_vectors;
+    int64 *query_idxs;
+    ArrayType *tombstones; // detoasted copy of the tombstones argument of the first row, NULL if none
+} search_batch_state;
+
+/**
+ * index_shard
+ * a faiss index collected by faiss_index_search_shards(), searched once the segment is done with its rows
+ */
+typedef struct index_shard
+{
+    char *key;         // NULL if the index is not cached, see index_cache_key()
+    Datum index_datum; // copy of the faiss index argument, may still be a toast pointer
+    bool index_isnull;
+    int64 *excluded_ids; // tombstones of the shard, sorted ascending. NULL if none
+    uint32 excluded_ids_num;
+} index_shard;
+
+/**
+ * search_shards_state
+ * the shards of faiss_index_search_shards() not searched yet, and the topk merged over the ones searched
+ */
+typedef struct search_shards_state
+{
+    uint32 dim;
+    uint32 topk;
+    uint32 query_vectors_num;
+    float4 *query_vectors; // of the first row. NULL in a state deserialized from another segment
+    int64 *query_idxs;     // NULL if not given
+    uint32 shard_num;
+    uint32 shard_capacity;
+    index_shard *shards;
+    int32 metric_type; // of the shards searched so far, -1 if none was
+    float4 *distances; // merged result of the shards searched so far, [query_vectors_num * topk]
+    int64 *idxs;
+} search_shards_state;
+
+/**
+ * search_shards_header
+ * header of a serialized search_shards_state, followed by its query_idxs, distances and idxs
+ */
+typedef struct search_shards_header
+{
+    uint32 dim;
+    uint32 topk;
+    uint32 query_vectors_num;
+    int32 metric_type;
+    bool has_query_idxs;
+} search_shards_header;
+
+/**
+ * topk_merge_state
+ * the topk nearest candidates merged so far, nearest first. every input batch is merged in and
+ * truncated to topk, so the state never holds more than topk candidates, each id once.
+ */
 typedef struct topk_merge_state
 {
     idx_t *idxs;
     float4 *distance;
-    uint32 *lims;
-    uint32 batch_num;
+    idx_t *scratch_idxs; // the merge writes here, then swaps with idxs
+    float4 *scratch_distance;
+    uint32 size;
+    uint32 capacity;
     uint32 topk;
+    bool descending; // larger distances are nearer, as for METRIC_INNER_PRODUCT
 } topk_merge_state;
 
-typedef struct heap_buf
+/**
+ * id_set
+ * open addressing set of the ids emitted by a merge, see topk_merge_batch()
+ */
+typedef struct id_set
+{
+    int64 *ids;
+    bool *used;
+    uint32 mask;
+} id_set;
+
+/**
+ * topk_merge_header
+ * header of a serialized topk_merge_state, followed by its distance and idxs
+ */
+typedef struct topk_merge_header
 {
-    float distance;
-    uint32 batch_id;
-} heap_buf;
+    uint32 size;
+    uint32 topk;
+    bool descending;
+} topk_merge_header;
 
-void swap_buf(heap_buf *hb1, heap_buf *hb2);
-void shiftdown(heap_buf *heap, uint32 start, uint32 end);
-void build_min_heap(heap_buf **heap, float *distance, int64 *idxs, uint32 *batches_size, uint32 batch_num);
-void heap_topk(heap_buf *heap, float *distance, int64 *idxs, Datum **result_distance, Datum **result_idxs, uint32 *batches_size, uint32 batch_num, uint32 topk);
+topk_merge_state *topk_merge_state_new(uint32 topk, bool descending);
+void topk_merge_batch(topk_merge_state *state, const int64 *idxs, const float4 *distance, uint32 num);
+bool id_set_insert(id_set *set, int64 id);
+
+create_index_state *create_index_state_new(building_index *building, bool with_ids);
+void create_index_append(create_index_state *state, const float4 *vector, int64 idx);
+void create_index_flush(create_index_state *state);
+building_index *building_index_register(FaissIndex *index);
+void building_index_unregister(building_index *building);
+void building_index_xact_callback(XactEvent event, void *arg);
 
 bytea *faissindex2bytea(FaissIndex *fi);
-FaissIndex *bytea2faissindex(const bytea *index_bytea);
+bytea *faissindex2bytea_after(FaissIndex *fi, const char *header, size_t header_size);
+FaissIndex *bytea2faissindex(const bytea *index_bytea, bool zero_copy);
+
+faiss_search_result *index_search(FunctionCallInfo fcinfo, bool range_search, int key_argno, bool preserve_vector, int excluded_argno);
+int64 *sorted_ids(ArrayType *ids_array, uint32 *ids_num);
+int int64_cmp(const void *a, const void *b);
+void search_index(Datum index_datum, bool index_isnull, const char *key, faiss_search_result *search_result, float4 *query_vectors, bool range_search);
+void faiss_threads(size_t vectors_num, bool search);
+ArrayType *array_1d_from_buffer(const void *data, size_t nelems, Oid element_type, int elmlen);
+Datum flat_search_result(FunctionCallInfo fcinfo, faiss_search_result *search_result, int64 *lims, ArrayType *idx_array, ArrayType *dis_array);
+Datum flat_topk_search_result(FunctionCallInfo fcinfo, faiss_search_result *search_result);
+void search_shards_flush(search_shards_state *state, MemoryContext context);
+void search_shards_merge(search_shards_state *state, const float4 *distances, const int64 *idxs);
+void release_shard_indexes(cache_t *cache, uint32 shard_num, handle_t **handles, FaissIndex **indexes);
+
+int fetch_index_chunk(void *arg, size_t chunk_no, const void **data, size_t *size);
+int index_chunk_cmp(const void *a, const void *b);
 
 cache_t *get_cache(size_t capacity);
+TimestampTz unix_micros_to_timestamptz(int64 micros);
+char *index_cache_key(FunctionCallInfo fcinfo, int index_argno, int key_argno);
+char *cache_key_arg(FunctionCallInfo fcinfo, int key_argno);
+char *versioned_cache_key(char *key);
+char *datum_cache_key(Datum index_datum);
+handle_t *cache_lookup_or_load_item(cache_t *cache, const char *key, Datum index_datum, bool index_isnull);
+int load_cache_item(void *arg, const char *key, size_t keylen, void **value, size_t *charge);
+cache_item *cache_item_load(Datum index_datum, const char *key, size_t keylen);
+cache_item *cache_item_read(Datum index_datum, const char *key, size_t keylen);
+char *datum_index_version(Datum index_datum);
+cache_item *index_store_open(const char *key, size_t keylen, const char *version);
+void index_store_save(const char *key, size_t keylen, const char *version, FaissIndex *index);
+size_t cache_item_charge(FaissIndex *index, size_t buffer_size);
+shared_image_t *shared_image_load(Datum index_datum, const char *key, size_t keylen);
+char *shared_image_key(const char *key);
+bool remove_shared_image(const char *key);
 void cache_item_deleter(const char *key, size_t keylen, void *value);
+bool cache_admit_item(cache_t *cache, const char *key, cache_item *item);
+
+void warm_worker_register(void);
+void warm_shmem_startup(void);
+void warm_worker_main(Datum main_arg);
+void warm_worker_detach(int code, Datum arg);
+void warm_sigterm(SIGNAL_ARGS);
+void warm_sighup(SIGNAL_ARGS);
+void warm_run(void);
+void warm_column(const char *relname, const char *index_col, const char *key_col, size_t budget, uint64 *bytes);
+void warm_column_rows(const char *relname, const char *index_col, const char *key_col, size_t budget, uint64 *bytes);
+warm_outcome warm_index(Datum index_datum, const char *key, size_t budget, uint64 *bytes);
+char *warm_list_table(Oid namespace_oid);
 
-#if 0
-/* it's too late to set env OMP_WAIT_POLICY */
 void _PG_init(void);
 void _PG_init(void)
 {
-    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: old env OMP_WAIT_POLICY: %s", __func__, getenv("OMP_WAIT_POLICY"))));
-    if (setenv("OMP_WAIT_POLICY", "PASSIVE", 1) != 0)
-    {
-        ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: faild to set env OMP_WAIT_POLICY.", __func__)));
-    }
-    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: now env OMP_WAIT_POLICY: %s", __func__, getenv("OMP_WAIT_POLICY"))));
+    DefineCustomEnumVariable("vector_recall.auto_cache_key",
+                             "How faiss indexes searched without a faiss_index_key are cached.",
+                             "off: not cached. toast: cached under their toast pointer if toasted. fingerprint: also cached under a hash of their content otherwise.",
+                             &auto_cache_key, AUTO_CACHE_KEY_TOAST, auto_cache_key_options, PGC_USERSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomEnumVariable("vector_recall.cache_policy",
+                             "Eviction policy of the faiss index cache.",
+                             "lru: least recently used. slru: segmented LRU, entries only looked up once (e.g. by a scan over cold indexes) are evicted first. clock: CLOCK approximation of LRU, lookups don't serialize on the lock of their shard. Takes effect when the cache is (re)created, see reset_cache().",
+                             &cache_policy_option, CACHE_POLICY_LRU, cache_policy_options, PGC_USERSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomIntVariable("vector_recall.cache_shard_bits",
+                            "The faiss index cache is split into 2^cache_shard_bits independently locked shards.",
+                            "Takes effect when the cache is (re)created, see reset_cache().",
+                            &cache_shard_bits, 4, 0, 10, PGC_USERSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomIntVariable("vector_recall.cache_capacity",
+                            "Capacity of the faiss index cache, shared by all its shards.",
+                            "Takes effect when the cache is created, reset_cache() takes an explicit capacity.",
+                            &cache_capacity, 32768, 1, INT_MAX, PGC_USERSET, GUC_UNIT_KB | VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomIntVariable("vector_recall.cache_admission_percent",
+                            "Faiss indexes charged more than this percent of the cache capacity are not cached, unless pinned.",
+                            "They are searched and freed instead of evicting most of the cache. Takes effect when the cache is (re)created, see reset_cache().",
+                            &cache_admission_percent, 100, 1, 100, PGC_USERSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomStringVariable("vector_recall.cache_key_version",
+                               "Version every faiss_index_key given to the functions of vector_recall is tagged with.",
+                               "A non-empty version v turns the key k into k@v, so that the indexes of a new version can be published next to the ones in use and switched to at once on every segment.",
+                               &cache_key_version, "", PGC_USERSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomEnumVariable("vector_recall.cache_priority",
+                             "Eviction priority of the faiss indexes cached by this session.",
+                             "low: evicted first. high: only evicted when no low entry is left. pinned: never evicted.",
+                             &cache_priority_option, CACHE_PRIORITY_LOW, cache_priority_options, PGC_USERSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomStringVariable("vector_recall.shared_cache_dir",
+                               "Directory of the faiss index images shared by all the backends of the host.",
+                               "Empty disables the shared tier. It should be on a tmpfs, e.g. /dev/shm/vector_recall.",
+                               &shared_cache_dir, "", PGC_SUSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomIntVariable("vector_recall.shared_cache_capacity",
+                            "Maximum total size of the shared faiss index images, 0 for unlimited.",
+                            NULL, &shared_cache_capacity, 0, 0, INT_MAX, PGC_SUSET, GUC_UNIT_KB | VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomBoolVariable("vector_recall.index_store",
+                             "Materialize the faiss indexes loaded into the cache as files under the data directory of the segment.",
+                             "Later loads memory map the file of the current version of the index instead of reading the bytea.",
+                             &index_store, false, PGC_SUSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomIntVariable("vector_recall.index_store_capacity",
+                            "Maximum total size of the index store of each segment, 0 for unlimited.",
+                            NULL, &index_store_capacity, 0, 0, INT_MAX, PGC_SUSET, GUC_UNIT_KB | VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomStringVariable("vector_recall.warm_database",
+                               "Database the cache warm-up worker of each segment reads the registered faiss indexes from.",
+                               "Empty disables the worker. It requires vector_recall in shared_preload_libraries and the shared tier, see vector_recall.shared_cache_dir.",
+                               &warm_database, "", PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomIntVariable("vector_recall.warm_budget",
+                            "Maximum total size of the faiss indexes the warm-up worker loads, 0 for unlimited.",
+                            "vector_recall.shared_cache_capacity bounds it as well.",
+                            &warm_budget, 0, 0, INT_MAX, PGC_SIGHUP, GUC_UNIT_KB, NULL, NULL, NULL);
+
+    DefineCustomIntVariable("vector_recall.omp_threads",
+                            "Number of OpenMP threads of each faiss search, training or add, 0 for automatic.",
+                            "Automatic: searches get one thread per 16 query vectors, training and adds vector_recall.omp_max_threads.",
+                            &omp_threads, 0, 0, 1024, PGC_USERSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomIntVariable("vector_recall.omp_max_threads",
+                            "Maximum number of OpenMP threads of each faiss call in automatic mode, 0 for the number of processors.",
+                            "Several segments and sessions share the processors of a host.",
+                            &omp_max_threads, 4, 0, 1024, PGC_USERSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomEnumVariable("vector_recall.omp_wait_policy",
+                             "Whether the idle OpenMP threads of faiss sleep or spin between two faiss calls.",
+                             "default: as configured by OMP_WAIT_POLICY. passive: they sleep. active: they spin a while. The GNU OpenMP runtime only takes it from OMP_WAIT_POLICY in the environment the server starts from.",
+                             &omp_wait_policy, OMP_WAIT_POLICY_DEFAULT, omp_wait_policy_options, PGC_USERSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+
+    DefineCustomIntVariable("vector_recall.train_sample_size",
+                            "Number of rows create_index_agg trains a faiss index on, 0 for automatic.",
+                            "They are its first rows. Automatic: as many as faiss keeps from a larger training set, 256 per centroid of its coarse or product quantizers.",
+                            &train_sample_size, 0, 0, INT_MAX, PGC_USERSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+    DefineCustomIntVariable("vector_recall.add_batch_size",
+                            "Number of rows create_index_agg adds to a trained faiss index at once.",
+                            "The rows of a batch are buffered until they are added.",
+                            &add_batch_size, 65536, 1, INT_MAX, PGC_USERSET, VECTOR_RECALL_GUC_FLAGS, NULL, NULL, NULL);
+
+    RegisterXactCallback(building_index_xact_callback, NULL);
+
+    if (process_shared_preload_libraries_in_progress)
+        warm_worker_register();
 }
-#endif
 
 PG_FUNCTION_INFO_V1(array_1d_extend_transfn);
 Datum array_1d_extend_transfn(PG_FUNCTION_ARGS)
@@ -199,7 +626,7 @@ PG_FUNCTION_INFO_V1(faiss_index_train);
 Datum faiss_index_train(PG_FUNCTION_ARGS)
 {
     bytea *index_bytea = PG_GETARG_BYTEA_P(0);
-    FaissIndex *index = bytea2faissindex(index_bytea);
+    FaissIndex *index = bytea2faissindex(index_bytea, false);
 
     ArrayType *vectors_array = PG_GETARG_ARRAYTYPE_P(1);
     float4 *vectors = (float4 *)ARR_DATA_PTR(vectors_array);
@@ -213,7 +640,10 @@ Datum faiss_index_train(PG_FUNCTION_ARGS)
     if (faiss_Index_is_trained(index))
         ereport(WARNING, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: faiss index can't or needn't train", __func__)));
     else
+    {
+        faiss_threads(vectors_num, false);
         FAISS_CHECK(faiss_Index_train(index, ARRNELEMS(vectors_array) / dim, vectors));
+    }
 
     PG_RETURN_BYTEA_P(faissindex2bytea(index));
 }
@@ -223,7 +653,7 @@ Datum faiss_index_add(PG_FUNCTION_ARGS)
 {
     CHECK(!PG_ARGISNULL(0));
     bytea *index_bytea = PG_GETARG_BYTEA_P(0);
-    FaissIndex *index = bytea2faissindex(index_bytea);
+    FaissIndex *index = bytea2faissindex(index_bytea, false);
 
     CHECK(!PG_ARGISNULL(1));
     ArrayType *vectors_array = PG_GETARG_ARRAYTYPE_P(1);
@@ -236,6 +666,7 @@ Datum faiss_index_add(PG_FUNCTION_ARGS)
     int64 vectors_num = ARRNELEMS(vectors_array) / dim;
     ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: vectors_num:%ld", __func__, vectors_num)));
 
+    faiss_threads(vectors_num, false);
     if (unlikely(PG_ARGISNULL(3)))
     {
         FAISS_CHECK(faiss_Index_add(index, vectors_num, vectors)); // add vectors to the index
@@ -256,7 +687,7 @@ PG_FUNCTION_INFO_V1(faiss_index_set_runtime_parameters);
 Datum faiss_index_set_runtime_parameters(PG_FUNCTION_ARGS)
 {
     bytea *index_bytea = PG_GETARG_BYTEA_P(0);
-    FaissIndex *index = bytea2faissindex(index_bytea);
+    FaissIndex *index = bytea2faissindex(index_bytea, false);
 
     char *runtime_parameters = text_to_cstring(PG_GETARG_TEXT_P(1));
     ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: input runtime_parameters: %s", __func__, runtime_parameters)));
@@ -273,13 +704,58 @@ PG_FUNCTION_INFO_V1(faiss_index_reset);
 Datum faiss_index_reset(PG_FUNCTION_ARGS)
 {
     bytea *index_bytea = PG_GETARG_BYTEA_P(0);
-    FaissIndex *index = bytea2faissindex(index_bytea);
+    FaissIndex *index = bytea2faissindex(index_bytea, false);
 
     FAISS_CHECK(faiss_Index_reset(index));
 
     PG_RETURN_BYTEA_P(faissindex2bytea(index));
 }
 
+PG_FUNCTION_INFO_V1(faiss_index_remove_ids);
+Datum faiss_index_remove_ids(PG_FUNCTION_ARGS)
+{
+    bytea *index_bytea = PG_GETARG_BYTEA_P(0);
+    uint32 ids_num = 0;
+    int64 *ids = sorted_ids(PG_GETARG_ARRAYTYPE_P(1), &ids_num);
+    FaissIndex *index = bytea2faissindex(index_bytea, false);
+
+    FaissIDSelectorBatch *selector = NULL;
+    FAISS_CHECK(faiss_IDSelectorBatch_new(&selector, ids_num, ids));
+    size_t removed = 0;
+    int ret = faiss_Index_remove_ids(index, (FaissIDSelector *)selector, &removed);
+    faiss_IDSelector_free((FaissIDSelector *)selector);
+    FAISS_CHECK(ret);
+    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: ids:%u, removed:%zu", __func__, ids_num, removed)));
+
+    PG_RETURN_BYTEA_P(faissindex2bytea(index));
+}
+
+PG_FUNCTION_INFO_V1(tombstones_add);
+Datum tombstones_add(PG_FUNCTION_ARGS)
+{
+    uint32 tombstones_num = 0, ids_num = 0;
+    int64 *tombstones = PG_ARGISNULL(0) ? NULL : sorted_ids(PG_GETARG_ARRAYTYPE_P(0), &tombstones_num);
+    int64 *ids = PG_ARGISNULL(1) ? NULL : sorted_ids(PG_GETARG_ARRAYTYPE_P(1), &ids_num);
+
+    // merge the two sorted sets
+    int64 *merged = palloc(((size_t)tombstones_num + ids_num + 1) * sizeof(int64));
+    uint32 i = 0, j = 0, num = 0;
+    while (i < tombstones_num || j < ids_num)
+    {
+        if (j == ids_num || (i < tombstones_num && tombstones[i] < ids[j]))
+            merged[num++] = tombstones[i++];
+        else if (i == tombstones_num || ids[j] < tombstones[i])
+            merged[num++] = ids[j++];
+        else
+        {
+            merged[num++] = tombstones[i++];
+            j++;
+        }
+    }
+
+    PG_RETURN_ARRAYTYPE_P(array_1d_from_buffer(merged, num, INT8OID, sizeof(int64)));
+}
+
 PG_FUNCTION_INFO_V1(create_index_transfn);
 Datum create_index_transfn(PG_FUNCTION_ARGS)
 {
@@ -295,50 +771,42 @@ Datum create_index_transfn(PG_FUNCTION_ARGS)
 
     if (unlikely(PG_ARGISNULL(0)))
     {
-        internal_state = (create_index_state *)palloc0(sizeof(create_index_state));
-        internal_state->size = 0;
-        internal_state->capacity = 16;
-        internal_state->dim = ARRNELEMS(vector_array);
-        internal_state->data = palloc(internal_state->capacity * internal_state->dim * sizeof(internal_state->data[0]));
-
         CHECK(!PG_ARGISNULL(2));
         char *description = text_to_cstring(PG_GETARG_TEXT_P(2));
-        strncpy(internal_state->description, description, sizeof(internal_state->description) / sizeof(internal_state->description[0]));
+        FaissMetricType metric_type = PG_ARGISNULL(4) ? METRIC_L2 : PG_GETARG_INT32(4);
 
-        if (likely(!PG_ARGISNULL(3)))
-            internal_state->idxs = palloc(internal_state->capacity * sizeof(internal_state->idxs[0]));
-
-        if (!PG_ARGISNULL(4))
-            internal_state->metric_type = PG_GETARG_INT32(4);
-        else
-            internal_state->metric_type = METRIC_L2;
+        // the index is built as the rows come, from the first one
+        FaissIndex *index = NULL;
+        FAISS_CHECK(faiss_index_factory(&index, ARRNELEMS(vector_array), description, metric_type));
+        building_index *building = building_index_register(index);
 
         if (!PG_ARGISNULL(5))
         {
             char *runtime_parameters = text_to_cstring(PG_GETARG_TEXT_P(5));
-            strncpy(internal_state->runtime_parameters, runtime_parameters, sizeof(internal_state->runtime_parameters) / sizeof(internal_state->runtime_parameters[0]));
             ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: input runtime_parameters: %s", __func__, runtime_parameters)));
+            FaissParameterSpace *parameter_space = NULL;
+            FAISS_CHECK(faiss_ParameterSpace_new(&parameter_space));
+            int ret = faiss_ParameterSpace_set_index_parameters(parameter_space, index, runtime_parameters);
+            faiss_ParameterSpace_free(parameter_space);
+            FAISS_CHECK(ret);
+        }
+
+        if (faiss_Index_is_trained(index))
+            ereport(LOG, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: faiss index can't or needn't train", __func__)));
+        internal_state = create_index_state_new(building, !PG_ARGISNULL(3));
+        // create_index_cache_agg
+        if (PG_NARGS() > 6)
+        {
+            CHECK(!PG_ARGISNULL(6));
+            internal_state->key = text_to_cstring(PG_GETARG_TEXT_P(6));
         }
     }
     else
-    {
         internal_state = (create_index_state *)PG_GETARG_POINTER(0);
-        CHECK(internal_state->dim == ARRNELEMS(vector_array));
-    }
 
-    if (internal_state->size == internal_state->capacity)
-    {
-        internal_state->capacity += (internal_state->capacity / 2);
-        internal_state->data = repalloc(internal_state->data, internal_state->capacity * internal_state->dim * sizeof(internal_state->data[0]));
-        if (likely(!PG_ARGISNULL(3)))
-            internal_state->idxs = repalloc(internal_state->idxs, internal_state->capacity * sizeof(internal_state->idxs[0]));
-    }
-
-    memcpy(internal_state->data + internal_state->size * internal_state->dim, ARR_DATA_PTR(vector_array), internal_state->dim * sizeof(internal_state->data[0]));
-    if (likely(!PG_ARGISNULL(3)))
-        internal_state->idxs[internal_state->size] = PG_GETARG_INT64(3);
-
-    internal_state->size += 1;
+    CHECK(internal_state->dim == ARRNELEMS(vector_array));
+    CHECK(internal_state->with_ids == !PG_ARGISNULL(3));
+    create_index_append(internal_state, (float4 *)ARR_DATA_PTR(vector_array), internal_state->with_ids ? PG_GETARG_INT64(3) : 0);
 
     MemoryContextSwitchTo(old_context);
     PG_RETURN_POINTER(internal_state);
@@ -356,31 +824,224 @@ Datum create_index_finalfn(PG_FUNCTION_ARGS)
         PG_RETURN_NULL();
 
     create_index_state *internal_state = (create_index_state *)PG_GETARG_POINTER(0);
+    CHECK(internal_state->building);
+    create_index_flush(internal_state);
+    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: total:" UINT64_FORMAT, __func__, internal_state->total)));
+
+    // faissindex2bytea() frees the index once written, it stays registered until then
+    bytea *result = faissindex2bytea(internal_state->building->index);
+    building_index_unregister(internal_state->building);
+    internal_state->building = NULL;
+    PG_RETURN_BYTEA_P(result);
+}
 
-    FaissIndex *index = NULL;
-    FAISS_CHECK(faiss_index_factory(&index, internal_state->dim, internal_state->description, METRIC_L2));
+PG_FUNCTION_INFO_V1(create_index_cache_finalfn);
+Datum create_index_cache_finalfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    if (unlikely(PG_ARGISNULL(0)))
+        PG_RETURN_NULL();
 
-    if (strnlen(internal_state->runtime_parameters, sizeof(internal_state->runtime_parameters) / sizeof(internal_state->runtime_parameters[0])))
+    create_index_state *internal_state = (create_index_state *)PG_GETARG_POINTER(0);
+    CHECK(internal_state->building);
+    CHECK(internal_state->key);
+    create_index_flush(internal_state);
+
+    // the index goes to the cache as it is, it is never serialized into a bytea so it may exceed 1GB
+    char *key = versioned_cache_key(pstrdup(internal_state->key));
+    FaissIndex *index = internal_state->building->index;
+    size_t charge = cache_item_charge(index, 0);
+    cache_item *item = (cache_item *)MemoryContextAlloc(TopMemoryContext, sizeof(cache_item));
+    item->index = index;
+    item->context = NULL;
+    item->image = NULL;
+    item->charge = charge;
+    // owned by the cache from here
+    building_index_unregister(internal_state->building);
+    internal_state->building = NULL;
+    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: key:%s, total:" UINT64_FORMAT ", charge:%zu", __func__, key, internal_state->total, charge)));
+
+    // like publish_cache(), the shared image of the key holds the index being replaced
+    remove_shared_image(key);
+    if (!cache_admit_item(get_cache(0), key, item))
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("%s: faiss index \"%s\" is not admitted by the cache", __func__, key),
+                        errhint("Raise vector_recall.cache_capacity or vector_recall.cache_admission_percent, or build it with vector_recall.cache_priority = 'pinned'.")));
+
+    PG_RETURN_TEXT_P(cstring_to_text(internal_state->key));
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_add_agg_transfn);
+Datum faiss_index_add_agg_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context, old_context;
+
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    CHECK(!PG_ARGISNULL(2));
+    ArrayType *vector_array = PG_GETARG_ARRAYTYPE_P(2);
+    // the ids of the partial indexes are kept as they are merged, sequential ones would collide
+    if (PG_ARGISNULL(3))
+        ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED), errmsg("%s: vector_idx must not be NULL", __func__)));
+
+    create_index_state *internal_state = NULL;
+    old_context = MemoryContextSwitchTo(agg_context);
+
+    if (unlikely(PG_ARGISNULL(0)))
     {
-        char *runtime_parameters = internal_state->runtime_parameters;
-        ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: input runtime_parameters: %s", __func__, runtime_parameters)));
-        FaissParameterSpace *parameter_space = NULL;
-        FAISS_CHECK(faiss_ParameterSpace_new(&parameter_space));
-        FAISS_CHECK(faiss_ParameterSpace_set_index_parameters(parameter_space, index, runtime_parameters));
-        faiss_ParameterSpace_free(parameter_space);
+        // every segment adds to its copy of the same trained index, the copies share its quantizers
+        CHECK(!PG_ARGISNULL(1));
+        FaissIndex *index = bytea2faissindex(PG_GETARG_BYTEA_P(1), false);
+        building_index *building = building_index_register(index);
+        if (!faiss_Index_is_trained(index))
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s: faiss index is not trained", __func__)));
+        // its vectors would be added once per segment
+        if (faiss_Index_ntotal(index) != 0)
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s: faiss index is not empty", __func__)));
+        internal_state = create_index_state_new(building, true);
+        // faiss_index_add_cache_agg
+        if (PG_NARGS() > 4)
+        {
+            CHECK(!PG_ARGISNULL(4));
+            internal_state->key = text_to_cstring(PG_GETARG_TEXT_P(4));
+        }
     }
-
-    if (faiss_Index_is_trained(index))
-        ereport(LOG, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: faiss index can't or needn't train", __func__)));
     else
-        FAISS_CHECK(faiss_Index_train(index, internal_state->size, internal_state->data));
+        internal_state = (create_index_state *)PG_GETARG_POINTER(0);
+
+    CHECK(internal_state->dim == ARRNELEMS(vector_array));
+    create_index_append(internal_state, (float4 *)ARR_DATA_PTR(vector_array), PG_GETARG_INT64(3));
+
+    MemoryContextSwitchTo(old_context);
+    PG_RETURN_POINTER(internal_state);
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_merge_agg_transfn);
+Datum faiss_index_merge_agg_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context, old_context;
+
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
 
-    if (internal_state->idxs)
-        FAISS_CHECK(faiss_Index_add_with_ids(index, internal_state->size, internal_state->data, internal_state->idxs));
+    create_index_state *internal_state = PG_ARGISNULL(0) ? NULL : (create_index_state *)PG_GETARG_POINTER(0);
+    if (PG_ARGISNULL(1))
+    {
+        if (internal_state == NULL)
+            PG_RETURN_NULL();
+        PG_RETURN_POINTER(internal_state);
+    }
+
+    old_context = MemoryContextSwitchTo(agg_context);
+    FaissIndex *index = bytea2faissindex(PG_GETARG_BYTEA_P(1), false);
+    building_index *building = building_index_register(index);
+    if (internal_state == NULL)
+    {
+        // the first index is merged into, the state of faiss_index_add_agg only ever holds the merged index
+        internal_state = create_index_state_new(building, true);
+        internal_state->total = faiss_Index_ntotal(index);
+    }
     else
-        FAISS_CHECK(faiss_Index_add(index, internal_state->size, (float *)(internal_state->data)));
+    {
+        internal_state->total += faiss_Index_ntotal(index);
+        FAISS_CHECK(faiss_index_merge_from(internal_state->building->index, index));
+        building_index_unregister(building);
+        faiss_Index_free(index);
+    }
 
-    PG_RETURN_BYTEA_P(faissindex2bytea(index));
+    MemoryContextSwitchTo(old_context);
+    PG_RETURN_POINTER(internal_state);
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_add_agg_combinefn);
+Datum faiss_index_add_agg_combinefn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    create_index_state *state1 = PG_ARGISNULL(0) ? NULL : (create_index_state *)PG_GETARG_POINTER(0);
+    create_index_state *state2 = PG_ARGISNULL(1) ? NULL : (create_index_state *)PG_GETARG_POINTER(1);
+    if (state2 == NULL)
+    {
+        if (state1 == NULL)
+            PG_RETURN_NULL();
+        PG_RETURN_POINTER(state1);
+    }
+
+    CHECK(state2->building);
+    create_index_flush(state2);
+    if (state1 == NULL)
+    {
+        // state2 may live in a shorter lived context, see faiss_index_add_agg_deserialfn(), its index does not
+        MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+        state1 = create_index_state_new(state2->building, true);
+        state1->total = state2->total;
+        state1->key = state2->key ? pstrdup(state2->key) : NULL;
+        state2->building = NULL;
+        MemoryContextSwitchTo(old_context);
+        PG_RETURN_POINTER(state1);
+    }
+
+    CHECK(state1->building);
+    create_index_flush(state1);
+    FAISS_CHECK(faiss_index_merge_from(state1->building->index, state2->building->index));
+    state1->total += state2->total;
+    if (!state1->key && state2->key)
+        state1->key = MemoryContextStrdup(agg_context, state2->key);
+
+    FaissIndex *index = state2->building->index;
+    building_index_unregister(state2->building);
+    state2->building = NULL;
+    faiss_Index_free(index);
+
+    PG_RETURN_POINTER(state1);
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_add_agg_serialfn);
+Datum faiss_index_add_agg_serialfn(PG_FUNCTION_ARGS)
+{
+    if (!AggCheckCallContext(fcinfo, NULL))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    // the partial index of the segment is shipped as a serialized faiss index, after the nul-terminated
+    // faiss_index_key of faiss_index_add_cache_agg (empty otherwise): the final phase only sees these
+    create_index_state *internal_state = (create_index_state *)PG_GETARG_POINTER(0);
+    CHECK(internal_state->building);
+    create_index_flush(internal_state);
+    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: total:" UINT64_FORMAT, __func__, internal_state->total)));
+
+    const char *key = internal_state->key ? internal_state->key : "";
+    bytea *result = faissindex2bytea_after(internal_state->building->index, key, strlen(key) + 1);
+    building_index_unregister(internal_state->building);
+    internal_state->building = NULL;
+    PG_RETURN_BYTEA_P(result);
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_add_agg_deserialfn);
+Datum faiss_index_add_agg_deserialfn(PG_FUNCTION_ARGS)
+{
+    if (!AggCheckCallContext(fcinfo, NULL))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    // in the current memory context, faiss_index_add_agg_combinefn() takes over the index and the key
+    bytea *partial = PG_GETARG_BYTEA_P(0);
+    const char *key = VARDATA(partial);
+    size_t size = VARSIZE(partial) - VARHDRSZ;
+    size_t keylen = strnlen(key, size);
+    CHECK(keylen < size);
+
+    FaissIndex *index = NULL;
+    FAISS_CHECK(faiss_read_index_buf(key + keylen + 1, size - keylen - 1, 2, false, &index));
+    create_index_state *internal_state = create_index_state_new(building_index_register(index), true);
+    internal_state->total = faiss_Index_ntotal(index);
+    internal_state->key = keylen ? pstrdup(key) : NULL;
+    PG_RETURN_POINTER(internal_state);
 }
 
 PG_FUNCTION_INFO_V1(faiss_index_search);
@@ -402,77 +1063,12 @@ Datum faiss_index_search(PG_FUNCTION_ARGS)
             ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("function returning record called in context that cannot accept type record")));
 
         funcctx->tuple_desc = BlessTupleDesc(tupdesc);
-        FaissIndex *faiss_index = NULL;
-
-        cache_t *cache = get_cache(0);
-        handle_t *handle = NULL;
-        if (!PG_ARGISNULL(6))
-        {
-            char *key = text_to_cstring(PG_GETARG_TEXT_P(6));
-            size_t keylen = strlen(key);
-            handle = cache_lookup(cache, key, keylen);
-            if (handle)
-            {
-                faiss_index = cache_value(cache, handle);
-                ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: cache hit: faiss_index:%p handle:%p", __func__, faiss_index, handle)));
-            }
-            else
-            {
-                CHECK(!PG_ARGISNULL(0));
-                bytea *index_bytea = PG_GETARG_BYTEA_P(0);
-                faiss_index = bytea2faissindex(index_bytea);
-                handle = cache_insert(cache, key, keylen, faiss_index, VARSIZE(index_bytea), cache_item_deleter);
-                ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: cache miss: faiss_index:%p handle:%p", __func__, faiss_index, handle)));
-            }
-        }
-        else
-        {
-            CHECK(!PG_ARGISNULL(0));
-            bytea *index_bytea = PG_GETARG_BYTEA_P(0);
-            faiss_index = bytea2faissindex(index_bytea);
-        }
 
-        CHECK(!PG_ARGISNULL(1));
-        ArrayType *query_vectors_array = PG_GETARG_ARRAYTYPE_P(1);
-        CHECK(!PG_ARGISNULL(2));
-        uint32 dim = PG_GETARG_UINT32(2);
-        CHECK(!PG_ARGISNULL(3));
-        uint32 topk = PG_GETARG_UINT32(3);
-        CHECK(dim == faiss_Index_d(faiss_index));
-
-        // get query_vectors data and infomation
-        float4 *query_vectors = (float4 *)ARR_DATA_PTR(query_vectors_array);
-        uint32 query_vectors_num = ARRNELEMS(query_vectors_array) / dim;
-        int64 *query_idxs = NULL;
-        uint32 query_idxs_num = 0;
-
-        // if provide query_idx, then output with query_idx
-        if (!PG_ARGISNULL(4))
-        {
-            ArrayType *query_idxs_array = PG_GETARG_ARRAYTYPE_P(4);
-            query_idxs = (int64 *)ARR_DATA_PTR(query_idxs_array);
-            query_idxs_num = ARRNELEMS(query_idxs_array);
-            CHECK(query_idxs_num == query_vectors_num);
-        }
-
-        // get the result of faiss search, construct the faiss_search_result.
-        faiss_search_result *search_result = (faiss_search_result *)palloc0(sizeof(faiss_search_result));
-        search_result->dim = dim;
-        search_result->topk = topk;
-        search_result->query_vectors = (!PG_ARGISNULL(5) && PG_GETARG_BOOL(5)) ? query_vectors : NULL;
-        search_result->query_idxs = query_idxs;
-        search_result->distances = palloc(topk * query_vectors_num * sizeof(float4));
-        search_result->idxs = palloc(topk * query_vectors_num * sizeof(int64));
-
-        FAISS_CHECK(faiss_Index_search(faiss_index, query_vectors_num, query_vectors, topk, search_result->distances, search_result->idxs));
-        if (!PG_ARGISNULL(6))
-            cache_release(cache, handle);
-        else
-            faiss_Index_free(faiss_index);
+        faiss_search_result *search_result = index_search(fcinfo, false, 6, !PG_ARGISNULL(5) && PG_GETARG_BOOL(5), 7);
 
         funcctx->user_fctx = search_result;
         // set the number of SRF CALL, also as the output rows number.
-        funcctx->max_calls = query_vectors_num;
+        funcctx->max_calls = search_result->query_vectors_num;
 
         MemoryContextSwitchTo(oldcontext);
     }
@@ -494,19 +1090,9 @@ Datum faiss_index_search(PG_FUNCTION_ARGS)
         Datum values[4];
         bool nulls[4];
 
-        int16 elmlen_out;
-        bool elmbyval_out;
-        char elmalign_out;
-
         if (search_result->query_vectors)
         {
-            Datum query_vector[dim];
-            for (uint32 i = 0; i < dim; ++i)
-                query_vector[i] = Float4GetDatum(search_result->query_vectors[query_idx * dim + i]);
-            get_typlenbyvalalign(FLOAT4OID, &elmlen_out, &elmbyval_out, &elmalign_out);
-            ArrayType *array = construct_array(query_vector, dim, FLOAT4OID, elmlen_out, elmbyval_out, elmalign_out);
-
-            values[0] = PointerGetDatum(array);
+            values[0] = PointerGetDatum(array_1d_from_buffer(search_result->query_vectors + (size_t)query_idx * dim, dim, FLOAT4OID, sizeof(float4)));
             nulls[0] = false;
         }
         else
@@ -524,25 +1110,15 @@ Datum faiss_index_search(PG_FUNCTION_ARGS)
             nulls[1] = true;
         }
 
-        ArrayType *dis_array, *idx_array;
-        Datum dis_vector[topk];
-        Datum idx_vector[topk];
-
+        // faiss pads the results of a query with -1 when the index has less than topk vectors
+        size_t ofs = (size_t)query_idx * topk;
         uint32 cnt = 0;
-        for (; cnt < topk && search_result->idxs[query_idx * topk + cnt] != -1; ++cnt)
-        {
-            idx_vector[cnt] = Int64GetDatum(search_result->idxs[query_idx * topk + cnt]);
-            dis_vector[cnt] = Float4GetDatum(search_result->distances[query_idx * topk + cnt]);
-        }
+        while (cnt < topk && search_result->idxs[ofs + cnt] != -1)
+            ++cnt;
 
-        get_typlenbyvalalign(INT8OID, &elmlen_out, &elmbyval_out, &elmalign_out);
-        idx_array = construct_array(idx_vector, cnt, INT8OID, elmlen_out, elmbyval_out, elmalign_out);
-        values[2] = PointerGetDatum(idx_array);
+        values[2] = PointerGetDatum(array_1d_from_buffer(search_result->idxs + ofs, cnt, INT8OID, sizeof(int64)));
         nulls[2] = false;
-
-        get_typlenbyvalalign(FLOAT4OID, &elmlen_out, &elmbyval_out, &elmalign_out);
-        dis_array = construct_array(dis_vector, cnt, FLOAT4OID, elmlen_out, elmbyval_out, elmalign_out);
-        values[3] = PointerGetDatum(dis_array);
+        values[3] = PointerGetDatum(array_1d_from_buffer(search_result->distances + ofs, cnt, FLOAT4OID, sizeof(float4)));
         nulls[3] = false;
 
         tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
@@ -575,81 +1151,15 @@ Datum faiss_index_range_search(PG_FUNCTION_ARGS)
             ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("function returning record called in context that cannot accept type record")));
 
         funcctx->tuple_desc = BlessTupleDesc(tupdesc);
-        FaissIndex *faiss_index = NULL;
-
-        cache_t *cache = get_cache(0);
-        handle_t *handle = NULL;
-        if (!PG_ARGISNULL(6))
-        {
-            char *key = text_to_cstring(PG_GETARG_TEXT_P(6));
-            size_t keylen = strlen(key);
-            handle = cache_lookup(cache, key, keylen);
-            if (handle)
-            {
-                faiss_index = cache_value(cache, handle);
-                ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: cache hit: faiss_index:%p handle:%p", __func__, faiss_index, handle)));
-            }
-            else
-            {
-                CHECK(!PG_ARGISNULL(0));
-                bytea *index_bytea = PG_GETARG_BYTEA_P(0);
-                faiss_index = bytea2faissindex(index_bytea);
-                handle = cache_insert(cache, key, keylen, faiss_index, VARSIZE(index_bytea), cache_item_deleter);
-                ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: cache miss: faiss_index:%p handle:%p", __func__, faiss_index, handle)));
-            }
-        }
-        else
-        {
-            CHECK(!PG_ARGISNULL(0));
-            bytea *index_bytea = PG_GETARG_BYTEA_P(0);
-            faiss_index = bytea2faissindex(index_bytea);
-        }
 
-        CHECK(!PG_ARGISNULL(1));
-        ArrayType *query_vectors_array = PG_GETARG_ARRAYTYPE_P(1);
-        CHECK(!PG_ARGISNULL(2));
-        uint32 dim = PG_GETARG_UINT32(2);
-        CHECK(!PG_ARGISNULL(3));
-        float4 radius = PG_GETARG_FLOAT4(3);
-        CHECK(dim == faiss_Index_d(faiss_index));
+        faiss_search_result *search_result = index_search(fcinfo, true, 6, !PG_ARGISNULL(5) && PG_GETARG_BOOL(5), 7);
 
-        // get query_vectors data and infomation
-        float4 *query_vectors = (float4 *)ARR_DATA_PTR(query_vectors_array);
-        uint32 query_vectors_num = ARRNELEMS(query_vectors_array) / dim;
-        int64 *query_idxs = NULL;
-        uint32 query_idxs_num = 0;
+        funcctx->user_fctx = search_result;
+        // set the number of SRF CALL, also as the output rows number.
+        funcctx->max_calls = search_result->query_vectors_num;
 
-        // if provide query_idx, then output with query_idx
-        if (!PG_ARGISNULL(4))
-        {
-            ArrayType *query_idxs_array = PG_GETARG_ARRAYTYPE_P(4);
-            query_idxs = (int64 *)ARR_DATA_PTR(query_idxs_array);
-            query_idxs_num = ARRNELEMS(query_idxs_array);
-            CHECK(query_idxs_num == query_vectors_num);
-        }
-
-        faiss_search_result *search_result = (faiss_search_result *)palloc0(sizeof(faiss_search_result));
-        search_result->dim = dim;
-        search_result->radius = radius;
-        search_result->query_vectors = (!PG_ARGISNULL(5) && PG_GETARG_BOOL(5)) ? query_vectors : NULL;
-        search_result->query_idxs = query_idxs;
-
-        FAISS_CHECK(faiss_RangeSearchResult_new(&(search_result->faiss_range_search_result), query_vectors_num));
-        FAISS_CHECK(faiss_Index_range_search(faiss_index, query_vectors_num, query_vectors, radius, search_result->faiss_range_search_result));
-        if (!PG_ARGISNULL(6))
-            cache_release(cache, handle);
-        else
-            faiss_Index_free(faiss_index);
-
-        faiss_RangeSearchResult_lims(search_result->faiss_range_search_result, &(search_result->lims));
-        faiss_RangeSearchResult_labels(search_result->faiss_range_search_result, &(search_result->idxs), &(search_result->distances));
-
-        funcctx->user_fctx = search_result;
-        // set the number of SRF CALL, also as the output rows number.
-        funcctx->max_calls = query_vectors_num;
-
-        MemoryContextSwitchTo(oldcontext);
-    }
+        MemoryContextSwitchTo(oldcontext);
+    }
 
     funcctx = SRF_PERCALL_SETUP();
     call_cntr = funcctx->call_cntr;
@@ -667,19 +1177,9 @@ Datum faiss_index_range_search(PG_FUNCTION_ARGS)
         Datum values[4];
         bool nulls[4];
 
-        int16 elmlen_out;
-        bool elmbyval_out;
-        char elmalign_out;
-
         if (search_result->query_vectors)
         {
-            Datum query_vector[dim];
-            for (uint32 i = 0; i < dim; ++i)
-                query_vector[i] = Float4GetDatum(search_result->query_vectors[query_idx * dim + i]);
-            get_typlenbyvalalign(FLOAT4OID, &elmlen_out, &elmbyval_out, &elmalign_out);
-            ArrayType *array = construct_array(query_vector, dim, FLOAT4OID, elmlen_out, elmbyval_out, elmalign_out);
-
-            values[0] = PointerGetDatum(array);
+            values[0] = PointerGetDatum(array_1d_from_buffer(search_result->query_vectors + (size_t)query_idx * dim, dim, FLOAT4OID, sizeof(float4)));
             nulls[0] = false;
         }
         else
@@ -699,23 +1199,10 @@ Datum faiss_index_range_search(PG_FUNCTION_ARGS)
 
         // result for query i is labels[lims[i]:lims[i+1]]
         size_t ofs = search_result->lims[call_cntr], lim = search_result->lims[call_cntr + 1] - search_result->lims[call_cntr];
-        Datum dis_vector[lim];
-        Datum idx_vector[lim];
-
-        for (size_t i = 0; i < lim; ++i)
-        {
-            idx_vector[i] = Int64GetDatum(search_result->idxs[ofs + i]);
-            dis_vector[i] = Float4GetDatum(search_result->distances[ofs + i]);
-        }
 
-        get_typlenbyvalalign(INT8OID, &elmlen_out, &elmbyval_out, &elmalign_out);
-        ArrayType *idx_array = construct_array(idx_vector, lim, INT8OID, elmlen_out, elmbyval_out, elmalign_out);
-        values[2] = PointerGetDatum(idx_array);
+        values[2] = PointerGetDatum(array_1d_from_buffer(search_result->idxs + ofs, lim, INT8OID, sizeof(int64)));
         nulls[2] = false;
-
-        get_typlenbyvalalign(FLOAT4OID, &elmlen_out, &elmbyval_out, &elmalign_out);
-        ArrayType *dis_array = construct_array(dis_vector, lim, FLOAT4OID, elmlen_out, elmbyval_out, elmalign_out);
-        values[3] = PointerGetDatum(dis_array);
+        values[3] = PointerGetDatum(array_1d_from_buffer(search_result->distances + ofs, lim, FLOAT4OID, sizeof(float4)));
         nulls[3] = false;
 
         tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
@@ -730,66 +1217,123 @@ Datum faiss_index_range_search(PG_FUNCTION_ARGS)
     }
 }
 
-PG_FUNCTION_INFO_V1(topk_merge_transfn);
-Datum topk_merge_transfn(PG_FUNCTION_ARGS)
+PG_FUNCTION_INFO_V1(faiss_index_search_flat);
+Datum faiss_index_search_flat(PG_FUNCTION_ARGS)
+{
+    faiss_search_result *search_result = index_search(fcinfo, false, 5, false, 6);
+    PG_RETURN_DATUM(flat_topk_search_result(fcinfo, search_result));
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_range_search_flat);
+Datum faiss_index_range_search_flat(PG_FUNCTION_ARGS)
+{
+    faiss_search_result *search_result = index_search(fcinfo, true, 5, false, 6);
+    size_t query_vectors_num = search_result->query_vectors_num;
+    size_t total = search_result->lims[query_vectors_num];
+
+    // the result of faiss is already flat, copy it out of its buffers
+    int64 *lims = palloc((query_vectors_num + 1) * sizeof(int64));
+    for (size_t i = 0; i <= query_vectors_num; i++)
+        lims[i] = search_result->lims[i];
+    ArrayType *idx_array = array_1d_from_buffer(search_result->idxs, total, INT8OID, sizeof(int64));
+    ArrayType *dis_array = array_1d_from_buffer(search_result->distances, total, FLOAT4OID, sizeof(float4));
+    faiss_RangeSearchResult_free(search_result->faiss_range_search_result);
+
+    PG_RETURN_DATUM(flat_search_result(fcinfo, search_result, lims, idx_array, dis_array));
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_search_batch_transfn);
+Datum faiss_index_search_batch_transfn(PG_FUNCTION_ARGS)
 {
     MemoryContext agg_context;
+
     if (!AggCheckCallContext(fcinfo, &agg_context))
         ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
 
-    CHECK(!PG_ARGISNULL(1));
-    ArrayType *idxs_arr = PG_GETARG_ARRAYTYPE_P(1);
     CHECK(!PG_ARGISNULL(2));
-    ArrayType *distance_arr = PG_GETARG_ARRAYTYPE_P(2);
+    ArrayType *vector_array = PG_GETARG_ARRAYTYPE_P(2);
     CHECK(!PG_ARGISNULL(3));
-    uint32 topk = PG_GETARG_UINT32(3);
-
-    const uint32 elemnum = ARRNELEMS(idxs_arr);
-    CHECK(elemnum == ARRNELEMS(distance_arr));
-
-    if (elemnum == 0 || topk == 0)
-    {
-        if (unlikely(PG_ARGISNULL(0)))
-            PG_RETURN_NULL();
-        else
-            PG_RETURN_POINTER(PG_GETARG_POINTER(0));
-    }
 
-    topk_merge_state *internal_state = NULL;
+    search_batch_state *internal_state = NULL;
     MemoryContext old_context = MemoryContextSwitchTo(agg_context);
     if (unlikely(PG_ARGISNULL(0)))
     {
-        internal_state = (topk_merge_state *)palloc0(sizeof(topk_merge_state));
-        internal_state->topk = topk;
-        internal_state->batch_num = 1;
-        internal_state->distance = palloc(elemnum * sizeof(internal_state->distance[0]));
-        internal_state->idxs = palloc(elemnum * sizeof(internal_state->idxs[0]));
-        internal_state->lims = palloc(2 * sizeof(internal_state->lims[0]));
-        internal_state->lims[0] = 0;
-        internal_state->lims[1] = elemnum;
-        memcpy(internal_state->idxs, ARR_DATA_PTR(idxs_arr), elemnum * sizeof(internal_state->idxs[0]));
-        memcpy(internal_state->distance, ARR_DATA_PTR(distance_arr), elemnum * sizeof(internal_state->distance[0]));
+        // every row of a group carries the same index, only the first one is kept
+        internal_state = (search_batch_state *)palloc0(sizeof(search_batch_state));
+        internal_state->key = index_cache_key(fcinfo, 1, 5);
+        internal_state->index_isnull = PG_ARGISNULL(1);
+        if (!internal_state->index_isnull)
+            internal_state->index_datum = datumCopy(PG_GETARG_DATUM(1), false, -1);
+
+        CHECK(!PG_ARGISNULL(4));
+        internal_state->topk = PG_GETARG_UINT32(4);
+        if (PG_NARGS() > 6 && !PG_ARGISNULL(6))
+            internal_state->tombstones = (ArrayType *)PG_DETOAST_DATUM_COPY(PG_GETARG_DATUM(6));
+        internal_state->dim = ARRNELEMS(vector_array);
+        internal_state->capacity = 16;
+        internal_state->query_vectors = palloc(internal_state->capacity * internal_state->dim * sizeof(internal_state->query_vectors[0]));
+        internal_state->query_idxs = palloc(internal_state->capacity * sizeof(internal_state->query_idxs[0]));
     }
     else
     {
-        internal_state = (topk_merge_state *)PG_GETARG_POINTER(0);
-        CHECK(internal_state->topk == topk);
+        internal_state = (search_batch_state *)PG_GETARG_POINTER(0);
+        CHECK(internal_state->dim == ARRNELEMS(vector_array));
 
-        uint32 b = ++(internal_state->batch_num);
-        internal_state->lims = repalloc(internal_state->lims, (b + 1) * sizeof(internal_state->lims[0]));
-        internal_state->lims[b] = internal_state->lims[b - 1] + elemnum;
-        internal_state->idxs = repalloc(internal_state->idxs, internal_state->lims[b] * sizeof(internal_state->idxs[0]));
-        internal_state->distance = repalloc(internal_state->distance, internal_state->lims[b] * sizeof(internal_state->distance[0]));
-        memcpy(internal_state->idxs + internal_state->lims[b - 1], ARR_DATA_PTR(idxs_arr), elemnum * sizeof(internal_state->idxs[0]));
-        memcpy(internal_state->distance + internal_state->lims[b - 1], ARR_DATA_PTR(distance_arr), elemnum * sizeof(internal_state->distance[0]));
+        // the rows are searched against the index of the first one: rows of another index, e.g. grouped
+        // without the index column, would silently get its results
+        bool same_index;
+        if (!PG_ARGISNULL(5))
+        {
+            char *key = cache_key_arg(fcinfo, 5);
+            same_index = internal_state->key && strcmp(key, internal_state->key) == 0;
+            pfree(key);
+        }
+        else if (internal_state->index_isnull || PG_ARGISNULL(1))
+            same_index = internal_state->index_isnull && PG_ARGISNULL(1);
+        else
+        {
+            // a toast pointer compares as such, an index value shipped inline is compared byte by byte
+            Datum index_datum = PG_GETARG_DATUM(1);
+            same_index = index_datum == internal_state->index_datum || datumIsEqual(internal_state->index_datum, index_datum, false, -1);
+        }
+        if (!same_index)
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s: the rows of a group must search the same faiss index", __func__)));
+        if (PG_ARGISNULL(4) || PG_GETARG_UINT32(4) != internal_state->topk)
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s: the rows of a group must search the same topk", __func__)));
+
+        bool same_tombstones;
+        if (PG_NARGS() <= 6 || PG_ARGISNULL(6))
+            same_tombstones = internal_state->tombstones == NULL;
+        else
+        {
+            ArrayType *tombstones = PG_GETARG_ARRAYTYPE_P(6);
+            same_tombstones = internal_state->tombstones && VARSIZE(tombstones) == VARSIZE(internal_state->tombstones) &&
+                              memcmp(tombstones, internal_state->tombstones, VARSIZE(tombstones)) == 0;
+            // detoasted in the aggregate context, which lives as long as the group
+            if ((Pointer)tombstones != DatumGetPointer(PG_GETARG_DATUM(6)))
+                pfree(tombstones);
+        }
+        if (!same_tombstones)
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s: the rows of a group must skip the same tombstones", __func__)));
+    }
+
+    if (internal_state->size == internal_state->capacity)
+    {
+        internal_state->capacity *= 2;
+        internal_state->query_vectors = repalloc(internal_state->query_vectors, internal_state->capacity * internal_state->dim * sizeof(internal_state->query_vectors[0]));
+        internal_state->query_idxs = repalloc(internal_state->query_idxs, internal_state->capacity * sizeof(internal_state->query_idxs[0]));
     }
 
+    memcpy(internal_state->query_vectors + (size_t)internal_state->size * internal_state->dim, ARR_DATA_PTR(vector_array), internal_state->dim * sizeof(internal_state->query_vectors[0]));
+    internal_state->query_idxs[internal_state->size] = PG_GETARG_INT64(3);
+    internal_state->size += 1;
+
     MemoryContextSwitchTo(old_context);
     PG_RETURN_POINTER(internal_state);
 }
 
-PG_FUNCTION_INFO_V1(topk_merge_finalfn);
-Datum topk_merge_finalfn(PG_FUNCTION_ARGS)
+PG_FUNCTION_INFO_V1(faiss_index_search_batch_finalfn);
+Datum faiss_index_search_batch_finalfn(PG_FUNCTION_ARGS)
 {
     MemoryContext agg_context;
 
@@ -799,202 +1343,2627 @@ Datum topk_merge_finalfn(PG_FUNCTION_ARGS)
     if (unlikely(PG_ARGISNULL(0)))
         PG_RETURN_NULL();
 
-    TupleDesc tuple_desc;
-    if (get_call_result_type(fcinfo, NULL, &tuple_desc) != TYPEFUNC_COMPOSITE)
-        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("function returning record called in context that cannot accept type record")));
-    tuple_desc = BlessTupleDesc(tuple_desc);
+    search_batch_state *internal_state = (search_batch_state *)PG_GETARG_POINTER(0);
 
-    topk_merge_state *internal_state = (topk_merge_state *)PG_GETARG_POINTER(0);
-    uint32 batch_num = internal_state->batch_num;
-    uint32 *lims = internal_state->lims;
-    uint32 topk = ((internal_state->topk <= lims[batch_num]) ? internal_state->topk : lims[batch_num]);
-    float *distance = internal_state->distance;
-    int64 *idxs = internal_state->idxs;
+    faiss_search_result *search_result = (faiss_search_result *)palloc0(sizeof(faiss_search_result));
+    search_result->dim = internal_state->dim;
+    search_result->query_vectors_num = internal_state->size;
+    search_result->topk = internal_state->topk;
+    search_result->query_idxs = internal_state->query_idxs;
+    if (internal_state->tombstones)
+        search_result->excluded_ids = sorted_ids(internal_state->tombstones, &search_result->excluded_ids_num);
 
-    heap_buf *heap = NULL;
-    Datum *result_distance, *result_idxs;
+    // a single lookup of the index and a single faiss call for the queries of every row
+    search_index(internal_state->index_datum, internal_state->index_isnull, internal_state->key, search_result, internal_state->query_vectors, false);
+    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: key:%s, query_vectors_num:%u, topk:%u", __func__, internal_state->key ? internal_state->key : "", internal_state->size, internal_state->topk)));
 
-    build_min_heap(&heap, distance, idxs, lims, batch_num);
+    PG_RETURN_DATUM(flat_topk_search_result(fcinfo, search_result));
+}
 
-    heap_topk(heap, distance, idxs, &result_distance, &result_idxs, lims, batch_num, topk);
+PG_FUNCTION_INFO_V1(unnest_search_results);
+Datum unnest_search_results(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    TupleDesc tupdesc;
 
-    Datum values[2];
-    bool nulls[2];
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("function returning record called in context that cannot accept type record")));
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
 
-    int16 elmlen_out;
-    bool elmbyval_out;
-    char elmalign_out;
+        CHECK(!PG_ARGISNULL(0));
+        HeapTupleHeader flat_results = PG_GETARG_HEAPTUPLEHEADER(0);
+        bool isnull[4];
+        Datum attrs[4];
+        for (int i = 0; i < 4; i++)
+            attrs[i] = GetAttributeByNum(flat_results, i + 1, &isnull[i]);
+        CHECK(!isnull[1] && !isnull[2] && !isnull[3]);
 
-    get_typlenbyvalalign(INT8OID, &elmlen_out, &elmbyval_out, &elmalign_out);
-    ArrayType *idxs_arr = construct_array(result_idxs, topk, INT8OID, elmlen_out, elmbyval_out, elmalign_out);
-    values[0] = PointerGetDatum(idxs_arr);
-    nulls[0] = false;
+        // the arrays are detoasted once, the rows point into them
+        faiss_search_result *search_result = (faiss_search_result *)palloc0(sizeof(faiss_search_result));
+        ArrayType *lims_array = DatumGetArrayTypeP(attrs[1]);
+        ArrayType *idxs_array = DatumGetArrayTypeP(attrs[2]);
+        ArrayType *distances_array = DatumGetArrayTypeP(attrs[3]);
+        CHECK(!ARR_HASNULL(lims_array) && !ARR_HASNULL(idxs_array) && !ARR_HASNULL(distances_array));
+        CHECK(ARR_ELEMTYPE(lims_array) == INT8OID && ARR_ELEMTYPE(idxs_array) == INT8OID && ARR_ELEMTYPE(distances_array) == FLOAT4OID);
+        CHECK(ARRNELEMS(lims_array) >= 1);
+        CHECK(ARRNELEMS(idxs_array) == ARRNELEMS(distances_array));
+        search_result->query_vectors_num = ARRNELEMS(lims_array) - 1;
+        search_result->idxs = (int64 *)ARR_DATA_PTR(idxs_array);
+        search_result->distances = (float4 *)ARR_DATA_PTR(distances_array);
+
+        // the lims may come from anywhere: every row must stay within vector_idxs and distances
+        const int64 *lims = (const int64 *)ARR_DATA_PTR(lims_array);
+        int64 nelems = ARRNELEMS(idxs_array);
+        for (uint32 i = 0; i <= search_result->query_vectors_num; ++i)
+        {
+            bool valid = lims[i] >= 0 && lims[i] <= nelems && (i == 0 || lims[i] >= lims[i - 1]);
+            if (!valid)
+                ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s: lims[%u] = " INT64_FORMAT " is out of range", __func__, i + 1, lims[i])));
+        }
+        if (lims[search_result->query_vectors_num] != nelems)
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s: the last of lims must be the number of vector_idxs " INT64_FORMAT, __func__, nelems)));
+        search_result->lims = (size_t *)lims;
+        if (!isnull[0])
+        {
+            ArrayType *query_idxs_array = DatumGetArrayTypeP(attrs[0]);
+            CHECK(!ARR_HASNULL(query_idxs_array) && ARRNELEMS(query_idxs_array) == (int)search_result->query_vectors_num);
+            search_result->query_idxs = (int64 *)ARR_DATA_PTR(query_idxs_array);
+        }
 
-    get_typlenbyvalalign(FLOAT4OID, &elmlen_out, &elmbyval_out, &elmalign_out);
-    ArrayType *distance_arr = construct_array(result_distance, topk, FLOAT4OID, elmlen_out, elmbyval_out, elmalign_out);
-    values[1] = PointerGetDatum(distance_arr);
-    nulls[1] = false;
+        funcctx->user_fctx = search_result;
+        funcctx->max_calls = search_result->query_vectors_num;
 
-    HeapTuple tuple = heap_form_tuple(tuple_desc, values, nulls);
-    Datum result = HeapTupleGetDatum(tuple);
+        MemoryContextSwitchTo(oldcontext);
+    }
 
-    PG_RETURN_DATUM(result);
-}
+    funcctx = SRF_PERCALL_SETUP();
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        faiss_search_result *search_result = funcctx->user_fctx;
+        size_t i = funcctx->call_cntr;
+        Datum values[4];
+        bool nulls[4] = {true, true, false, false};
 
-bytea *faissindex2bytea(FaissIndex *faiss_index)
-{
-    char *buf = NULL;
-    size_t buf_size = 0;
-    FILE *fp_write = open_memstream(&buf, &buf_size);
-    if (fp_write == NULL)
-        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: open_memstream failed!", __func__)));
-    FAISS_CHECK(faiss_write_index(faiss_index, fp_write));
-    fclose(fp_write);
-    faiss_Index_free(faiss_index);
+        if (search_result->query_idxs)
+        {
+            values[1] = Int64GetDatum(search_result->query_idxs[i]);
+            nulls[1] = false;
+        }
 
-    uint32 var_size = (uint32)buf_size + VARHDRSZ;
-    bytea *ret_bytea = palloc(var_size);
-    SET_VARSIZE(ret_bytea, var_size);
-    memcpy(VARDATA(ret_bytea), buf, buf_size);
-    free(buf);
+        // the lims are BIGINT, the offsets of a query into vector_idxs and distances, checked by the first call
+        size_t ofs = search_result->lims[i];
+        size_t cnt = search_result->lims[i + 1] - ofs;
+        values[2] = PointerGetDatum(array_1d_from_buffer(search_result->idxs + ofs, cnt, INT8OID, sizeof(int64)));
+        values[3] = PointerGetDatum(array_1d_from_buffer(search_result->distances + ofs, cnt, FLOAT4OID, sizeof(float4)));
 
-    return ret_bytea;
+        HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
 }
 
-FaissIndex *bytea2faissindex(const bytea *index_bytea)
+PG_FUNCTION_INFO_V1(faiss_index_search_shards_transfn);
+Datum faiss_index_search_shards_transfn(PG_FUNCTION_ARGS)
 {
-    FaissIndex *index = NULL;
-    char *index_buf = (char *)VARDATA(index_bytea);
-    size_t buf_size = (size_t)VARSIZE(index_bytea) - VARHDRSZ;
-    FILE *fp_index = fmemopen(index_buf, buf_size, "r");
-    if (fp_index == NULL)
-        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: fmemopen failed!", __func__)));
+    MemoryContext agg_context;
 
-    FAISS_CHECK(faiss_read_index(fp_index, 2, &index));
-    fclose(fp_index);
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
 
-    return index;
-}
+    CHECK(!PG_ARGISNULL(2));
+    ArrayType *query_vectors_array = PG_GETARG_ARRAYTYPE_P(2);
+    CHECK(!PG_ARGISNULL(3));
+    uint32 dim = PG_GETARG_UINT32(3);
+    CHECK(dim > 0);
+    CHECK(!PG_ARGISNULL(4));
+    uint32 topk = PG_GETARG_UINT32(4);
+    uint32 query_vectors_num = ARRNELEMS(query_vectors_array) / dim;
 
-void swap_buf(heap_buf *hb1, heap_buf *hb2)
-{
-    float dtmp = hb1->distance;
-    uint32 btmp = hb1->batch_id;
-    hb1->distance = hb2->distance;
-    hb1->batch_id = hb2->batch_id;
-    hb2->distance = dtmp;
-    hb2->batch_id = btmp;
-}
+    search_shards_state *internal_state = NULL;
+    MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+    if (unlikely(PG_ARGISNULL(0)))
+    {
+        // every row of a group carries the same queries, only the ones of the first row are kept
+        internal_state = (search_shards_state *)palloc0(sizeof(search_shards_state));
+        internal_state->dim = dim;
+        internal_state->topk = topk;
+        internal_state->query_vectors_num = query_vectors_num;
+        internal_state->query_vectors = palloc((size_t)query_vectors_num * dim * sizeof(float4));
+        memcpy(internal_state->query_vectors, ARR_DATA_PTR(query_vectors_array), (size_t)query_vectors_num * dim * sizeof(float4));
+        if (!PG_ARGISNULL(5))
+        {
+            ArrayType *query_idxs_array = PG_GETARG_ARRAYTYPE_P(5);
+            CHECK(ARRNELEMS(query_idxs_array) == (int)query_vectors_num);
+            internal_state->query_idxs = palloc(query_vectors_num * sizeof(int64));
+            memcpy(internal_state->query_idxs, ARR_DATA_PTR(query_idxs_array), query_vectors_num * sizeof(int64));
+        }
+        internal_state->metric_type = -1;
+        internal_state->shard_capacity = 4;
+        internal_state->shards = palloc(internal_state->shard_capacity * sizeof(internal_state->shards[0]));
+    }
+    else
+    {
+        internal_state = (search_shards_state *)PG_GETARG_POINTER(0);
+        CHECK(internal_state->dim == dim && internal_state->topk == topk && internal_state->query_vectors_num == query_vectors_num);
+    }
 
-void shiftdown(heap_buf *heap, uint32 start, uint32 end)
-{
-    uint32 parent = start;
-    uint32 smaller = parent;
-    while (parent < end)
+    if (internal_state->shard_num == internal_state->shard_capacity)
     {
-        uint32 lchild = parent * 2 + 1;
-        uint32 rchild = lchild + 1;
-        if (lchild < end && heap[lchild].distance < heap[smaller].distance)
-            smaller = lchild;
-        if (rchild < end && heap[rchild].distance < heap[smaller].distance)
-            smaller = rchild;
-        if (smaller == parent)
-            break;
-        swap_buf(heap + smaller, heap + parent);
-        parent = smaller;
+        internal_state->shard_capacity *= 2;
+        internal_state->shards = repalloc(internal_state->shards, internal_state->shard_capacity * sizeof(internal_state->shards[0]));
     }
-}
 
-void build_min_heap(heap_buf **heap, float *distance, int64 *idxs, uint32 *batches_size, uint32 batch_num)
-{
-    *heap = palloc((batch_num) * sizeof(heap_buf));
-    for (uint32 i = 0; i < batch_num; ++i)
+    // keep the toast pointer only, the shard is looked up in the cache or detoasted when searched
+    index_shard *shard = &internal_state->shards[internal_state->shard_num++];
+    shard->key = index_cache_key(fcinfo, 1, 6);
+    shard->index_isnull = PG_ARGISNULL(1);
+    shard->index_datum = shard->index_isnull ? (Datum)0 : datumCopy(PG_GETARG_DATUM(1), false, -1);
+    shard->excluded_ids = NULL;
+    shard->excluded_ids_num = 0;
+    if (PG_NARGS() > 7 && !PG_ARGISNULL(7))
     {
-        (*heap)[i].distance = distance[batches_size[i]];
-        (*heap)[i].batch_id = i;
+        // sorted_ids() may return the data of the argument itself, which doesn't outlive the row
+        ArrayType *tombstones = PG_GETARG_ARRAYTYPE_P(7);
+        int64 *excluded_ids = sorted_ids(tombstones, &shard->excluded_ids_num);
+        if (excluded_ids == (int64 *)ARR_DATA_PTR(tombstones))
+        {
+            shard->excluded_ids = palloc(shard->excluded_ids_num * sizeof(int64));
+            memcpy(shard->excluded_ids, excluded_ids, shard->excluded_ids_num * sizeof(int64));
+        }
+        else
+            shard->excluded_ids = excluded_ids;
     }
 
-    for (int i = batch_num / 2 - 1; i >= 0; --i)
-        shiftdown(*heap, i, batch_num);
+    MemoryContextSwitchTo(old_context);
+    PG_RETURN_POINTER(internal_state);
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_search_shards_finalfn);
+Datum faiss_index_search_shards_finalfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    if (unlikely(PG_ARGISNULL(0)))
+        PG_RETURN_NULL();
+
+    search_shards_state *internal_state = (search_shards_state *)PG_GETARG_POINTER(0);
+    search_shards_flush(internal_state, agg_context);
+    CHECK(internal_state->metric_type >= 0);
+
+    faiss_search_result *search_result = (faiss_search_result *)palloc0(sizeof(faiss_search_result));
+    search_result->dim = internal_state->dim;
+    search_result->query_vectors_num = internal_state->query_vectors_num;
+    search_result->topk = internal_state->topk;
+    search_result->query_idxs = internal_state->query_idxs;
+    search_result->distances = internal_state->distances;
+    search_result->idxs = internal_state->idxs;
+
+    PG_RETURN_DATUM(flat_topk_search_result(fcinfo, search_result));
 }
 
-void heap_topk(heap_buf *heap, float *distance, int64 *idxs, Datum **result_distance, Datum **result_idxs, uint32 *batches_size, uint32 batch_num, uint32 topk)
+PG_FUNCTION_INFO_V1(faiss_index_search_shards_combinefn);
+Datum faiss_index_search_shards_combinefn(PG_FUNCTION_ARGS)
 {
-    *result_distance = palloc(topk * sizeof(Datum));
-    *result_idxs = palloc(topk * sizeof(Datum));
+    MemoryContext agg_context;
 
-    uint32 *batches_pos = palloc(batch_num * sizeof(uint32));
-    for (uint32 i = 0; i < batch_num; ++i)
-        batches_pos[i] = batches_size[i];
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
 
-    (*result_distance)[0] = Float4GetDatum(heap[0].distance);
-    (*result_idxs)[0] = Int64GetDatum(idxs[batches_pos[heap[0].batch_id]]);
+    search_shards_state *state1 = PG_ARGISNULL(0) ? NULL : (search_shards_state *)PG_GETARG_POINTER(0);
+    search_shards_state *state2 = PG_ARGISNULL(1) ? NULL : (search_shards_state *)PG_GETARG_POINTER(1);
+    if (state2 == NULL)
+    {
+        if (state1 == NULL)
+            PG_RETURN_NULL();
+        PG_RETURN_POINTER(state1);
+    }
 
-    for (uint32 i = 1; i < topk; ++i)
+    search_shards_flush(state2, CurrentMemoryContext);
+    size_t result_size = (size_t)state2->query_vectors_num * state2->topk;
+    if (state1 == NULL)
     {
-        batches_pos[heap[0].batch_id]++;
-        if (batches_pos[heap[0].batch_id] == batches_size[heap[0].batch_id + 1])
+        // state2 may live in a shorter lived context, see faiss_index_search_shards_deserialfn()
+        MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+        state1 = (search_shards_state *)palloc0(sizeof(search_shards_state));
+        state1->dim = state2->dim;
+        state1->topk = state2->topk;
+        state1->query_vectors_num = state2->query_vectors_num;
+        if (state2->query_idxs)
         {
-            --batch_num;
-            heap[0].distance = heap[batch_num].distance;
-            heap[0].batch_id = heap[batch_num].batch_id;
+            state1->query_idxs = palloc(state2->query_vectors_num * sizeof(int64));
+            memcpy(state1->query_idxs, state2->query_idxs, state2->query_vectors_num * sizeof(int64));
         }
-        else
-        {
-            heap[0].distance = distance[batches_pos[heap[0].batch_id]];
-        }
-        shiftdown(heap, 0, batch_num);
-        (*result_distance)[i] = Float4GetDatum(distance[batches_pos[heap[0].batch_id]]);
-        (*result_idxs)[i] = Int64GetDatum(idxs[batches_pos[heap[0].batch_id]]);
+        state1->metric_type = -1;
+        MemoryContextSwitchTo(old_context);
+    }
+    else
+    {
+        CHECK(state1->topk == state2->topk && state1->query_vectors_num == state2->query_vectors_num);
+        search_shards_flush(state1, agg_context);
     }
-}
 
-PG_FUNCTION_INFO_V1(reset_cache);
-Datum reset_cache(PG_FUNCTION_ARGS)
-{
-    int64 capacity = PG_GETARG_INT64(0);
-    cache_t *cache = get_cache(capacity);
-    PG_RETURN_BOOL(!!cache);
+    if (state2->metric_type < 0)
+        PG_RETURN_POINTER(state1);
+
+    if (state1->metric_type < 0)
+    {
+        state1->metric_type = state2->metric_type;
+        state1->distances = MemoryContextAlloc(agg_context, result_size * sizeof(float4));
+        state1->idxs = MemoryContextAlloc(agg_context, result_size * sizeof(int64));
+        memcpy(state1->distances, state2->distances, result_size * sizeof(float4));
+        memcpy(state1->idxs, state2->idxs, result_size * sizeof(int64));
+    }
+    else
+    {
+        CHECK(state1->metric_type == state2->metric_type);
+        search_shards_merge(state1, state2->distances, state2->idxs);
+    }
+
+    PG_RETURN_POINTER(state1);
 }
 
-PG_FUNCTION_INFO_V1(total_charge_cache);
-Datum total_charge_cache(PG_FUNCTION_ARGS)
+PG_FUNCTION_INFO_V1(faiss_index_search_shards_serialfn);
+Datum faiss_index_search_shards_serialfn(PG_FUNCTION_ARGS)
 {
-    cache_t *cache = get_cache(0);
-    PG_RETURN_UINT64(cache ? cache_total_charge(cache) : 0);
+    MemoryContext agg_context;
+
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    // the shards are searched on the segment that holds them, only their merged topk is shipped
+    search_shards_state *internal_state = (search_shards_state *)PG_GETARG_POINTER(0);
+    search_shards_flush(internal_state, agg_context);
+
+    search_shards_header header;
+    memset(&header, 0, sizeof(header));
+    header.dim = internal_state->dim;
+    header.topk = internal_state->topk;
+    header.query_vectors_num = internal_state->query_vectors_num;
+    header.metric_type = internal_state->metric_type;
+    header.has_query_idxs = internal_state->query_idxs != NULL;
+
+    size_t query_idxs_size = header.has_query_idxs ? header.query_vectors_num * sizeof(int64) : 0;
+    size_t result_size = header.metric_type >= 0 ? (size_t)header.query_vectors_num * header.topk : 0;
+    size_t total = VARHDRSZ + sizeof(header) + query_idxs_size + result_size * (sizeof(float4) + sizeof(int64));
+    if (!AllocSizeIsValid(total))
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("%s: %u query vectors and topk %u exceed the maximum allowed size", __func__, header.query_vectors_num, header.topk)));
+
+    bytea *result = (bytea *)palloc(total);
+    SET_VARSIZE(result, total);
+    char *ptr = VARDATA(result);
+    memcpy(ptr, &header, sizeof(header));
+    ptr += sizeof(header);
+    if (query_idxs_size)
+        memcpy(ptr, internal_state->query_idxs, query_idxs_size);
+    ptr += query_idxs_size;
+    if (result_size)
+    {
+        memcpy(ptr, internal_state->distances, result_size * sizeof(float4));
+        ptr += result_size * sizeof(float4);
+        memcpy(ptr, internal_state->idxs, result_size * sizeof(int64));
+    }
+
+    PG_RETURN_BYTEA_P(result);
 }
 
-PG_FUNCTION_INFO_V1(prune_cache);
-Datum prune_cache(PG_FUNCTION_ARGS)
+PG_FUNCTION_INFO_V1(faiss_index_search_shards_deserialfn);
+Datum faiss_index_search_shards_deserialfn(PG_FUNCTION_ARGS)
 {
-    cache_t *cache = get_cache(0);
-    if (cache)
-        cache_prune(cache);
-    PG_RETURN_NULL();
+    if (!AggCheckCallContext(fcinfo, NULL))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    bytea *serialized = PG_GETARG_BYTEA_P(0);
+    size_t size = VARSIZE(serialized) - VARHDRSZ;
+    const char *ptr = VARDATA(serialized);
+
+    search_shards_header header;
+    CHECK(size >= sizeof(header));
+    memcpy(&header, ptr, sizeof(header));
+    ptr += sizeof(header);
+
+    size_t query_idxs_size = header.has_query_idxs ? header.query_vectors_num * sizeof(int64) : 0;
+    size_t result_size = header.metric_type >= 0 ? (size_t)header.query_vectors_num * header.topk : 0;
+    CHECK(size == sizeof(header) + query_idxs_size + result_size * (sizeof(float4) + sizeof(int64)));
+
+    // in the current memory context, faiss_index_search_shards_combinefn() copies what it keeps
+    search_shards_state *internal_state = (search_shards_state *)palloc0(sizeof(search_shards_state));
+    internal_state->dim = header.dim;
+    internal_state->topk = header.topk;
+    internal_state->query_vectors_num = header.query_vectors_num;
+    internal_state->metric_type = header.metric_type;
+    if (query_idxs_size)
+    {
+        internal_state->query_idxs = palloc(query_idxs_size);
+        memcpy(internal_state->query_idxs, ptr, query_idxs_size);
+        ptr += query_idxs_size;
+    }
+    if (result_size)
+    {
+        internal_state->distances = palloc(result_size * sizeof(float4));
+        memcpy(internal_state->distances, ptr, result_size * sizeof(float4));
+        ptr += result_size * sizeof(float4);
+        internal_state->idxs = palloc(result_size * sizeof(int64));
+        memcpy(internal_state->idxs, ptr, result_size * sizeof(int64));
+    }
+
+    PG_RETURN_POINTER(internal_state);
 }
 
-cache_t *get_cache(size_t capacity)
+PG_FUNCTION_INFO_V1(topk_merge_transfn);
+Datum topk_merge_transfn(PG_FUNCTION_ARGS)
 {
-    static cache_t *cache = NULL;
+    MemoryContext agg_context;
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
 
-    if (capacity && cache)
+    CHECK(!PG_ARGISNULL(1));
+    ArrayType *idxs_arr = PG_GETARG_ARRAYTYPE_P(1);
+    CHECK(!PG_ARGISNULL(2));
+    ArrayType *distance_arr = PG_GETARG_ARRAYTYPE_P(2);
+    CHECK(!PG_ARGISNULL(3));
+    uint32 topk = PG_GETARG_UINT32(3);
+    // the metric_type argument of the 4-argument topk_merge
+    bool descending = PG_NARGS() > 4 && !PG_ARGISNULL(4) && PG_GETARG_INT32(4) == METRIC_INNER_PRODUCT;
+
+    const uint32 elemnum = ARRNELEMS(idxs_arr);
+    CHECK(elemnum == ARRNELEMS(distance_arr));
+
+    if (elemnum == 0 || topk == 0)
     {
-        ereport(WARNING, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: found cache(%p), now destroy it", __func__, cache)));
-        cache_destroy(cache);
-        cache = NULL;
+        if (unlikely(PG_ARGISNULL(0)))
+            PG_RETURN_NULL();
+        else
+            PG_RETURN_POINTER(PG_GETARG_POINTER(0));
     }
 
-    if (!cache)
+    topk_merge_state *internal_state = NULL;
+    MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+    if (unlikely(PG_ARGISNULL(0)))
     {
-        size_t cap = capacity ? capacity : 1 << 25;
-        cache = cache_create_lru(cap);
-        ereport(LOG, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: cache_create_lru(%zu)=%p", __func__, cap, cache)));
+        internal_state = topk_merge_state_new(topk, descending);
+    }
+    else
+    {
+        internal_state = (topk_merge_state *)PG_GETARG_POINTER(0);
+        CHECK(internal_state->topk == topk && internal_state->descending == descending);
     }
 
-    return cache;
+    topk_merge_batch(internal_state, (int64 *)ARR_DATA_PTR(idxs_arr), (float4 *)ARR_DATA_PTR(distance_arr), elemnum);
+
+    MemoryContextSwitchTo(old_context);
+    PG_RETURN_POINTER(internal_state);
 }
 
-void cache_item_deleter(const char *key, size_t keylen, void *value)
+PG_FUNCTION_INFO_V1(topk_merge_finalfn);
+Datum topk_merge_finalfn(PG_FUNCTION_ARGS)
 {
-    faiss_Index_free((FaissIndex *)value);
+    MemoryContext agg_context;
+
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    if (unlikely(PG_ARGISNULL(0)))
+        PG_RETURN_NULL();
+
+    TupleDesc tuple_desc;
+    if (get_call_result_type(fcinfo, NULL, &tuple_desc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("function returning record called in context that cannot accept type record")));
+    tuple_desc = BlessTupleDesc(tuple_desc);
+
+    topk_merge_state *internal_state = (topk_merge_state *)PG_GETARG_POINTER(0);
+
+    Datum values[2];
+    bool nulls[2] = {false, false};
+    values[0] = PointerGetDatum(array_1d_from_buffer(internal_state->idxs, internal_state->size, INT8OID, sizeof(int64)));
+    values[1] = PointerGetDatum(array_1d_from_buffer(internal_state->distance, internal_state->size, FLOAT4OID, sizeof(float4)));
+
+    HeapTuple tuple = heap_form_tuple(tuple_desc, values, nulls);
+    Datum result = HeapTupleGetDatum(tuple);
+
+    PG_RETURN_DATUM(result);
+}
+
+PG_FUNCTION_INFO_V1(topk_merge_combinefn);
+Datum topk_merge_combinefn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    topk_merge_state *state1 = PG_ARGISNULL(0) ? NULL : (topk_merge_state *)PG_GETARG_POINTER(0);
+    topk_merge_state *state2 = PG_ARGISNULL(1) ? NULL : (topk_merge_state *)PG_GETARG_POINTER(1);
+    if (state2 == NULL)
+    {
+        if (state1 == NULL)
+            PG_RETURN_NULL();
+        PG_RETURN_POINTER(state1);
+    }
+
+    // state2 may live in a shorter lived context, see topk_merge_deserialfn(): merge it into a copy
+    MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+    if (state1 == NULL)
+        state1 = topk_merge_state_new(state2->topk, state2->descending);
+    else
+        CHECK(state1->topk == state2->topk && state1->descending == state2->descending);
+    topk_merge_batch(state1, state2->idxs, state2->distance, state2->size);
+    MemoryContextSwitchTo(old_context);
+
+    PG_RETURN_POINTER(state1);
+}
+
+PG_FUNCTION_INFO_V1(topk_merge_serialfn);
+Datum topk_merge_serialfn(PG_FUNCTION_ARGS)
+{
+    if (!AggCheckCallContext(fcinfo, NULL))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    topk_merge_state *internal_state = (topk_merge_state *)PG_GETARG_POINTER(0);
+    topk_merge_header header;
+    memset(&header, 0, sizeof(header));
+    header.size = internal_state->size;
+    header.topk = internal_state->topk;
+    header.descending = internal_state->descending;
+
+    size_t total = VARHDRSZ + sizeof(header) + (size_t)header.size * (sizeof(float4) + sizeof(int64));
+    bytea *result = (bytea *)palloc(total);
+    SET_VARSIZE(result, total);
+    char *ptr = VARDATA(result);
+    memcpy(ptr, &header, sizeof(header));
+    ptr += sizeof(header);
+    memcpy(ptr, internal_state->distance, header.size * sizeof(float4));
+    ptr += header.size * sizeof(float4);
+    memcpy(ptr, internal_state->idxs, header.size * sizeof(int64));
+
+    PG_RETURN_BYTEA_P(result);
+}
+
+PG_FUNCTION_INFO_V1(topk_merge_deserialfn);
+Datum topk_merge_deserialfn(PG_FUNCTION_ARGS)
+{
+    if (!AggCheckCallContext(fcinfo, NULL))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    bytea *serialized = PG_GETARG_BYTEA_P(0);
+    size_t size = VARSIZE(serialized) - VARHDRSZ;
+    const char *ptr = VARDATA(serialized);
+
+    topk_merge_header header;
+    CHECK(size >= sizeof(header));
+    memcpy(&header, ptr, sizeof(header));
+    ptr += sizeof(header);
+    CHECK(header.size <= header.topk && size == sizeof(header) + (size_t)header.size * (sizeof(float4) + sizeof(int64)));
+
+    // in the current memory context, topk_merge_combinefn() copies what it keeps
+    topk_merge_state *internal_state = (topk_merge_state *)palloc0(sizeof(topk_merge_state));
+    internal_state->topk = header.topk;
+    internal_state->descending = header.descending;
+    internal_state->size = header.size;
+    internal_state->capacity = header.size;
+    internal_state->distance = palloc(header.size * sizeof(float4));
+    memcpy(internal_state->distance, ptr, header.size * sizeof(float4));
+    ptr += header.size * sizeof(float4);
+    internal_state->idxs = palloc(header.size * sizeof(int64));
+    memcpy(internal_state->idxs, ptr, header.size * sizeof(int64));
+
+    PG_RETURN_POINTER(internal_state);
+}
+
+/**
+ * faissindex2bytea
+ * serialize the faiss index into an exactly sized bytea and free the index.
+ * the size is computed with a counting pass first, so the bytes are written once, in place.
+ */
+bytea *faissindex2bytea(FaissIndex *faiss_index)
+{
+    return faissindex2bytea_after(faiss_index, NULL, 0);
+}
+
+/**
+ * faissindex2bytea_after
+ * like faissindex2bytea(), the serialized faiss index follows header[0, header_size) in the bytea.
+ */
+bytea *faissindex2bytea_after(FaissIndex *faiss_index, const char *header, size_t header_size)
+{
+    size_t buf_size = 0;
+    FAISS_CHECK(faiss_write_index_size(faiss_index, &buf_size));
+    if (buf_size > MaxAllocSize - VARHDRSZ - header_size)
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("%s: serialized faiss index size %zu exceeds the bytea limit", __func__, buf_size),
+                        errhint("Build it into the cache with create_index_cache_agg or faiss_index_add_cache_agg, and store it with faiss_index_cache_chunks.")));
+
+    uint32 var_size = (uint32)(header_size + buf_size) + VARHDRSZ;
+    bytea *ret_bytea = palloc(var_size);
+    SET_VARSIZE(ret_bytea, var_size);
+    if (header_size)
+        memcpy(VARDATA(ret_bytea), header, header_size);
+
+    size_t written = 0;
+    FAISS_CHECK(faiss_write_index_buf(faiss_index, VARDATA(ret_bytea) + header_size, buf_size, &written));
+    CHECK(written == buf_size);
+    faiss_Index_free(faiss_index);
+
+    return ret_bytea;
+}
+
+/**
+ * bytea2faissindex
+ * read the faiss index straight from the bytea buffer.
+ * with zero_copy, the index may keep pointing into index_bytea: the caller
+ * must keep index_bytea alive until the index is freed, and must not modify the index.
+ */
+FaissIndex *bytea2faissindex(const bytea *index_bytea, bool zero_copy)
+{
+    FaissIndex *index = NULL;
+    char *index_buf = (char *)VARDATA(index_bytea);
+    size_t buf_size = (size_t)VARSIZE(index_bytea) - VARHDRSZ;
+
+    FAISS_CHECK(faiss_read_index_buf(index_buf, buf_size, 2, zero_copy, &index));
+
+    return index;
+}
+
+/**
+ * create_index_state_new
+ * a state adding to the index of building, trained on a sample of the rows first if it is not trained
+ */
+create_index_state *create_index_state_new(building_index *building, bool with_ids)
+{
+    create_index_state *state = (create_index_state *)palloc0(sizeof(create_index_state));
+    state->dim = faiss_Index_d(building->index);
+    state->with_ids = with_ids;
+    state->building = building;
+
+    if (!faiss_Index_is_trained(building->index))
+    {
+        size_t sample_size = train_sample_size;
+        if (sample_size == 0)
+            FAISS_CHECK(faiss_index_train_sample_size(building->index, &sample_size));
+        state->train_size = Max(Min(sample_size, MaxAllocSize / sizeof(float4) / state->dim), 1);
+    }
+    state->batch_size = Min(add_batch_size, MaxAllocSize / sizeof(float4) / state->dim);
+
+    state->capacity = 16;
+    state->data = palloc(state->capacity * state->dim * sizeof(state->data[0]));
+    if (state->with_ids)
+        state->idxs = palloc(state->capacity * sizeof(state->idxs[0]));
+    return state;
+}
+
+/**
+ * create_index_append
+ * buffer a row into state, training the index on the sample once complete or adding the batch once full
+ */
+void create_index_append(create_index_state *state, const float4 *vector, int64 idx)
+{
+    if (state->size == state->capacity)
+    {
+        // the buffer grows up to the training sample, or to a batch once trained
+        uint32 limit = state->train_size ? state->train_size : state->batch_size;
+        state->capacity = Min(limit, (uint64)state->capacity * 2);
+        state->data = repalloc(state->data, state->capacity * state->dim * sizeof(state->data[0]));
+        if (state->with_ids)
+            state->idxs = repalloc(state->idxs, state->capacity * sizeof(state->idxs[0]));
+    }
+
+    memcpy(state->data + (size_t)state->size * state->dim, vector, state->dim * sizeof(state->data[0]));
+    if (state->with_ids)
+        state->idxs[state->size] = idx;
+    state->size += 1;
+
+    if (state->size >= (state->train_size ? state->train_size : state->batch_size))
+        create_index_flush(state);
+}
+
+/**
+ * create_index_flush
+ * train the index of state on the rows buffered if it is not trained yet, then add them to it
+ */
+void create_index_flush(create_index_state *state)
+{
+    if (state->size == 0)
+        return;
+
+    FaissIndex *index = state->building->index;
+    if (state->train_size)
+    {
+        faiss_threads(state->size, false);
+        FAISS_CHECK(faiss_Index_train(index, state->size, state->data));
+        state->train_size = 0;
+    }
+
+    faiss_threads(state->size, false);
+    if (state->with_ids)
+        FAISS_CHECK(faiss_Index_add_with_ids(index, state->size, state->data, state->idxs));
+    else
+        FAISS_CHECK(faiss_Index_add(index, state->size, state->data));
+    state->total += state->size;
+    state->size = 0;
+}
+
+/**
+ * building_index_register
+ * keep track of index until building_index_unregister(), or the end of the transaction
+ */
+building_index *building_index_register(FaissIndex *index)
+{
+    building_index *building = (building_index *)MemoryContextAlloc(TopMemoryContext, sizeof(building_index));
+    building->index = index;
+    building->next = building_indexes;
+    building_indexes = building;
+    return building;
+}
+
+/**
+ * building_index_unregister
+ * stop keeping track of the index of building, which the caller frees
+ */
+void building_index_unregister(building_index *building)
+{
+    building_index **link = &building_indexes;
+    while (*link && *link != building)
+        link = &(*link)->next;
+    CHECK(*link == building);
+    *link = building->next;
+    pfree(building);
+}
+
+/**
+ * building_index_xact_callback
+ * free the indexes of the create_index_agg calls that did not complete
+ */
+void building_index_xact_callback(XactEvent event, void *arg)
+{
+    if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT)
+        return;
+
+    while (building_indexes)
+    {
+        building_index *building = building_indexes;
+        building_indexes = building->next;
+        faiss_Index_free(building->index);
+        pfree(building);
+    }
+}
+
+/**
+ * topk_merge_state_new
+ * an empty topk_merge_state, its arrays grow with the candidates up to topk
+ */
+topk_merge_state *topk_merge_state_new(uint32 topk, bool descending)
+{
+    topk_merge_state *state = (topk_merge_state *)palloc0(sizeof(topk_merge_state));
+    state->topk = topk;
+    state->descending = descending;
+    return state;
+}
+
+/**
+ * topk_merge_batch
+ * merge the num candidates of a batch, nearest first, into state and truncate it to topk. on equal
+ * distances the candidates already in state come first. an id already merged, e.g. found by two
+ * replicas of a shard, keeps its nearest slot only, and the -1 padding of faiss is skipped.
+ * allocates in the current memory context.
+ */
+void topk_merge_batch(topk_merge_state *state, const int64 *idxs, const float4 *distance, uint32 num)
+{
+    uint32 size = Min((uint64)state->size + num, state->topk);
+    if (size > state->capacity)
+    {
+        uint32 capacity = Min(Max(size, (uint64)state->capacity * 2), state->topk);
+        if (state->capacity == 0)
+        {
+            state->idxs = palloc(capacity * sizeof(int64));
+            state->distance = palloc(capacity * sizeof(float4));
+        }
+        else
+        {
+            state->idxs = repalloc(state->idxs, capacity * sizeof(int64));
+            state->distance = repalloc(state->distance, capacity * sizeof(float4));
+        }
+        if (state->scratch_idxs)
+        {
+            pfree(state->scratch_idxs);
+            pfree(state->scratch_distance);
+        }
+        state->scratch_idxs = palloc(capacity * sizeof(int64));
+        state->scratch_distance = palloc(capacity * sizeof(float4));
+        state->capacity = capacity;
+    }
+    else if (!state->scratch_idxs)
+    {
+        state->scratch_idxs = palloc(state->capacity * sizeof(int64));
+        state->scratch_distance = palloc(state->capacity * sizeof(float4));
+    }
+
+    id_set seen;
+    uint32 slots = 1;
+    while (slots < 2 * ((uint64)state->size + num))
+        slots <<= 1;
+    seen.ids = palloc(slots * sizeof(int64));
+    seen.used = palloc0(slots * sizeof(bool));
+    seen.mask = slots - 1;
+
+    uint32 i = 0, j = 0, n = 0;
+    while (n < size && (i < state->size || j < num))
+    {
+        int64 id;
+        float4 dis;
+        if (j == num || (i < state->size && (state->descending ? state->distance[i] >= distance[j] : state->distance[i] <= distance[j])))
+        {
+            id = state->idxs[i];
+            dis = state->distance[i];
+            i++;
+        }
+        else
+        {
+            id = idxs[j];
+            dis = distance[j];
+            j++;
+        }
+        if (id == -1 || !id_set_insert(&seen, id))
+            continue;
+        state->scratch_idxs[n] = id;
+        state->scratch_distance[n] = dis;
+        n++;
+    }
+    pfree(seen.ids);
+    pfree(seen.used);
+
+    int64 *tmp_idxs = state->idxs;
+    float4 *tmp_distance = state->distance;
+    state->idxs = state->scratch_idxs;
+    state->distance = state->scratch_distance;
+    state->scratch_idxs = tmp_idxs;
+    state->scratch_distance = tmp_distance;
+    state->size = n;
+}
+
+/**
+ * id_set_insert
+ * add id to set, return false if it was already there
+ */
+bool id_set_insert(id_set *set, int64 id)
+{
+    uint32 slot = (uint32)(((uint64)id * UINT64CONST(0x9E3779B97F4A7C15)) >> 32) & set->mask;
+    while (set->used[slot])
+    {
+        if (set->ids[slot] == id)
+            return false;
+        slot = (slot + 1) & set->mask;
+    }
+    set->used[slot] = true;
+    set->ids[slot] = id;
+    return true;
+}
+
+PG_FUNCTION_INFO_V1(reset_cache);
+Datum reset_cache(PG_FUNCTION_ARGS)
+{
+    int64 capacity = PG_GETARG_INT64(0);
+    cache_t *cache = get_cache(capacity);
+    PG_RETURN_BOOL(!!cache);
+}
+
+PG_FUNCTION_INFO_V1(resize_cache);
+Datum resize_cache(PG_FUNCTION_ARGS)
+{
+    int64 capacity = PG_GETARG_INT64(0);
+    if (capacity <= 0)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s: capacity must be positive, got " INT64_FORMAT, __func__, capacity)));
+
+    // unlike reset_cache(), the entries that still fit stay cached
+    cache_t *cache = get_cache(0);
+    cache_set_capacity(cache, (size_t)capacity);
+    PG_RETURN_INT64(cache_total_charge(cache));
+}
+
+PG_FUNCTION_INFO_V1(total_charge_cache);
+Datum total_charge_cache(PG_FUNCTION_ARGS)
+{
+    cache_t *cache = get_cache(0);
+    PG_RETURN_UINT64(cache ? cache_total_charge(cache) : 0);
+}
+
+PG_FUNCTION_INFO_V1(charge_cache);
+Datum charge_cache(PG_FUNCTION_ARGS)
+{
+    char *key = cache_key_arg(fcinfo, 0);
+    cache_t *cache = get_cache(0);
+    handle_t *handle = cache_lookup(cache, key, strlen(key));
+    if (!handle)
+        PG_RETURN_NULL();
+
+    size_t charge = ((cache_item *)cache_value(cache, handle))->charge;
+    cache_release(cache, handle);
+    PG_RETURN_INT64(charge);
+}
+
+PG_FUNCTION_INFO_V1(erase_cache);
+Datum erase_cache(PG_FUNCTION_ARGS)
+{
+    char *key = cache_key_arg(fcinfo, 0);
+    // the next load would attach the shared image of the key again
+    remove_shared_image(key);
+
+    cache_t *cache = get_cache(0);
+    handle_t *handle = cache_lookup(cache, key, strlen(key));
+    if (!handle)
+        PG_RETURN_BOOL(false);
+
+    cache_release(cache, handle);
+    // searches holding the entry keep using it until they release it
+    cache_erase(cache, key, strlen(key));
+    PG_RETURN_BOOL(true);
+}
+
+PG_FUNCTION_INFO_V1(erase_cache_versions);
+Datum erase_cache_versions(PG_FUNCTION_ARGS)
+{
+    char *key = text_to_cstring(PG_GETARG_TEXT_P(0));
+    char *prefix = psprintf("%s@", key);
+    size_t prefix_len = strlen(prefix);
+    char *current = cache_key_arg(fcinfo, 0);
+    cache_t *cache = get_cache(0);
+
+    cache_entry_info *entries = NULL;
+    size_t n = cache_list_entries(cache, &entries);
+    int64 erased = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        // the unversioned key and the current version stay
+        if (entries[i].keylen > prefix_len && memcmp(entries[i].key, prefix, prefix_len) == 0 && strcmp(entries[i].key, current) != 0)
+        {
+            remove_shared_image(entries[i].key);
+            cache_erase(cache, entries[i].key, entries[i].keylen);
+            erased++;
+        }
+    }
+    cache_free_entries(entries, n);
+    PG_RETURN_INT64(erased);
+}
+
+PG_FUNCTION_INFO_V1(publish_cache);
+Datum publish_cache(PG_FUNCTION_ARGS)
+{
+    char *key = cache_key_arg(fcinfo, 0);
+    size_t keylen = strlen(key);
+
+    // the shared image of the key, if any, holds the index being replaced
+    remove_shared_image(key);
+
+    cache_item *item = cache_item_load(PG_GETARG_DATUM(1), key, keylen);
+    size_t charge = item->charge;
+
+    // replaces the entry of key at once: searches holding the old one keep using it until they release it
+    cache_t *cache = get_cache(0);
+    handle_t *handle = cache_insert_priority(cache, key, keylen, item, charge, cache_priority_option, cache_item_deleter);
+    cache_release(cache, handle);
+    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: key:%s, charge:%zu", __func__, key, charge)));
+
+    PG_RETURN_INT64(charge);
+}
+
+PG_FUNCTION_INFO_V1(prune_cache);
+Datum prune_cache(PG_FUNCTION_ARGS)
+{
+    cache_t *cache = get_cache(0);
+    if (cache)
+        cache_prune(cache);
+    PG_RETURN_NULL();
+}
+
+PG_FUNCTION_INFO_V1(cache_stats);
+Datum cache_stats(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    TupleDesc tupdesc;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("function returning record called in context that cannot accept type record")));
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+        funcctx->max_calls = cache_num_shards(get_cache(0));
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        int shard = funcctx->call_cntr;
+        cache_counters stats;
+        cache_shard_counters(get_cache(0), shard, &stats);
+
+        Datum values[15];
+        bool nulls[15];
+        memset(nulls, false, sizeof(nulls));
+        values[0] = Int32GetDatum(shard);
+        values[1] = Int64GetDatum(stats.capacity);
+        values[2] = Int64GetDatum(stats.usage);
+        values[3] = Int64GetDatum(stats.entries);
+        values[4] = Int64GetDatum(stats.hits);
+        values[5] = Int64GetDatum(stats.misses);
+        values[6] = Int64GetDatum(stats.inserts);
+        values[7] = Int64GetDatum(stats.rejects);
+        values[8] = Int64GetDatum(stats.evictions);
+        values[9] = Int64GetDatum(stats.bytes_evicted);
+        values[10] = Int64GetDatum(stats.erased_in_use);
+        values[11] = Int64GetDatum(stats.lock_waits);
+        values[12] = Int64GetDatum(stats.loads);
+        values[13] = Int64GetDatum(stats.load_failures);
+        values[14] = Float8GetDatum(stats.load_seconds);
+
+        HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+PG_FUNCTION_INFO_V1(cache_entries);
+Datum cache_entries(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    TupleDesc tupdesc;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("function returning record called in context that cannot accept type record")));
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        // the snapshot is malloc()ed by the cache, copy it before anything may throw
+        cache_entry_info *snapshot = NULL;
+        size_t n = cache_list_entries(get_cache(0), &snapshot);
+        cache_entry_info *entries = NULL;
+        PG_TRY();
+        {
+            entries = (cache_entry_info *)palloc(sizeof(cache_entry_info) * (n + 1));
+            for (size_t i = 0; i < n; i++)
+            {
+                entries[i] = snapshot[i];
+                entries[i].key = pnstrdup(snapshot[i].key, snapshot[i].keylen);
+            }
+        }
+        PG_CATCH();
+        {
+            cache_free_entries(snapshot, n);
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+        cache_free_entries(snapshot, n);
+
+        funcctx->user_fctx = entries;
+        funcctx->max_calls = n;
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        cache_entry_info *entry = &((cache_entry_info *)funcctx->user_fctx)[funcctx->call_cntr];
+        TimestampTz inserted_at = unix_micros_to_timestamptz(entry->inserted_at);
+
+        Datum values[8];
+        bool nulls[8];
+        memset(nulls, false, sizeof(nulls));
+        values[0] = CStringGetTextDatum(entry->key);
+        values[1] = Int32GetDatum(entry->shard);
+        values[2] = Int64GetDatum(entry->charge);
+        values[3] = Int32GetDatum(entry->refs);
+        values[4] = CStringGetTextDatum(cache_priority_options[entry->priority].name);
+        values[5] = BoolGetDatum(entry->in_protected);
+        values[6] = DirectFunctionCall2(timestamp_mi, TimestampTzGetDatum(GetCurrentTimestamp()), TimestampTzGetDatum(inserted_at));
+        values[7] = TimestampTzGetDatum(unix_micros_to_timestamptz(entry->last_access));
+
+        HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+PG_FUNCTION_INFO_V1(shared_cache_remove);
+Datum shared_cache_remove(PG_FUNCTION_ARGS)
+{
+    char *key = cache_key_arg(fcinfo, 0);
+    // backends that attached the image keep their mapping until their cache entry goes away
+    PG_RETURN_BOOL(remove_shared_image(key));
+}
+
+PG_FUNCTION_INFO_V1(shared_cache_clear);
+Datum shared_cache_clear(PG_FUNCTION_ARGS)
+{
+    if (!shared_cache_dir || !shared_cache_dir[0])
+        PG_RETURN_INT64(0);
+
+    long removed = shared_image_clear(shared_cache_dir);
+    if (removed < 0)
+        ereport(ERROR, (errcode_for_file_access(), errmsg("%s: could not clear \"%s\": %m", __func__, shared_cache_dir)));
+    PG_RETURN_INT64(removed);
+}
+
+PG_FUNCTION_INFO_V1(index_store_remove);
+Datum index_store_remove(PG_FUNCTION_ARGS)
+{
+    char *key = cache_key_arg(fcinfo, 0);
+    long removed = 0;
+
+    // backends that opened the file keep their mapping until their cache entry goes away
+    FAISS_CHECK(faiss_index_store_remove(INDEX_STORE_DIR, key, strlen(key), &removed));
+    PG_RETURN_BOOL(removed > 0);
+}
+
+PG_FUNCTION_INFO_V1(index_store_clear);
+Datum index_store_clear(PG_FUNCTION_ARGS)
+{
+    long removed = 0;
+    FAISS_CHECK(faiss_index_store_clear(INDEX_STORE_DIR, &removed));
+    PG_RETURN_INT64(removed);
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_chunks);
+Datum faiss_index_chunks(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    TupleDesc tupdesc;
+
+    CHECK(!PG_ARGISNULL(1));
+    int32 chunk_size = PG_GETARG_INT32(1);
+    if (chunk_size <= 0 || chunk_size > MaxAllocSize - VARHDRSZ)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s: invalid chunk_size %d", __func__, chunk_size)));
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("function returning record called in context that cannot accept type record")));
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        CHECK(!PG_ARGISNULL(0));
+        // only the size is needed here, each call fetches its own slice of the toasted value
+        uint64 total_size = toast_raw_datum_size(PG_GETARG_DATUM(0)) - VARHDRSZ;
+        funcctx->max_calls = (total_size + chunk_size - 1) / chunk_size;
+        ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: total_size:%lu, chunk_num:%lu", __func__, total_size, (uint64)funcctx->max_calls)));
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        Datum values[2];
+        bool nulls[2] = {false, false};
+
+        int32 chunk_no = funcctx->call_cntr;
+        values[0] = Int32GetDatum(chunk_no);
+        values[1] = PointerGetDatum(DatumGetByteaPSlice(PG_GETARG_DATUM(0), chunk_no * chunk_size, chunk_size));
+
+        HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_cache_chunks);
+Datum faiss_index_cache_chunks(PG_FUNCTION_ARGS)
+{
+    FuncCallContext *funcctx;
+    TupleDesc tupdesc;
+
+    if (SRF_IS_FIRSTCALL())
+    {
+        funcctx = SRF_FIRSTCALL_INIT();
+        MemoryContext oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+        if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("function returning record called in context that cannot accept type record")));
+        funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+        CHECK(!PG_ARGISNULL(0));
+        CHECK(!PG_ARGISNULL(1));
+        int32 chunk_size = PG_GETARG_INT32(1);
+        if (chunk_size <= 0 || chunk_size > MaxAllocSize - VARHDRSZ)
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s: invalid chunk_size %d", __func__, chunk_size)));
+
+        cache_chunks_state *state = (cache_chunks_state *)palloc0(sizeof(cache_chunks_state));
+        state->key = cache_key_arg(fcinfo, 0);
+        state->chunk_size = chunk_size;
+
+        cache_t *cache = get_cache(0);
+        handle_t *handle = cache_lookup(cache, state->key, strlen(state->key));
+        if (!handle)
+            ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT), errmsg("%s: faiss index \"%s\" is not cached", __func__, state->key)));
+        state->item = (cache_item *)cache_value(cache, handle);
+        int ret = faiss_write_index_size(state->item->index, &state->total_size);
+        cache_release(cache, handle);
+        FAISS_CHECK(ret);
+
+        funcctx->user_fctx = state;
+        funcctx->max_calls = (state->total_size + chunk_size - 1) / chunk_size;
+        ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: total_size:%zu, chunk_num:%lu", __func__, state->total_size, (uint64)funcctx->max_calls)));
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    funcctx = SRF_PERCALL_SETUP();
+    if (funcctx->call_cntr < funcctx->max_calls)
+    {
+        cache_chunks_state *state = funcctx->user_fctx;
+        size_t offset = funcctx->call_cntr * state->chunk_size;
+        size_t size = Min(state->chunk_size, state->total_size - offset);
+
+        // the entry is looked up again for every chunk rather than held across calls, a handle left by an
+        // aborted query would never be released. the chunks of a replaced entry must not be mixed up though
+        cache_t *cache = get_cache(0);
+        handle_t *handle = cache_lookup(cache, state->key, strlen(state->key));
+        if (!handle || cache_value(cache, handle) != state->item)
+        {
+            if (handle)
+                cache_release(cache, handle);
+            ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE), errmsg("%s: faiss index \"%s\" was evicted or replaced while being chunked", __func__, state->key)));
+        }
+
+        // only the current chunk is held: faiss serializes the whole index again and the bytes outside of it are dropped
+        bytea *chunk = palloc(size + VARHDRSZ);
+        SET_VARSIZE(chunk, size + VARHDRSZ);
+        size_t written = 0;
+        int ret = faiss_write_index_range(state->item->index, offset, VARDATA(chunk), size, &written);
+        cache_release(cache, handle);
+        FAISS_CHECK(ret);
+        CHECK(written == size);
+
+        Datum values[2];
+        bool nulls[2] = {false, false};
+        values[0] = Int32GetDatum(funcctx->call_cntr);
+        values[1] = PointerGetDatum(chunk);
+
+        HeapTuple tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+    }
+    else
+    {
+        SRF_RETURN_DONE(funcctx);
+    }
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_load_chunks_transfn);
+Datum faiss_index_load_chunks_transfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    CHECK(!PG_ARGISNULL(1));
+    CHECK(!PG_ARGISNULL(2));
+    CHECK(!PG_ARGISNULL(3));
+
+    load_chunks_state *internal_state = NULL;
+    MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+    if (unlikely(PG_ARGISNULL(0)))
+    {
+        internal_state = (load_chunks_state *)palloc0(sizeof(load_chunks_state));
+        internal_state->key = cache_key_arg(fcinfo, 1);
+        internal_state->capacity = 16;
+        internal_state->chunks = palloc(internal_state->capacity * sizeof(internal_state->chunks[0]));
+    }
+    else
+    {
+        internal_state = (load_chunks_state *)PG_GETARG_POINTER(0);
+    }
+
+    if (internal_state->chunk_num == internal_state->capacity)
+    {
+        internal_state->capacity *= 2;
+        internal_state->chunks = repalloc(internal_state->chunks, internal_state->capacity * sizeof(internal_state->chunks[0]));
+    }
+
+    // keep the toast pointer only, the chunk is detoasted when faiss reaches it
+    index_chunk *chunk = &internal_state->chunks[internal_state->chunk_num++];
+    chunk->chunk_no = PG_GETARG_INT32(2);
+    chunk->chunk = datumCopy(PG_GETARG_DATUM(3), false, -1);
+
+    MemoryContextSwitchTo(old_context);
+    PG_RETURN_POINTER(internal_state);
+}
+
+PG_FUNCTION_INFO_V1(faiss_index_load_chunks_finalfn);
+Datum faiss_index_load_chunks_finalfn(PG_FUNCTION_ARGS)
+{
+    MemoryContext agg_context;
+
+    if (!AggCheckCallContext(fcinfo, &agg_context))
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: aggregate function called in non-aggregate context", __func__)));
+
+    if (unlikely(PG_ARGISNULL(0)))
+        PG_RETURN_NULL();
+
+    load_chunks_state *internal_state = (load_chunks_state *)PG_GETARG_POINTER(0);
+    qsort(internal_state->chunks, internal_state->chunk_num, sizeof(index_chunk), index_chunk_cmp);
+
+    uint64 total_size = 0;
+    for (uint32 i = 0; i < internal_state->chunk_num; ++i)
+    {
+        if (internal_state->chunks[i].chunk_no != (int32)i)
+            ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("%s: faiss index \"%s\" misses chunk %u", __func__, internal_state->key, i)));
+        total_size += toast_raw_datum_size(internal_state->chunks[i].chunk) - VARHDRSZ;
+    }
+
+    chunk_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.chunks = internal_state->chunks;
+
+    FaissIndex *faiss_index = NULL;
+    if (faiss_read_index_chunks(fetch_index_chunk, &reader, internal_state->chunk_num, 2, &faiss_index))
+    {
+        if (reader.edata)
+            ReThrowError(reader.edata);
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: faiss_read_index_chunks's faiss error: %s", __func__, faiss_get_last_error())));
+    }
+    if (reader.detoasted)
+        pfree(reader.detoasted);
+
+    size_t charge = 0;
+    PG_TRY();
+    {
+        charge = cache_item_charge(faiss_index, 0);
+    }
+    PG_CATCH();
+    {
+        faiss_Index_free(faiss_index);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    cache_item *item = (cache_item *)MemoryContextAlloc(TopMemoryContext, sizeof(cache_item));
+    item->index = faiss_index;
+    item->context = NULL;
+    item->image = NULL;
+    item->charge = charge;
+
+    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: key:%s, chunk_num:%u, total_size:%lu, charge:%zu", __func__, internal_state->key, internal_state->chunk_num, total_size, charge)));
+    // nothing to search if the cache turns it away, the index is freed then
+    if (!cache_admit_item(get_cache(0), internal_state->key, item))
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("%s: faiss index \"%s\" is not admitted by the cache", __func__, internal_state->key),
+                        errhint("Raise vector_recall.cache_capacity or vector_recall.cache_admission_percent, or load it with vector_recall.cache_priority = 'pinned'.")));
+
+    PG_RETURN_INT64(total_size);
+}
+
+/**
+ * index_search
+ * search the faiss index of argument 0 (or the one cached under the faiss_index_key argument key_argno)
+ * for the query vectors of arguments 1 and 2: their topk nearest neighbors, or their neighbors within
+ * the radius of argument 3 for a range search. argument 4 are the optional ids of the query vectors.
+ * the result of a range search is owned by faiss, see faiss_RangeSearchResult_free().
+ */
+faiss_search_result *index_search(FunctionCallInfo fcinfo, bool range_search, int key_argno, bool preserve_vector, int excluded_argno)
+{
+    char *key = index_cache_key(fcinfo, 0, key_argno);
+
+    CHECK(!PG_ARGISNULL(1));
+    ArrayType *query_vectors_array = PG_GETARG_ARRAYTYPE_P(1);
+    CHECK(!PG_ARGISNULL(2));
+    uint32 dim = PG_GETARG_UINT32(2);
+    CHECK(!PG_ARGISNULL(3));
+
+    // get query_vectors data and infomation
+    float4 *query_vectors = (float4 *)ARR_DATA_PTR(query_vectors_array);
+    uint32 query_vectors_num = ARRNELEMS(query_vectors_array) / dim;
+    int64 *query_idxs = NULL;
+    uint32 query_idxs_num = 0;
+
+    // if provide query_idx, then output with query_idx
+    if (!PG_ARGISNULL(4))
+    {
+        ArrayType *query_idxs_array = PG_GETARG_ARRAYTYPE_P(4);
+        query_idxs = (int64 *)ARR_DATA_PTR(query_idxs_array);
+        query_idxs_num = ARRNELEMS(query_idxs_array);
+        CHECK(query_idxs_num == query_vectors_num);
+    }
+
+    // construct the faiss_search_result, search_index() fills in the result of faiss search.
+    faiss_search_result *search_result = (faiss_search_result *)palloc0(sizeof(faiss_search_result));
+    search_result->dim = dim;
+    search_result->query_vectors_num = query_vectors_num;
+    search_result->query_vectors = preserve_vector ? query_vectors : NULL;
+    search_result->query_idxs = query_idxs;
+    if (range_search)
+        search_result->radius = PG_GETARG_FLOAT4(3);
+    else
+        search_result->topk = PG_GETARG_UINT32(3);
+
+    // the tombstones of the index, see tombstones_add()
+    if (excluded_argno >= 0 && PG_NARGS() > excluded_argno && !PG_ARGISNULL(excluded_argno))
+        search_result->excluded_ids = sorted_ids(PG_GETARG_ARRAYTYPE_P(excluded_argno), &search_result->excluded_ids_num);
+
+    search_index(PG_GETARG_DATUM(0), PG_ARGISNULL(0), key, search_result, query_vectors, range_search);
+    return search_result;
+}
+
+/**
+ * search_index
+ * run the search of search_result (its dim, query_vectors_num, and topk or radius) for query_vectors
+ * on the faiss index index_datum, or the one cached under key unless key is NULL.
+ */
+void search_index(Datum index_datum, bool index_isnull, const char *key, faiss_search_result *search_result, float4 *query_vectors, bool range_search)
+{
+    FaissIndex *faiss_index = NULL;
+
+    cache_t *cache = get_cache(0);
+    handle_t *handle = NULL;
+    if (key)
+    {
+        handle = cache_lookup_or_load_item(cache, key, index_datum, index_isnull);
+        faiss_index = ((cache_item *)cache_value(cache, handle))->index;
+    }
+    else
+    {
+        CHECK(!index_isnull);
+        bytea *index_bytea = DatumGetByteaP(index_datum);
+        // index_bytea lives in the current memory context and the index is freed before this call returns
+        faiss_index = bytea2faissindex(index_bytea, true);
+    }
+
+    // the handle must not stay referenced if the search fails
+    PG_TRY();
+    {
+        uint32 query_vectors_num = search_result->query_vectors_num;
+        CHECK(search_result->dim == faiss_Index_d(faiss_index));
+
+        faiss_threads(query_vectors_num, true);
+        if (range_search)
+        {
+            FAISS_CHECK(faiss_RangeSearchResult_new(&(search_result->faiss_range_search_result), query_vectors_num));
+            if (search_result->excluded_ids_num)
+                FAISS_CHECK(faiss_range_search_excluding(faiss_index, query_vectors_num, query_vectors, search_result->radius, search_result->excluded_ids, search_result->excluded_ids_num, search_result->faiss_range_search_result));
+            else
+                FAISS_CHECK(faiss_Index_range_search(faiss_index, query_vectors_num, query_vectors, search_result->radius, search_result->faiss_range_search_result));
+        }
+        else
+        {
+            uint32 topk = search_result->topk;
+            search_result->distances = palloc((size_t)topk * query_vectors_num * sizeof(float4));
+            search_result->idxs = palloc((size_t)topk * query_vectors_num * sizeof(int64));
+            if (search_result->excluded_ids_num)
+                FAISS_CHECK(faiss_search_excluding(faiss_index, query_vectors_num, query_vectors, topk, search_result->excluded_ids, search_result->excluded_ids_num, search_result->distances, search_result->idxs));
+            else
+                FAISS_CHECK(faiss_Index_search(faiss_index, query_vectors_num, query_vectors, topk, search_result->distances, search_result->idxs));
+        }
+    }
+    PG_CATCH();
+    {
+        if (key)
+            cache_release(cache, handle);
+        else
+            faiss_Index_free(faiss_index);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    if (key)
+        cache_release(cache, handle);
+    else
+        faiss_Index_free(faiss_index);
+
+    if (range_search)
+    {
+        faiss_RangeSearchResult_lims(search_result->faiss_range_search_result, &(search_result->lims));
+        faiss_RangeSearchResult_labels(search_result->faiss_range_search_result, &(search_result->idxs), &(search_result->distances));
+    }
+}
+
+/**
+ * faiss_threads
+ * set the OpenMP threads of the faiss calls to come, for vectors_num vectors, see vector_recall.omp_threads.
+ * a single query searches on the thread of the backend, instead of waking a thread per core of the host
+ * in every segment and every session.
+ */
+void faiss_threads(size_t vectors_num, bool search)
+{
+    static int applied_wait_policy = OMP_WAIT_POLICY_DEFAULT;
+    if (omp_wait_policy != applied_wait_policy)
+    {
+        applied_wait_policy = omp_wait_policy;
+        if (omp_wait_policy != OMP_WAIT_POLICY_DEFAULT && faiss_omp_set_wait_policy(omp_wait_policy == OMP_WAIT_POLICY_PASSIVE) != 0)
+            ereport(WARNING, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED), errmsg("%s: could not set vector_recall.omp_wait_policy: %s", __func__, faiss_get_last_error())));
+    }
+
+    int threads = omp_threads;
+    if (threads == 0)
+    {
+        int max_threads = omp_max_threads ? omp_max_threads : faiss_omp_get_num_procs();
+        threads = max_threads;
+        if (search && vectors_num < (size_t)max_threads * OMP_QUERIES_PER_THREAD)
+            threads = Max(1, (vectors_num + OMP_QUERIES_PER_THREAD - 1) / OMP_QUERIES_PER_THREAD);
+    }
+    FAISS_CHECK(faiss_omp_set_num_threads(threads));
+}
+
+/**
+ * array_1d_from_buffer
+ * a one-dimensional array of nelems fixed-length, pass-by-value elements copied at once from data,
+ * instead of going through a Datum per element. data may be NULL to fill the array afterwards.
+ */
+ArrayType *array_1d_from_buffer(const void *data, size_t nelems, Oid element_type, int elmlen)
+{
+    if (nelems == 0)
+        return construct_empty_array(element_type);
+
+    size_t nbytes = nelems * elmlen;
+    size_t total = ARR_OVERHEAD_NONULLS(1) + nbytes;
+    if (!AllocSizeIsValid(total))
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("%s: array of %zu elements exceeds the maximum allowed size", __func__, nelems)));
+
+    ArrayType *result = (ArrayType *)palloc(total);
+    SET_VARSIZE(result, total);
+    result->ndim = 1;
+    result->dataoffset = 0;
+    result->elemtype = element_type;
+    *(ARR_DIMS(result)) = nelems;
+    *(ARR_LBOUND(result)) = 1;
+    if (data)
+        memcpy(ARR_DATA_PTR(result), data, nbytes);
+    return result;
+}
+
+/**
+ * flat_search_result
+ * the __vector_index_search_flat_results of a search
+ */
+Datum flat_search_result(FunctionCallInfo fcinfo, faiss_search_result *search_result, int64 *lims, ArrayType *idx_array, ArrayType *dis_array)
+{
+    TupleDesc tupdesc;
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("function returning record called in context that cannot accept type record")));
+    tupdesc = BlessTupleDesc(tupdesc);
+
+    Datum values[4];
+    bool nulls[4] = {false, false, false, false};
+
+    if (search_result->query_idxs)
+        values[0] = PointerGetDatum(array_1d_from_buffer(search_result->query_idxs, search_result->query_vectors_num, INT8OID, sizeof(int64)));
+    else
+        nulls[0] = true;
+    values[1] = PointerGetDatum(array_1d_from_buffer(lims, search_result->query_vectors_num + 1, INT8OID, sizeof(int64)));
+    values[2] = PointerGetDatum(idx_array);
+    values[3] = PointerGetDatum(dis_array);
+
+    return HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls));
+}
+
+/**
+ * flat_topk_search_result
+ * the __vector_index_search_flat_results of a topk search
+ */
+Datum flat_topk_search_result(FunctionCallInfo fcinfo, faiss_search_result *search_result)
+{
+    uint32 topk = search_result->topk;
+    size_t query_vectors_num = search_result->query_vectors_num;
+
+    // result for query i is vector_idxs[lims[i]:lims[i+1]], without the -1 padding of faiss
+    int64 *lims = palloc((query_vectors_num + 1) * sizeof(int64));
+    size_t total = 0;
+    lims[0] = 0;
+    for (size_t i = 0; i < query_vectors_num; i++)
+    {
+        uint32 cnt = 0;
+        while (cnt < topk && search_result->idxs[i * topk + cnt] != -1)
+            ++cnt;
+        total += cnt;
+        lims[i + 1] = total;
+    }
+
+    ArrayType *idx_array, *dis_array;
+    if (total == query_vectors_num * topk)
+    {
+        // the usual case: the buffers of faiss are the arrays
+        idx_array = array_1d_from_buffer(search_result->idxs, total, INT8OID, sizeof(int64));
+        dis_array = array_1d_from_buffer(search_result->distances, total, FLOAT4OID, sizeof(float4));
+    }
+    else
+    {
+        idx_array = array_1d_from_buffer(NULL, total, INT8OID, sizeof(int64));
+        dis_array = array_1d_from_buffer(NULL, total, FLOAT4OID, sizeof(float4));
+        for (size_t i = 0; i < query_vectors_num; i++)
+        {
+            size_t cnt = lims[i + 1] - lims[i];
+            memcpy((int64 *)ARR_DATA_PTR(idx_array) + lims[i], search_result->idxs + i * topk, cnt * sizeof(int64));
+            memcpy((float4 *)ARR_DATA_PTR(dis_array) + lims[i], search_result->distances + i * topk, cnt * sizeof(float4));
+        }
+    }
+
+    return flat_search_result(fcinfo, search_result, lims, idx_array, dis_array);
+}
+
+/**
+ * search_shards_flush
+ * search the shards collected in state at once, in parallel, and merge their topk into the result
+ * of state, allocated in context.
+ */
+void search_shards_flush(search_shards_state *state, MemoryContext context)
+{
+    uint32 shard_num = state->shard_num;
+    if (shard_num == 0)
+        return;
+    CHECK(state->query_vectors);
+
+    cache_t *cache = get_cache(0);
+    size_t result_size = (size_t)state->query_vectors_num * state->topk;
+    handle_t **handles = palloc0(shard_num * sizeof(handle_t *));
+    FaissIndex **indexes = palloc0(shard_num * sizeof(FaissIndex *));
+    const int64 **excluded_ids = palloc(shard_num * sizeof(int64 *));
+    size_t *excluded_ids_num = palloc(shard_num * sizeof(size_t));
+    float4 *distances = palloc(result_size * sizeof(float4));
+    int64 *idxs = palloc(result_size * sizeof(int64));
+
+    // the handles must not stay referenced if a lookup or the search fails
+    PG_TRY();
+    {
+        for (uint32 i = 0; i < shard_num; i++)
+        {
+            index_shard *shard = &state->shards[i];
+            if (shard->key)
+            {
+                handles[i] = cache_lookup_or_load_item(cache, shard->key, shard->index_datum, shard->index_isnull);
+                indexes[i] = ((cache_item *)cache_value(cache, handles[i]))->index;
+            }
+            else
+            {
+                CHECK(!shard->index_isnull);
+                // the detoasted index lives in the current memory context and the index is freed below
+                indexes[i] = bytea2faissindex(DatumGetByteaP(shard->index_datum), true);
+            }
+            CHECK(state->dim == faiss_Index_d(indexes[i]));
+            excluded_ids[i] = shard->excluded_ids;
+            excluded_ids_num[i] = shard->excluded_ids_num;
+        }
+
+        // for vector_recall.omp_threads, every shard counts as a batch of its own
+        faiss_threads((size_t)shard_num * Max(state->query_vectors_num, OMP_QUERIES_PER_THREAD), true);
+        FAISS_CHECK(faiss_search_shards((const FaissIndex **)indexes, shard_num, state->query_vectors_num, state->query_vectors, state->topk, excluded_ids, excluded_ids_num, distances, idxs));
+    }
+    PG_CATCH();
+    {
+        release_shard_indexes(cache, shard_num, handles, indexes);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    int32 metric_type = faiss_Index_metric_type(indexes[0]);
+    release_shard_indexes(cache, shard_num, handles, indexes);
+    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: shard_num:%u, query_vectors_num:%u, topk:%u", __func__, shard_num, state->query_vectors_num, state->topk)));
+
+    for (uint32 i = 0; i < shard_num; i++)
+    {
+        if (!state->shards[i].index_isnull)
+            pfree(DatumGetPointer(state->shards[i].index_datum));
+        if (state->shards[i].key)
+            pfree(state->shards[i].key);
+        if (state->shards[i].excluded_ids)
+            pfree(state->shards[i].excluded_ids);
+    }
+    state->shard_num = 0;
+
+    if (state->metric_type < 0)
+    {
+        state->metric_type = metric_type;
+        state->distances = MemoryContextAlloc(context, result_size * sizeof(float4));
+        state->idxs = MemoryContextAlloc(context, result_size * sizeof(int64));
+        memcpy(state->distances, distances, result_size * sizeof(float4));
+        memcpy(state->idxs, idxs, result_size * sizeof(int64));
+    }
+    else
+    {
+        CHECK(state->metric_type == metric_type);
+        search_shards_merge(state, distances, idxs);
+    }
+    pfree(distances);
+    pfree(idxs);
+}
+
+/**
+ * search_shards_merge
+ * merge the topk of distances and idxs into the result of state, in place
+ */
+void search_shards_merge(search_shards_state *state, const float4 *distances, const int64 *idxs)
+{
+    size_t result_size = (size_t)state->query_vectors_num * state->topk;
+    float4 *all_distances = palloc(2 * result_size * sizeof(float4));
+    int64 *all_idxs = palloc(2 * result_size * sizeof(int64));
+    memcpy(all_distances, state->distances, result_size * sizeof(float4));
+    memcpy(all_distances + result_size, distances, result_size * sizeof(float4));
+    memcpy(all_idxs, state->idxs, result_size * sizeof(int64));
+    memcpy(all_idxs + result_size, idxs, result_size * sizeof(int64));
+
+    FAISS_CHECK(faiss_merge_knn_results(state->query_vectors_num, state->topk, 2, state->metric_type, all_distances, all_idxs, state->distances, state->idxs));
+    pfree(all_distances);
+    pfree(all_idxs);
+}
+
+/**
+ * release_shard_indexes
+ * release the handles of the cached shards and free the others
+ */
+void release_shard_indexes(cache_t *cache, uint32 shard_num, handle_t **handles, FaissIndex **indexes)
+{
+    for (uint32 i = 0; i < shard_num; i++)
+    {
+        if (handles[i])
+            cache_release(cache, handles[i]);
+        else if (indexes[i])
+            faiss_Index_free(indexes[i]);
+    }
+}
+
+/**
+ * sorted_ids
+ * the ids of ids_array sorted ascending without duplicates, in *ids_num. ids_array itself if it already is
+ */
+int64 *sorted_ids(ArrayType *ids_array, uint32 *ids_num)
+{
+    CHECK(!ARR_HASNULL(ids_array));
+    int64 *ids = (int64 *)ARR_DATA_PTR(ids_array);
+    uint32 num = ARRNELEMS(ids_array);
+
+    uint32 i = 1;
+    while (i < num && ids[i - 1] < ids[i])
+        i++;
+    if (i >= num)
+    {
+        *ids_num = num;
+        return ids;
+    }
+
+    int64 *sorted = palloc(num * sizeof(int64));
+    memcpy(sorted, ids, num * sizeof(int64));
+    qsort(sorted, num, sizeof(int64), int64_cmp);
+    uint32 unique = 1;
+    for (i = 1; i < num; i++)
+        if (sorted[i] != sorted[unique - 1])
+            sorted[unique++] = sorted[i];
+    *ids_num = unique;
+    return sorted;
+}
+
+int int64_cmp(const void *a, const void *b)
+{
+    int64 lhs = *(const int64 *)a;
+    int64 rhs = *(const int64 *)b;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+int index_chunk_cmp(const void *a, const void *b)
+{
+    int32 lhs = ((const index_chunk *)a)->chunk_no;
+    int32 rhs = ((const index_chunk *)b)->chunk_no;
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/**
+ * fetch_index_chunk
+ * faiss_chunk_fetch_fn of faiss_read_index_chunks(). it is called from C++ code,
+ * so errors are caught here and rethrown by the caller once faiss has unwound.
+ */
+int fetch_index_chunk(void *arg, size_t chunk_no, const void **data, size_t *size)
+{
+    chunk_reader *reader = (chunk_reader *)arg;
+    MemoryContext old_context = CurrentMemoryContext;
+    volatile int ret = 0;
+
+    PG_TRY();
+    {
+        if (reader->detoasted)
+        {
+            pfree(reader->detoasted);
+            reader->detoasted = NULL;
+        }
+
+        Datum raw = reader->chunks[chunk_no].chunk;
+        bytea *chunk = DatumGetByteaP(raw);
+        if ((Pointer)chunk != DatumGetPointer(raw))
+            reader->detoasted = chunk;
+
+        *data = VARDATA(chunk);
+        *size = VARSIZE(chunk) - VARHDRSZ;
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(old_context);
+        reader->edata = CopyErrorData();
+        FlushErrorState();
+        ret = -1;
+    }
+    PG_END_TRY();
+
+    return ret;
+}
+
+/**
+ * index_cache_key
+ * the cache key of the faiss index argument: the faiss_index_key argument if given,
+ * else one derived from the identity of the value according to vector_recall.auto_cache_key.
+ * a toasted index is keyed by its toast pointer, without detoasting it: an update of the row
+ * stores a new toast value, hence a new key. return NULL if the index is not to be cached.
+ */
+char *index_cache_key(FunctionCallInfo fcinfo, int index_argno, int key_argno)
+{
+    if (!PG_ARGISNULL(key_argno))
+        return cache_key_arg(fcinfo, key_argno);
+
+    if (PG_ARGISNULL(index_argno))
+        return NULL;
+    return datum_cache_key(PG_GETARG_DATUM(index_argno));
+}
+
+/**
+ * cache_key_arg
+ * the cache key of the faiss_index_key argument key_argno, tagged with vector_recall.cache_key_version.
+ * a query dispatches the same version to every segment, so it never mixes the shards of two versions.
+ */
+char *cache_key_arg(FunctionCallInfo fcinfo, int key_argno)
+{
+    return versioned_cache_key(text_to_cstring(PG_GETARG_TEXT_P(key_argno)));
+}
+
+/**
+ * versioned_cache_key
+ * key tagged with vector_recall.cache_key_version, see cache_key_arg(). key is freed if it is.
+ */
+char *versioned_cache_key(char *key)
+{
+    if (!cache_key_version || !cache_key_version[0])
+        return key;
+
+    char *versioned = psprintf("%s@%s", key, cache_key_version);
+    pfree(key);
+    return versioned;
+}
+
+/**
+ * datum_cache_key
+ * the cache key derived from the identity of a faiss index value, see index_cache_key().
+ */
+char *datum_cache_key(Datum index_datum)
+{
+    if (auto_cache_key == AUTO_CACHE_KEY_OFF)
+        return NULL;
+
+    struct varlena *attr = (struct varlena *)DatumGetPointer(index_datum);
+    if (VARATT_IS_EXTERNAL_ONDISK(attr))
+    {
+        struct varatt_external toast_pointer;
+        VARATT_EXTERNAL_GET_POINTER(toast_pointer, attr);
+        // toast value ids are unique within one database of one server, and the shared tier spans the host
+        return psprintf("toast:%d:%u:%u:%u:%d", PostPortNumber, MyDatabaseId, toast_pointer.va_toastrelid, toast_pointer.va_valueid, toast_pointer.va_rawsize);
+    }
+
+    if (auto_cache_key == AUTO_CACHE_KEY_FINGERPRINT)
+    {
+        // same sized indexes are common, shards share their structure: a 32-bit hash would collide
+        char hexsum[33];
+        bytea *index_bytea = DatumGetByteaP(index_datum);
+        uint32 size = VARSIZE(index_bytea) - VARHDRSZ;
+        if (!pg_md5_hash(VARDATA(index_bytea), size, hexsum))
+            ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("%s: out of memory", __func__)));
+        return psprintf("fingerprint:%u:%s", size, hexsum);
+    }
+
+    return NULL;
+}
+
+cache_t *get_cache(size_t capacity)
+{
+    static cache_t *cache = NULL;
+
+    if (capacity && cache)
+    {
+        ereport(WARNING, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: found cache(%p), now destroy it", __func__, cache)));
+        cache_destroy(cache);
+        cache = NULL;
+    }
+
+    if (!cache)
+    {
+        size_t cap = capacity ? capacity : (size_t)cache_capacity * 1024;
+        if (cache_policy_option == CACHE_POLICY_SLRU)
+        {
+            cache = cache_create_slru(cap, cache_shard_bits);
+            ereport(LOG, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: cache_create_slru(%zu, %d)=%p", __func__, cap, cache_shard_bits, cache)));
+        }
+        else if (cache_policy_option == CACHE_POLICY_CLOCK)
+        {
+            cache = cache_create_clock(cap, cache_shard_bits);
+            ereport(LOG, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: cache_create_clock(%zu, %d)=%p", __func__, cap, cache_shard_bits, cache)));
+        }
+        else
+        {
+            cache = cache_create_lru(cap, cache_shard_bits);
+            ereport(LOG, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: cache_create_lru(%zu, %d)=%p", __func__, cap, cache_shard_bits, cache)));
+        }
+        cache_set_admission_ratio(cache, cache_admission_percent / 100.0);
+    }
+
+    return cache;
+}
+
+/**
+ * unix_micros_to_timestamptz
+ * convert the timestamps of the cache, in microseconds since the unix epoch
+ */
+TimestampTz unix_micros_to_timestamptz(int64 micros)
+{
+    return TimestampTzPlusMilliseconds(time_t_to_timestamptz(micros / 1000000), (micros % 1000000) / 1000);
+}
+
+/**
+ * cache_lookup_or_load_item
+ * look the index of key up in the cache, loading it from index_datum on a miss. concurrent callers
+ * missing on the same key wait for a single load. errors raised by the load are rethrown here,
+ * once out of the cache.
+ */
+handle_t *cache_lookup_or_load_item(cache_t *cache, const char *key, Datum index_datum, bool index_isnull)
+{
+    cache_item_loader loader;
+    memset(&loader, 0, sizeof(loader));
+    loader.key = key;
+    loader.index_datum = index_datum;
+    loader.index_isnull = index_isnull;
+
+    cache_load_info info;
+    handle_t *handle = cache_lookup_or_load(cache, key, strlen(key), load_cache_item, &loader, cache_priority_option, cache_item_deleter, &info);
+    if (!handle)
+    {
+        if (loader.edata)
+            ReThrowError(loader.edata);
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: faiss index \"%s\" failed to load (%d) in %.3f s", __func__, key, info.error, info.seconds)));
+    }
+
+    if (info.loaded)
+        ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: cache miss: key:%s handle:%p charge:%zu load time:%.3f s", __func__, key, handle, ((cache_item *)cache_value(cache, handle))->charge, info.seconds)));
+    else if (info.waited)
+        ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: cache hit after waiting %.3f s for its load: key:%s handle:%p", __func__, info.seconds, key, handle)));
+    else
+        ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: cache hit: key:%s handle:%p", __func__, key, handle)));
+    return handle;
+}
+
+/**
+ * load_cache_item
+ * loader of cache_lookup_or_load_item(), called from the cache: errors must not longjmp out of it,
+ * they are saved in the cache_item_loader instead.
+ */
+int load_cache_item(void *arg, const char *key, size_t keylen, void **value, size_t *charge)
+{
+    cache_item_loader *loader = (cache_item_loader *)arg;
+    MemoryContext old_context = CurrentMemoryContext;
+    volatile int ret = 0;
+
+    PG_TRY();
+    {
+        if (loader->index_isnull)
+            ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED), errmsg("%s: faiss index \"%s\" is not cached and faiss_index is NULL", __func__, loader->key)));
+        cache_item *item = cache_item_load(loader->index_datum, key, keylen);
+        *value = item;
+        *charge = item->charge;
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(old_context);
+        loader->edata = CopyErrorData();
+        FlushErrorState();
+        ret = -1;
+    }
+    PG_END_TRY();
+
+    return ret;
+}
+
+/**
+ * cache_item_load
+ * load the index of a new cache entry. with vector_recall.index_store, the file of the current
+ * version of the index is opened if the segment has one, and materialized otherwise.
+ */
+cache_item *cache_item_load(Datum index_datum, const char *key, size_t keylen)
+{
+    if (!index_store)
+        return cache_item_read(index_datum, key, keylen);
+
+    char *version = datum_index_version(index_datum);
+    cache_item *item = index_store_open(key, keylen, version);
+    if (!item)
+    {
+        item = cache_item_read(index_datum, key, keylen);
+        index_store_save(key, keylen, version, item->index);
+    }
+    pfree(version);
+    return item;
+}
+
+/**
+ * cache_item_read
+ * deserialize the index of a new cache entry zero-copy, so that a cached index costs a single copy
+ * of the serialized bytes: either the image of the shared tier, mapped by every backend of the host,
+ * or the bytea detoasted directly into a long-lived memory context.
+ */
+cache_item *cache_item_read(Datum index_datum, const char *key, size_t keylen)
+{
+    bool zero_copy = faiss_read_index_buf_zero_copy();
+    cache_item *item = NULL;
+
+    shared_image_t *image = shared_image_load(index_datum, key, keylen);
+    if (image)
+    {
+        item = (cache_item *)MemoryContextAlloc(TopMemoryContext, sizeof(cache_item));
+        item->index = NULL;
+        item->context = NULL;
+        item->image = image;
+
+        PG_TRY();
+        {
+            FAISS_CHECK(faiss_read_index_buf(shared_image_data(image), shared_image_size(image), 2, zero_copy, &(item->index)));
+            // a mapping the index references is resident memory of this backend as well
+            item->charge = cache_item_charge(item->index, zero_copy ? shared_image_size(image) : 0);
+        }
+        PG_CATCH();
+        {
+            if (item->index)
+                faiss_Index_free(item->index);
+            shared_image_detach(image);
+            pfree(item);
+            PG_RE_THROW();
+        }
+        PG_END_TRY();
+
+        if (!zero_copy)
+        {
+            // nothing references the mapping
+            shared_image_detach(image);
+            item->image = NULL;
+        }
+        return item;
+    }
+
+    MemoryContext context = AllocSetContextCreate(TopMemoryContext, "vector_recall cache item", ALLOCSET_SMALL_MINSIZE, ALLOCSET_SMALL_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
+    MemoryContext old_context = MemoryContextSwitchTo(context);
+    item = (cache_item *)palloc(sizeof(cache_item));
+    item->context = context;
+    item->image = NULL;
+    item->index = NULL;
+
+    PG_TRY();
+    {
+        bytea *index_bytea = DatumGetByteaPCopy(index_datum);
+        item->index = bytea2faissindex(index_bytea, zero_copy);
+        item->charge = cache_item_charge(item->index, zero_copy ? VARSIZE(index_bytea) : 0);
+        if (!zero_copy)
+            pfree(index_bytea);
+    }
+    PG_CATCH();
+    {
+        if (item->index)
+            faiss_Index_free(item->index);
+        MemoryContextSwitchTo(old_context);
+        MemoryContextDelete(context);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    MemoryContextSwitchTo(old_context);
+    return item;
+}
+
+/**
+ * cache_item_charge
+ * the charge of a cache entry is the memory held by the deserialized index (codes, graph links,
+ * inverted lists, id maps...), which may be far from the serialized size, plus buffer_size bytes
+ * of serialized buffer the index keeps referencing after a zero-copy read.
+ */
+size_t cache_item_charge(FaissIndex *index, size_t buffer_size)
+{
+    size_t footprint = 0;
+    FAISS_CHECK(faiss_index_memory_footprint(index, &footprint));
+    return footprint + buffer_size;
+}
+
+/**
+ * shared_image_load
+ * attach the shared image of key, publishing it from index_datum first if no backend did yet.
+ * return NULL if the shared tier is disabled or unusable, the caller then falls back to a private copy.
+ */
+shared_image_t *shared_image_load(Datum index_datum, const char *key, size_t keylen)
+{
+    if (!shared_cache_dir || !shared_cache_dir[0])
+        return NULL;
+
+    char *image_key = shared_image_key(key);
+    size_t image_keylen = strlen(image_key);
+    shared_image_t *image = shared_image_attach(shared_cache_dir, image_key, image_keylen);
+    if (image)
+    {
+        ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: attached shared image of \"%s\"", __func__, key)));
+        return image;
+    }
+
+    bytea *index_bytea = DatumGetByteaP(index_datum);
+    if (shared_image_publish(shared_cache_dir, image_key, image_keylen, VARDATA(index_bytea), VARSIZE(index_bytea) - VARHDRSZ, (size_t)shared_cache_capacity * 1024) != 0)
+        ereport(WARNING, (errcode_for_file_access(), errmsg("%s: could not publish shared image of \"%s\" in \"%s\": %m", __func__, key, shared_cache_dir)));
+    else
+        image = shared_image_attach(shared_cache_dir, image_key, image_keylen);
+
+    if ((Pointer)index_bytea != DatumGetPointer(index_datum))
+        pfree(index_bytea);
+
+    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: published shared image of \"%s\": %p", __func__, key, image)));
+    return image;
+}
+
+/**
+ * shared_image_key
+ * the name of the shared image of key. the shared directory spans the host, where the segments of a
+ * cluster use the same keys for their own shards, so the key is qualified by the server and database.
+ */
+char *shared_image_key(const char *key)
+{
+    return psprintf("%d:%u:%s", PostPortNumber, MyDatabaseId, key);
+}
+
+/**
+ * cache_admit_item
+ * insert item under key into the cache, return whether the cache keeps it: it does not when item is
+ * charged more than the admission ratio of the capacity, e.g. when the capacity is 0. item is freed then.
+ */
+bool cache_admit_item(cache_t *cache, const char *key, cache_item *item)
+{
+    size_t keylen = strlen(key);
+    handle_t *handle = cache_insert_priority(cache, key, keylen, item, item->charge, cache_priority_option, cache_item_deleter);
+    // an entry not admitted is only referenced by handle, the lookup finds the previous entry of key if any
+    handle_t *cached = cache_lookup(cache, key, keylen);
+    bool admitted = cached && cache_value(cache, cached) == item;
+    if (cached)
+        cache_release(cache, cached);
+    cache_release(cache, handle);
+    return admitted;
+}
+
+/**
+ * remove_shared_image
+ * remove the shared image of key, return whether there was one. false if the shared tier is disabled.
+ */
+bool remove_shared_image(const char *key)
+{
+    if (!shared_cache_dir || !shared_cache_dir[0])
+        return false;
+
+    char *image_key = shared_image_key(key);
+    bool removed = shared_image_remove(shared_cache_dir, image_key, strlen(image_key)) > 0;
+    pfree(image_key);
+    return removed;
+}
+
+/**
+ * datum_index_version
+ * identify the content of index_datum, the index store only opens the file of the current version:
+ * updating the row stores the index under a new toast value, an inline index is hashed.
+ */
+char *datum_index_version(Datum index_datum)
+{
+    struct varlena *attr = (struct varlena *)DatumGetPointer(index_datum);
+    if (VARATT_IS_EXTERNAL_ONDISK(attr))
+    {
+        struct varatt_external toast_pointer;
+        VARATT_EXTERNAL_GET_POINTER(toast_pointer, attr);
+        return psprintf("toast:%u:%u:%u:%d", MyDatabaseId, toast_pointer.va_toastrelid, toast_pointer.va_valueid, toast_pointer.va_rawsize);
+    }
+
+    char hexsum[33];
+    bytea *index_bytea = DatumGetByteaP(index_datum);
+    uint32 size = VARSIZE(index_bytea) - VARHDRSZ;
+    if (!pg_md5_hash(VARDATA(index_bytea), size, hexsum))
+        ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("%s: out of memory", __func__)));
+    if ((Pointer)index_bytea != DatumGetPointer(index_datum))
+        pfree(index_bytea);
+    return psprintf("content:%u:%s", size, hexsum);
+}
+
+/**
+ * index_store_open
+ * open the stored file of key at version, memory mapped: its pages come from the page cache, shared
+ * by the backends and kept across restarts, so they are not charged. return NULL if there is none
+ * or if it can't be read, the caller then materializes it again.
+ */
+cache_item *index_store_open(const char *key, size_t keylen, const char *version)
+{
+    FaissIndex *index = NULL;
+    if (faiss_index_store_open(INDEX_STORE_DIR, key, keylen, version, 2, &index) != 0)
+    {
+        ereport(WARNING, (errcode(ERRCODE_DATA_CORRUPTED), errmsg("%s: could not open stored faiss index \"%s\": %s", __func__, key, faiss_get_last_error())));
+        return NULL;
+    }
+    if (!index)
+        return NULL;
+
+    cache_item *item = (cache_item *)MemoryContextAlloc(TopMemoryContext, sizeof(cache_item));
+    item->index = index;
+    item->context = NULL;
+    item->image = NULL;
+    item->charge = 0;
+
+    PG_TRY();
+    {
+        item->charge = cache_item_charge(index, 0);
+    }
+    PG_CATCH();
+    {
+        faiss_Index_free(index);
+        pfree(item);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: opened stored faiss index \"%s\" (%s)", __func__, key, version)));
+    return item;
+}
+
+/**
+ * index_store_save
+ * materialize index as the stored file of key at version, removing the files of its older versions.
+ * failing to store is not an error, the index is just read from the bytea next time.
+ */
+void index_store_save(const char *key, size_t keylen, const char *version, FaissIndex *index)
+{
+    if (faiss_index_store_save(INDEX_STORE_DIR, key, keylen, version, index, (size_t)index_store_capacity * 1024) != 0)
+        ereport(WARNING, (errcode_for_file_access(), errmsg("%s: could not store faiss index \"%s\" in \"%s\": %s", __func__, key, INDEX_STORE_DIR, faiss_get_last_error())));
+    else
+        ereport(DEBUG1, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: stored faiss index \"%s\" (%s)", __func__, key, version)));
+}
+
+void cache_item_deleter(const char *key, size_t keylen, void *value)
+{
+    cache_item *item = (cache_item *)value;
+    faiss_Index_free(item->index);
+    if (item->image)
+        shared_image_detach(item->image);
+    if (item->context)
+        MemoryContextDelete(item->context);
+    else
+        pfree(item);
+}
+
+/**
+ * warm-up
+ * the cache of a backend is private, and lost with it: a background worker per segment reads the
+ * faiss indexes registered in vector_recall_warm_list (vector_recall_register_warm()) from the
+ * segment's own rows, by decreasing priority and within vector_recall.warm_budget, and publishes
+ * them to the shared tier. the first search of every backend then maps the image instead of
+ * reading the toasted bytea. the worker warms up at startup and on vector_recall_warm().
+ */
+void warm_worker_register(void)
+{
+    RequestAddinShmemSpace(MAXALIGN(sizeof(warm_state)));
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = warm_shmem_startup;
+
+    // the master stores no faiss index
+    if (!warm_database || !warm_database[0] || IS_QUERY_DISPATCHER())
+        return;
+
+    BackgroundWorker worker;
+    memset(&worker, 0, sizeof(worker));
+    snprintf(worker.bgw_name, BGW_MAXLEN, "vector_recall cache warm-up");
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = 60;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "vector_recall");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "warm_worker_main");
+    RegisterBackgroundWorker(&worker);
+}
+
+void warm_shmem_startup(void)
+{
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    warm_shared_state = ShmemInitStruct("vector_recall warm-up", sizeof(warm_state), &found);
+    if (!found)
+    {
+        memset(warm_shared_state, 0, sizeof(warm_state));
+        SpinLockInit(&warm_shared_state->mutex);
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+void warm_sigterm(SIGNAL_ARGS)
+{
+    int save_errno = errno;
+    warm_got_sigterm = true;
+    SetLatch(&MyProc->procLatch);
+    errno = save_errno;
+}
+
+void warm_sighup(SIGNAL_ARGS)
+{
+    int save_errno = errno;
+    warm_got_sighup = true;
+    SetLatch(&MyProc->procLatch);
+    errno = save_errno;
+}
+
+void warm_worker_detach(int code, Datum arg)
+{
+    SpinLockAcquire(&warm_shared_state->mutex);
+    warm_shared_state->worker = NULL;
+    warm_shared_state->running = false;
+    SpinLockRelease(&warm_shared_state->mutex);
+}
+
+void warm_worker_main(Datum main_arg)
+{
+    pqsignal(SIGTERM, warm_sigterm);
+    pqsignal(SIGHUP, warm_sighup);
+    BackgroundWorkerUnblockSignals();
+
+    // only read the rows stored on this segment
+    Gp_role = GP_ROLE_UTILITY;
+    BackgroundWorkerInitializeConnection(warm_database, NULL);
+
+    SpinLockAcquire(&warm_shared_state->mutex);
+    warm_shared_state->worker = MyProc;
+    warm_shared_state->requested = true;
+    SpinLockRelease(&warm_shared_state->mutex);
+    on_shmem_exit(warm_worker_detach, 0);
+
+    for (;;)
+    {
+        ResetLatch(&MyProc->procLatch);
+        if (warm_got_sigterm)
+            break;
+
+        if (warm_got_sighup)
+        {
+            warm_got_sighup = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        SpinLockAcquire(&warm_shared_state->mutex);
+        bool requested = warm_shared_state->requested;
+        warm_shared_state->requested = false;
+        SpinLockRelease(&warm_shared_state->mutex);
+        if (requested)
+            warm_run();
+
+        int rc = WaitLatch(&MyProc->procLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH, 0L);
+        if (rc & WL_POSTMASTER_DEATH)
+            proc_exit(1);
+    }
+
+    proc_exit(1);
+}
+
+void warm_run(void)
+{
+    if (!shared_cache_dir || !shared_cache_dir[0])
+    {
+        ereport(LOG, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: vector_recall.shared_cache_dir is empty, nothing to warm up", __func__)));
+        return;
+    }
+
+    // past the capacity, publishing an index would evict the ones of higher priority
+    size_t budget = (size_t)warm_budget * 1024;
+    size_t capacity = (size_t)shared_cache_capacity * 1024;
+    if (capacity && (!budget || budget > capacity))
+        budget = capacity;
+
+    SpinLockAcquire(&warm_shared_state->mutex);
+    warm_shared_state->running = true;
+    warm_shared_state->started_at = GetCurrentTimestamp();
+    warm_shared_state->finished_at = 0;
+    warm_shared_state->indexes_total = 0;
+    warm_shared_state->indexes_warmed = 0;
+    warm_shared_state->indexes_cached = 0;
+    warm_shared_state->indexes_skipped = 0;
+    warm_shared_state->bytes = 0;
+    warm_shared_state->last_error[0] = '\0';
+    SpinLockRelease(&warm_shared_state->mutex);
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "vector_recall cache warm-up");
+
+    uint64 bytes = 0;
+    if (SPI_execute("SELECT extnamespace FROM pg_catalog.pg_extension WHERE extname = 'vector_recall'", true, 1) != SPI_OK_SELECT)
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: could not look up extension vector_recall", __func__)));
+    if (SPI_processed == 0)
+        ereport(LOG, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: extension vector_recall is not installed in database \"%s\"", __func__, warm_database)));
+    else
+    {
+        bool isnull;
+        Oid namespace_oid = DatumGetObjectId(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+        if (SPI_execute(psprintf("SELECT relid::text, index_col, key_col FROM %s ORDER BY priority DESC, relid, index_col", warm_list_table(namespace_oid)), true, 0) != SPI_OK_SELECT)
+            ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: could not read the warm-up list", __func__)));
+
+        // the values are allocated in the SPI procedure context, they outlive the subtransactions of warm_column()
+        SPITupleTable *list = SPI_tuptable;
+        uint64 list_num = SPI_processed;
+        for (uint64 i = 0; i < list_num && !warm_got_sigterm; ++i)
+        {
+            char *relname = SPI_getvalue(list->vals[i], list->tupdesc, 1);
+            char *index_col = SPI_getvalue(list->vals[i], list->tupdesc, 2);
+            char *key_col = SPI_getvalue(list->vals[i], list->tupdesc, 3);
+            warm_column(relname, index_col, key_col, budget, &bytes);
+        }
+    }
+
+    PopActiveSnapshot();
+    SPI_finish();
+    CommitTransactionCommand();
+    pgstat_report_activity(STATE_IDLE, NULL);
+
+    SpinLockAcquire(&warm_shared_state->mutex);
+    warm_shared_state->running = false;
+    warm_shared_state->finished_at = GetCurrentTimestamp();
+    SpinLockRelease(&warm_shared_state->mutex);
+    ereport(LOG, (errcode(ERRCODE_SUCCESSFUL_COMPLETION), errmsg("%s: warmed up %lu bytes of faiss indexes", __func__, bytes)));
+}
+
+/**
+ * warm_column
+ * warm up the indexes of one registered column in a subtransaction, so that a column that fails
+ * (e.g. its table was dropped) only skips that column.
+ */
+void warm_column(const char *relname, const char *index_col, const char *key_col, size_t budget, uint64 *bytes)
+{
+    MemoryContext old_context = CurrentMemoryContext;
+    ResourceOwner old_owner = CurrentResourceOwner;
+
+    BeginInternalSubTransaction(NULL);
+    MemoryContextSwitchTo(old_context);
+
+    PG_TRY();
+    {
+        warm_column_rows(relname, index_col, key_col, budget, bytes);
+
+        ReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(old_context);
+        CurrentResourceOwner = old_owner;
+        SPI_restore_connection();
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(old_context);
+        ErrorData *edata = CopyErrorData();
+        FlushErrorState();
+
+        RollbackAndReleaseCurrentSubTransaction();
+        MemoryContextSwitchTo(old_context);
+        CurrentResourceOwner = old_owner;
+        SPI_restore_connection();
+
+        ereport(WARNING, (errcode(edata->sqlerrcode), errmsg("%s: could not warm up %s.%s: %s", __func__, relname, index_col, edata->message)));
+        SpinLockAcquire(&warm_shared_state->mutex);
+        snprintf(warm_shared_state->last_error, sizeof(warm_shared_state->last_error), "%s.%s: %s", relname, index_col, edata->message);
+        SpinLockRelease(&warm_shared_state->mutex);
+        FreeErrorData(edata);
+    }
+    PG_END_TRY();
+}
+
+void warm_column_rows(const char *relname, const char *index_col, const char *key_col, size_t budget, uint64 *bytes)
+{
+    char *query = key_col ? psprintf("SELECT %s, %s::text FROM %s", quote_identifier(index_col), quote_identifier(key_col), relname)
+                          : psprintf("SELECT %s FROM %s", quote_identifier(index_col), relname);
+    if (SPI_execute(query, true, 0) != SPI_OK_SELECT)
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: could not read %s.%s", __func__, relname, index_col)));
+
+    SPITupleTable *rows = SPI_tuptable;
+    uint64 row_num = SPI_processed;
+    if (SPI_gettypeid(rows->tupdesc, 1) != BYTEAOID)
+        ereport(ERROR, (errcode(ERRCODE_DATATYPE_MISMATCH), errmsg("%s: %s.%s is not a bytea column", __func__, relname, index_col)));
+
+    SpinLockAcquire(&warm_shared_state->mutex);
+    warm_shared_state->indexes_total += row_num;
+    SpinLockRelease(&warm_shared_state->mutex);
+
+    // the indexes are detoasted one at a time
+    MemoryContext row_context = AllocSetContextCreate(CurrentMemoryContext, "vector_recall warm-up row", ALLOCSET_DEFAULT_MINSIZE, ALLOCSET_DEFAULT_INITSIZE, ALLOCSET_DEFAULT_MAXSIZE);
+    for (uint64 i = 0; i < row_num && !warm_got_sigterm; ++i)
+    {
+        MemoryContext old_context = MemoryContextSwitchTo(row_context);
+        warm_outcome outcome = WARM_SKIPPED;
+        bool isnull;
+        Datum index_datum = SPI_getbinval(rows->vals[i], rows->tupdesc, 1, &isnull);
+        if (!isnull)
+        {
+            // the keys of key_col are versioned as the searches version them, with the version of the configuration
+            char *key = NULL;
+            if (key_col)
+            {
+                key = SPI_getvalue(rows->vals[i], rows->tupdesc, 2);
+                if (key)
+                    key = versioned_cache_key(key);
+            }
+            else
+                key = datum_cache_key(index_datum);
+            if (key)
+                outcome = warm_index(index_datum, key, budget, bytes);
+        }
+        MemoryContextSwitchTo(old_context);
+        MemoryContextReset(row_context);
+
+        SpinLockAcquire(&warm_shared_state->mutex);
+        if (outcome == WARM_WARMED)
+            warm_shared_state->indexes_warmed++;
+        else if (outcome == WARM_CACHED)
+            warm_shared_state->indexes_cached++;
+        else
+            warm_shared_state->indexes_skipped++;
+        warm_shared_state->bytes = *bytes;
+        SpinLockRelease(&warm_shared_state->mutex);
+    }
+    MemoryContextDelete(row_context);
+}
+
+/**
+ * warm_index
+ * publish the image of one index unless it is already published, counting its size in *bytes.
+ */
+warm_outcome warm_index(Datum index_datum, const char *key, size_t budget, uint64 *bytes)
+{
+    // published under the name shared_image_load() attaches, the worker is connected to the database of the index
+    char *image_key = shared_image_key(key);
+    size_t keylen = strlen(image_key);
+    shared_image_t *image = shared_image_attach(shared_cache_dir, image_key, keylen);
+    if (image)
+    {
+        *bytes += shared_image_size(image);
+        shared_image_detach(image);
+        return WARM_CACHED;
+    }
+
+    // known without detoasting
+    size_t size = toast_raw_datum_size(index_datum) - VARHDRSZ;
+    if (budget && *bytes + size > budget)
+        return WARM_SKIPPED;
+
+    bytea *index_bytea = DatumGetByteaP(index_datum);
+    if (shared_image_publish(shared_cache_dir, image_key, keylen, VARDATA(index_bytea), VARSIZE(index_bytea) - VARHDRSZ, (size_t)shared_cache_capacity * 1024) != 0)
+    {
+        ereport(WARNING, (errcode_for_file_access(), errmsg("%s: could not publish shared image of \"%s\" in \"%s\": %m", __func__, key, shared_cache_dir)));
+        return WARM_SKIPPED;
+    }
+
+    *bytes += size;
+    return WARM_WARMED;
+}
+
+/**
+ * warm_list_table
+ * the qualified name of the warm-up list, which lives in the schema of the extension.
+ */
+char *warm_list_table(Oid namespace_oid)
+{
+    char *schema = get_namespace_name(namespace_oid);
+    if (!schema)
+        ereport(ERROR, (errcode(ERRCODE_UNDEFINED_SCHEMA), errmsg("%s: schema %u of vector_recall does not exist", __func__, namespace_oid)));
+    return quote_qualified_identifier(schema, "vector_recall_warm_list");
+}
+
+PG_FUNCTION_INFO_V1(vector_recall_register_warm);
+Datum vector_recall_register_warm(PG_FUNCTION_ARGS)
+{
+    CHECK(!PG_ARGISNULL(0));
+    Oid relid = PG_GETARG_OID(0);
+    CHECK(!PG_ARGISNULL(1));
+    Name index_col = PG_GETARG_NAME(1);
+    int32 priority = PG_ARGISNULL(3) ? 0 : PG_GETARG_INT32(3);
+
+    AttrNumber attnum = get_attnum(relid, NameStr(*index_col));
+    if (attnum == InvalidAttrNumber)
+        ereport(ERROR, (errcode(ERRCODE_UNDEFINED_COLUMN), errmsg("%s: column \"%s\" of relation \"%s\" does not exist", __func__, NameStr(*index_col), get_rel_name(relid))));
+    if (get_atttype(relid, attnum) != BYTEAOID)
+        ereport(ERROR, (errcode(ERRCODE_DATATYPE_MISMATCH), errmsg("%s: column \"%s\" of relation \"%s\" is not a bytea column", __func__, NameStr(*index_col), get_rel_name(relid))));
+    if (!PG_ARGISNULL(2) && get_attnum(relid, NameStr(*PG_GETARG_NAME(2))) == InvalidAttrNumber)
+        ereport(ERROR, (errcode(ERRCODE_UNDEFINED_COLUMN), errmsg("%s: column \"%s\" of relation \"%s\" does not exist", __func__, NameStr(*PG_GETARG_NAME(2)), get_rel_name(relid))));
+
+    Oid argtypes[4] = {REGCLASSOID, NAMEOID, NAMEOID, INT4OID};
+    Datum values[4] = {ObjectIdGetDatum(relid), NameGetDatum(index_col), PG_ARGISNULL(2) ? (Datum)0 : PG_GETARG_DATUM(2), Int32GetDatum(priority)};
+    char nulls[4] = {' ', ' ', PG_ARGISNULL(2) ? 'n' : ' ', ' '};
+
+    char *table = warm_list_table(get_func_namespace(fcinfo->flinfo->fn_oid));
+    SPI_connect();
+    if (SPI_execute_with_args(psprintf("DELETE FROM %s WHERE relid = $1 AND index_col = $2", table), 2, argtypes, values, nulls, false, 0) != SPI_OK_DELETE ||
+        SPI_execute_with_args(psprintf("INSERT INTO %s VALUES ($1, $2, $3, $4)", table), 4, argtypes, values, nulls, false, 0) != SPI_OK_INSERT)
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: could not update %s", __func__, table)));
+    SPI_finish();
+
+    PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(vector_recall_unregister_warm);
+Datum vector_recall_unregister_warm(PG_FUNCTION_ARGS)
+{
+    Oid argtypes[2] = {REGCLASSOID, NAMEOID};
+    Datum values[2] = {PG_GETARG_DATUM(0), PG_GETARG_DATUM(1)};
+
+    char *table = warm_list_table(get_func_namespace(fcinfo->flinfo->fn_oid));
+    SPI_connect();
+    if (SPI_execute_with_args(psprintf("DELETE FROM %s WHERE relid = $1 AND index_col = $2", table), 2, argtypes, values, NULL, false, 0) != SPI_OK_DELETE)
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("%s: could not update %s", __func__, table)));
+    bool removed = SPI_processed > 0;
+    SPI_finish();
+
+    PG_RETURN_BOOL(removed);
+}
+
+PG_FUNCTION_INFO_V1(vector_recall_warm);
+Datum vector_recall_warm(PG_FUNCTION_ARGS)
+{
+    if (!warm_shared_state)
+        PG_RETURN_BOOL(false);
+
+    SpinLockAcquire(&warm_shared_state->mutex);
+    PGPROC *worker = warm_shared_state->worker;
+    if (worker)
+        warm_shared_state->requested = true;
+    SpinLockRelease(&warm_shared_state->mutex);
+
+    if (worker)
+        SetLatch(&worker->procLatch);
+    PG_RETURN_BOOL(worker != NULL);
+}
+
+PG_FUNCTION_INFO_V1(vector_recall_warm_progress);
+Datum vector_recall_warm_progress(PG_FUNCTION_ARGS)
+{
+    TupleDesc tupdesc;
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("function returning record called in context that cannot accept type record")));
+
+    if (!warm_shared_state)
+        PG_RETURN_NULL();
+
+    warm_state state;
+    SpinLockAcquire(&warm_shared_state->mutex);
+    memcpy(&state, warm_shared_state, sizeof(state));
+    SpinLockRelease(&warm_shared_state->mutex);
+
+    Datum values[9];
+    bool nulls[9] = {false, state.started_at == 0, state.finished_at == 0, false, false, false, false, false, state.last_error[0] == '\0'};
+    values[0] = BoolGetDatum(state.running);
+    values[1] = TimestampTzGetDatum(state.started_at);
+    values[2] = TimestampTzGetDatum(state.finished_at);
+    values[3] = Int32GetDatum(state.indexes_total);
+    values[4] = Int32GetDatum(state.indexes_warmed);
+    values[5] = Int32GetDatum(state.indexes_cached);
+    values[6] = Int32GetDatum(state.indexes_skipped);
+    values[7] = Int64GetDatum(state.bytes);
+    values[8] = CStringGetTextDatum(state.last_error);
+
+    HeapTuple tuple = heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls);
+    PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
 }